@@ -0,0 +1,222 @@
+#include "mish.h"
+#include <ctime>
+#include <sys/time.h> // For timersub
+using namespace std;
+
+// Number of pipelines accounted so far, used to group stages in the log
+static long pipelineCounter = 0;
+
+// Function to read the monotonic clock in seconds
+double monotonicNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Function to convert a timeval to seconds
+static double seconds(const struct timeval &tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Function to escape a string for use inside a JSON string literal
+string jsonEscape(string_view text)
+{
+    string out;
+    out.reserve(text.size() + 2);
+    for (unsigned char c : text)
+    {
+        switch (c)
+        {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if (c < 0x20)
+            {
+                char buffer[8];
+                snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                out += buffer;
+            }
+            else
+            {
+                out += static_cast<char>(c);
+            }
+        }
+    }
+    return out;
+}
+
+// Function to join a command's tokens for display
+static string commandText(const Command &cmd)
+{
+    string text;
+    for (const auto &token : cmd.tokens)
+    {
+        text += text.empty() ? "" : " ";
+        text += token;
+    }
+    return text;
+}
+
+// Function to append one JSON line per stage to the file named by MISH_RUSAGE_LOG
+static void logUsage(const Command *pipeline, const vector<pid_t> &pids,
+                     const vector<StageResult> &results)
+{
+    string path = env.get("MISH_RUSAGE_LOG");
+    if (path.empty())
+        return;
+
+    ofstream log(path, ios::app);
+    if (!log)
+    {
+        handleError("Cannot open rusage log " + path);
+        errno = 0;
+        return;
+    }
+
+    long timestamp = static_cast<long>(time(nullptr));
+    for (size_t i = 0; i < pids.size(); i++)
+    {
+        const StageResult &r = results[i];
+        log << "{\"ts\":" << timestamp
+            << ",\"pipeline\":" << pipelineCounter
+            << ",\"stage\":" << i
+            << ",\"pid\":" << pids[i]
+            << ",\"argv\":[";
+        for (size_t t = 0; t < pipeline[i].tokens.size(); t++)
+        {
+            log << (t ? "," : "") << "\"" << jsonEscape(pipeline[i].tokens[t]) << "\"";
+        }
+        log << "],\"status\":" << exitStatusOf(r.status)
+            << fixed << setprecision(6)
+            << ",\"wall_s\":" << r.wall
+            << ",\"user_s\":" << seconds(r.usage.ru_utime)
+            << ",\"sys_s\":" << seconds(r.usage.ru_stime)
+            << ",\"maxrss_kb\":" << r.usage.ru_maxrss
+            << ",\"nvcsw\":" << r.usage.ru_nvcsw
+            << ",\"nivcsw\":" << r.usage.ru_nivcsw
+            << ",\"minflt\":" << r.usage.ru_minflt
+            << ",\"majflt\":" << r.usage.ru_majflt
+            << "}\n";
+    }
+}
+
+// Function to print the per-stage breakdown requested with the 'time' prefix
+static void printUsage(const Command *pipeline, const vector<StageResult> &results, double wall)
+{
+    double user = 0, sys = 0;
+    cerr << left << setw(6) << "stage" << setw(10) << "wall" << setw(10) << "user" << setw(10) << "sys"
+         << setw(10) << "maxrss" << setw(8) << "vcsw" << setw(8) << "ivcsw" << setw(9) << "minflt"
+         << setw(8) << "majflt" << "command" << endl;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const StageResult &r = results[i];
+        user += seconds(r.usage.ru_utime);
+        sys += seconds(r.usage.ru_stime);
+
+        ostringstream w, u, s;
+        w << fixed << setprecision(3) << r.wall << "s";
+        u << fixed << setprecision(3) << seconds(r.usage.ru_utime) << "s";
+        s << fixed << setprecision(3) << seconds(r.usage.ru_stime) << "s";
+        cerr << setw(6) << i + 1 << setw(10) << w.str() << setw(10) << u.str() << setw(10) << s.str()
+             << setw(10) << (to_string(r.usage.ru_maxrss) + "K") << setw(8) << r.usage.ru_nvcsw
+             << setw(8) << r.usage.ru_nivcsw << setw(9) << r.usage.ru_minflt << setw(8) << r.usage.ru_majflt
+             << commandText(pipeline[i]) << endl;
+    }
+    cerr << right << fixed << setprecision(3) << "real " << wall << "s  user " << user << "s  sys " << sys
+         << "s" << endl;
+    cerr.unsetf(ios::fixed);
+}
+
+// Function to record resource usage for a finished foreground pipeline.
+// 'timed' prints the breakdown, MISH_RUSAGE_LOG appends it as JSON lines.
+void accountPipeline(const Command *pipeline, const vector<pid_t> &pids,
+                     const vector<StageResult> &results, double wall, bool timed)
+{
+    pipelineCounter++;
+    if (timed)
+    {
+        printUsage(pipeline, results, wall);
+    }
+    logUsage(pipeline, pids, results);
+}
+
+// Function to print what passed through each metered link of a pipeline (|> or
+// MISH_PIPESTATS=1). A relay waiting to read is waiting for the stage before it; waiting to
+// write, for the stage after it. The stage its neighbours waited on longest is the bottleneck.
+void printPipeStats(const Command *pipeline, const vector<ShellStage> &stages)
+{
+    int slowest = -1;
+    double slowestWait = 0;
+    unordered_map<int, double> waitedOn; // Stage -> seconds its neighbours spent waiting on it
+
+    cerr << left << setw(6) << "link" << setw(12) << "bytes" << setw(12) << "MB/s" << setw(12) << "read-wait"
+         << setw(12) << "write-wait" << "stages" << endl;
+    for (const auto &stage : stages)
+    {
+        if (stage.kind != ShellStageKind::Relay)
+            continue;
+        int i = stage.index;
+        double rate = stage.wall > 0 ? stage.bytes / stage.wall / 1e6 : 0;
+        ostringstream r, rw, ww;
+        r << fixed << setprecision(1) << rate;
+        rw << fixed << setprecision(3) << stage.readWait << "s";
+        ww << fixed << setprecision(3) << stage.writeWait << "s";
+        cerr << setw(6) << i + 1 << setw(12) << stage.bytes << setw(12) << r.str() << setw(12) << rw.str()
+             << setw(12) << ww.str() << pipeline[i].tokens[0] << " -> " << pipeline[i + 1].tokens[0] << endl;
+
+        for (int j : {i, i + 1})
+        {
+            double &wait = waitedOn[j];
+            wait += j == i ? stage.readWait : stage.writeWait;
+            if (wait > slowestWait)
+            {
+                slowestWait = wait;
+                slowest = j;
+            }
+        }
+    }
+    if (slowest != -1)
+    {
+        cerr << "bottleneck: stage " << slowest + 1 << " (" << pipeline[slowest].tokens[0] << "), waited on for "
+             << fixed << setprecision(3) << slowestWait << "s" << endl;
+    }
+    cerr << right;
+    cerr.unsetf(ios::fixed);
+}
+
+// Function to time a built-in that runs inside the shell, using the shell's own rusage
+int timeBuiltIn(const Command &cmd)
+{
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    double start = monotonicNow();
+
+    int status = executeBuiltInRedirected(cmd);
+
+    StageResult result;
+    getrusage(RUSAGE_SELF, &after);
+    result.status = status << 8;
+    result.wall = monotonicNow() - start;
+    result.usage = after;
+    timersub(&after.ru_utime, &before.ru_utime, &result.usage.ru_utime);
+    timersub(&after.ru_stime, &before.ru_stime, &result.usage.ru_stime);
+    result.usage.ru_nvcsw = after.ru_nvcsw - before.ru_nvcsw;
+    result.usage.ru_nivcsw = after.ru_nivcsw - before.ru_nivcsw;
+    result.usage.ru_minflt = after.ru_minflt - before.ru_minflt;
+    result.usage.ru_majflt = after.ru_majflt - before.ru_majflt;
+
+    accountPipeline(&cmd, {getpid()}, {result}, result.wall, true);
+    return status;
+}
@@ -0,0 +1,49 @@
+#include "mish.h"
+using namespace std;
+
+// Smallest block the arena allocates
+static const size_t ARENA_MIN_BLOCK = 4096;
+
+// Function to hand out 'size' bytes, adding a block when the last one is full
+char *Arena::allocate(size_t size)
+{
+    if (blocks.empty() || blocks.back().size - used < size)
+    {
+        // Grow geometrically so a long line settles after a few resets
+        size_t blockSize = max(max(size, total), ARENA_MIN_BLOCK);
+        blocks.push_back({unique_ptr<char[]>(new char[blockSize]), blockSize});
+        total += blockSize;
+        used = 0;
+    }
+
+    char *memory = blocks.back().data.get() + used;
+    used += size;
+    return memory;
+}
+
+// Function to copy a string into the arena with a terminating NUL
+string_view Arena::copy(string_view text)
+{
+    char *memory = allocate(text.size() + 1);
+    memcpy(memory, text.data(), text.size());
+    memory[text.size()] = '\0';
+    return string_view(memory, text.size());
+}
+
+// Function to free everything in the arena. Several blocks are merged into one of the same
+// total size, so the next line of the same length fits without allocating.
+void Arena::reset()
+{
+    if (blocks.size() > 1)
+    {
+        blocks.clear();
+        blocks.push_back({unique_ptr<char[]>(new char[total]), total});
+    }
+    used = 0;
+}
+
+// Function to get the number of bytes owned by the arena
+size_t Arena::capacity() const
+{
+    return total;
+}
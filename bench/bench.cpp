@@ -0,0 +1,1289 @@
+// Benchmark harness for mish. Links the shell core from libmish.a and measures the
+// tokenizer, the parser, process spawning, pipeline throughput, script mode and globbing.
+// Global operator new is replaced to count heap allocations on the parse path.
+//
+// Usage: mish_bench [--out results.jsonl] [--only name]
+//        mish_bench --compare baseline.jsonl results.jsonl [--threshold percent]
+//        mish_bench --fuzz iterations [--seed n]
+//
+// Results are JSON lines, one benchmark per line:
+//   {"name":"tokenize","value":123.4,"unit":"MB/s","better":"higher"}
+
+#include "../mish.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <dirent.h>
+#include <new>
+#include <random>
+#include <sys/mman.h>
+#include <sys/stat.h>
+using namespace std;
+
+// Number of heap allocations made by the process
+static atomic<unsigned long> allocationCount(0);
+
+// Counting replacements for the global allocation functions
+void *operator new(size_t size)
+{
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    if (void *memory = malloc(size == 0 ? 1 : size))
+        return memory;
+    throw bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void *memory, size_t) noexcept
+{
+    free(memory);
+}
+
+// One benchmark result
+struct BenchResult
+{
+    string name;
+    double value;
+    string unit;
+    bool higherIsBetter;
+};
+
+// Function to read a steady clock in seconds
+static double now()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Function to build a long synthetic command line with quotes, escapes and operators
+static string syntheticLine(size_t targetBytes)
+{
+    string line = "cmd";
+    size_t i = 0;
+    while (line.size() < targetBytes)
+    {
+        switch (i % 8)
+        {
+        case 0:
+            line += " /var/log/service/archive/file_" + to_string(i) + ".log";
+            break;
+        case 1:
+            line += " \"quoted argument " + to_string(i) + "\"";
+            break;
+        case 2:
+            line += " escaped\\ space\\\"" + to_string(i);
+            break;
+        case 3:
+            line += " --option=value" + to_string(i);
+            break;
+        case 4:
+            line += " | filter" + to_string(i);
+            break;
+        case 5:
+            line += " > out" + to_string(i) + ".txt";
+            break;
+        case 6:
+            line += " ; next" + to_string(i);
+            break;
+        default:
+            line += "\targ" + to_string(i);
+            break;
+        }
+        i++;
+    }
+    return line;
+}
+
+// Function to build a line with a long argument list of file paths, as generated scripts have
+static string pathsLine(int count)
+{
+    string line = "tar -czf backup.tgz";
+    for (int i = 0; i < count; i++)
+    {
+        line += " /srv/data/projects/mish/build/output/objects/module_" + to_string(i) + "/component.o";
+    }
+    return line;
+}
+
+// Function to measure tokenizer throughput in MB/s for one line with a given lexer backend
+static double tokenizeRate(const string &line, LexerBackend backend)
+{
+    LexerBackend saved = lexerBackend;
+    lexerBackend = backend;
+    CommandLine parsed;
+    int iterations = 0;
+    double start = now();
+    double elapsed = 0;
+    while (elapsed < 1.0)
+    {
+        tokenize(line, parsed);
+        iterations++;
+        elapsed = now() - start;
+    }
+    lexerBackend = saved;
+    return line.size() * iterations / elapsed / 1e6;
+}
+
+// Tokenizer throughput in MB/s on a 1 MiB line, with the lexer backend picked at startup
+static BenchResult benchTokenize()
+{
+    return {"tokenize", tokenizeRate(syntheticLine(1 << 20), lexerBackend), "MB/s", true};
+}
+
+// Tokenizer throughput on the same line with the scalar lexer, for comparison
+static BenchResult benchTokenizeScalar()
+{
+    return {"tokenize_scalar", tokenizeRate(syntheticLine(1 << 20), LexerBackend::Scalar), "MB/s", true};
+}
+
+// Tokenizer throughput in MB/s on a 5000-path argument list
+static BenchResult benchTokenizePaths()
+{
+    return {"tokenize_paths", tokenizeRate(pathsLine(5000), lexerBackend), "MB/s", true};
+}
+
+// parseTokens throughput in tokens per second (without validation errors)
+static BenchResult benchParse()
+{
+    // Keep redirections out so every command validates
+    string line;
+    for (int i = 0; i < 20000; i++)
+    {
+        line += "cmd" + to_string(i) + " arg1 \"arg two\" --flag=" + to_string(i);
+        line += (i % 3 == 0) ? " | " : " ; ";
+    }
+    line += "last";
+    CommandLine parsed;
+    tokenize(line, parsed);
+
+    int iterations = 0;
+    double start = now();
+    double elapsed = 0;
+    while (elapsed < 1.0)
+    {
+        parseTokens(parsed);
+        iterations++;
+        elapsed = now() - start;
+    }
+    return {"parse", parsed.tokens.size() * iterations / elapsed / 1e6, "Mtokens/s", true};
+}
+
+// Heap allocations per line of tokenize + parseTokens once the CommandLine is warm
+static BenchResult benchParseAllocs()
+{
+    const vector<string> lines = {
+        "ls -l /usr/bin | grep \"^-rwx\" | sort -k5 -n > /tmp/listing.txt",
+        "cat < input.txt | tr a-z A-Z >> output.txt ; echo done &",
+        "printf \"%s %d\\n\" name 42 ; VAR=value ; test -f file\\ name",
+        syntheticLine(4096),
+    };
+
+    // Warm up: the arena and vectors grow to fit the longest line
+    CommandLine parsed;
+    for (const auto &line : lines)
+    {
+        tokenize(line, parsed);
+        parseTokens(parsed);
+    }
+
+    const int rounds = 10000;
+    unsigned long before = allocationCount.load();
+    for (int i = 0; i < rounds; i++)
+    {
+        const string &line = lines[i % lines.size()];
+        tokenize(line, parsed);
+        parseTokens(parsed);
+    }
+    unsigned long allocations = allocationCount.load() - before;
+    return {"parse_allocs", static_cast<double>(allocations) / rounds, "allocs/line", false};
+}
+
+// Function to measure the spawn latency of /bin/true through spawnCommand, median in microseconds
+static double spawnLatency()
+{
+    CommandLine parsed;
+    tokenize("/bin/true", parsed);
+    parseTokens(parsed);
+    const Command &cmd = parsed.commands[0];
+    StageIO io;
+
+    vector<double> samples;
+    for (int i = 0; i < 300; i++)
+    {
+        double start = now();
+        pid_t pid = spawnCommand(cmd, io);
+        int status;
+        waitpid(pid, &status, 0);
+        samples.push_back((now() - start) * 1e6);
+    }
+    sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+}
+
+// Spawn latency of /bin/true with the configured backend
+static BenchResult benchSpawn()
+{
+    return {"spawn_true", spawnLatency(), "us", false};
+}
+
+// Spawn latency of /bin/true through the zygote, to compare with spawn_true
+static BenchResult benchSpawnZygote()
+{
+    SpawnBackend saved = spawnBackend;
+    if (!startZygote())
+    {
+        throw ShellError("cannot start the zygote");
+    }
+    spawnBackend = SpawnBackend::Zygote;
+    double latency = spawnLatency();
+    spawnBackend = saved;
+    stopZygote();
+    return {"spawn_true_zygote", latency, "us", false};
+}
+
+// Rate of the 'parallel' built-in running /bin/true for 2000 items, summary discarded
+static BenchResult benchParallel()
+{
+    char path[] = "/tmp/mish_bench_items_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        throw ShellError("cannot create parallel input file");
+    }
+    string items;
+    for (int i = 0; i < 2000; i++)
+    {
+        items += to_string(i) + "\n";
+    }
+    bool written = write(fd, items.data(), items.size()) == static_cast<ssize_t>(items.size());
+    close(fd);
+    if (!written)
+    {
+        unlink(path);
+        throw ShellError("cannot write parallel input file");
+    }
+
+    CommandLine line;
+    tokenize(string("parallel -a ") + path + " true", line);
+    parseTokens(line);
+    int saved = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    close(null);
+    double start = now();
+    executeBuiltIn(line.commands[0]);
+    double elapsed = now() - start;
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+    unlink(path);
+    return {"parallel_true_2k", 2000 / elapsed, "items/s", true};
+}
+
+// Function to measure the throughput of 'cat < file | cat | cat > /dev/null' in MB/s, with
+// the environment variable 'name' set to 'value' meanwhile
+static double pipelineRate(const string &name, const string &value)
+{
+    char path[] = "/tmp/mish_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        throw ShellError("cannot create pipeline input file");
+    }
+    string block(1 << 20, 'x');
+    const size_t totalBytes = 64u << 20;
+    for (size_t written = 0; written < totalBytes; written += block.size())
+    {
+        if (write(fd, block.data(), block.size()) != static_cast<ssize_t>(block.size()))
+        {
+            close(fd);
+            unlink(path);
+            throw ShellError("cannot write pipeline input file");
+        }
+    }
+    close(fd);
+
+    CommandLine pipeline;
+    tokenize(string("cat < ") + path + " | cat | cat > /dev/null", pipeline);
+    parseTokens(pipeline);
+    env.set(name, value);
+    double best = 1e9;
+    for (int run = 0; run < 3; run++)
+    {
+        double start = now();
+        executePipeline(pipeline.commands.data(), pipeline.commands.size());
+        best = min(best, now() - start);
+    }
+    env.unset(name);
+    unlink(path);
+    return totalBytes / best / 1e6;
+}
+
+// Pipeline throughput with the first and last 'cat' run by the shell with splice
+static BenchResult benchPipeline()
+{
+    return {"pipeline_cat3", pipelineRate("MISH_SPLICE", "1"), "MB/s", true};
+}
+
+// Pipeline throughput with every stage a process, as before splice stages
+static BenchResult benchPipelineSpawned()
+{
+    return {"pipeline_cat3_spawned", pipelineRate("MISH_SPLICE", "0"), "MB/s", true};
+}
+
+// Pipeline throughput with splice stages and 1 MiB pipe buffers
+static BenchResult benchPipelineLargePipes()
+{
+    return {"pipeline_cat3_1m", pipelineRate("MISH_PIPESIZE", "1M"), "MB/s", true};
+}
+
+// Pipeline throughput with both links metered by relays, the per-link report discarded
+static BenchResult benchPipelineMetered()
+{
+    int saved = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    close(null);
+    double rate = pipelineRate("MISH_PIPESTATS", "1");
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+    return {"pipeline_cat3_metered", rate, "MB/s", true};
+}
+
+// Function to write the 100k-line benchmark script, returns its path
+static string writeBenchScript(int lines)
+{
+    char path[] = "/tmp/mish_bench_script_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        throw ShellError("cannot create benchmark script");
+    }
+    string script;
+    for (int i = 0; i < lines; i++)
+    {
+        switch (i % 4)
+        {
+        case 0:
+            script += "BENCH_VAR=value" + to_string(i) + "\n";
+            break;
+        case 1:
+            script += "true\n";
+            break;
+        case 2:
+            script += "echo line " + to_string(i) + " > /dev/null\n";
+            break;
+        default:
+            script += "# comment line\n";
+            break;
+        }
+    }
+    bool ok = write(fd, script.data(), script.size()) == static_cast<ssize_t>(script.size());
+    close(fd);
+    if (!ok)
+    {
+        unlink(path);
+        throw ShellError("cannot write benchmark script");
+    }
+    return path;
+}
+
+// End-to-end script mode over a 100k-line script of built-ins read line by line, in lines per second
+static BenchResult benchScript()
+{
+    const int lines = 100000;
+    string path = writeBenchScript(lines);
+    env.set("MISH_SCRIPT_CACHE", "0");
+    double start = now();
+    scriptMode(path);
+    double elapsed = now() - start;
+    env.unset("MISH_SCRIPT_CACHE");
+    unlink(path.c_str());
+    return {"script_100k", lines / elapsed, "lines/s", true};
+}
+
+// The same script run from a warm script cache entry
+static BenchResult benchScriptCached()
+{
+    const int lines = 100000;
+    string path = writeBenchScript(lines);
+    if (!precompileScript(path))
+    {
+        unlink(path.c_str());
+        throw ShellError("cannot compile benchmark script");
+    }
+    double start = now();
+    scriptMode(path);
+    double elapsed = now() - start;
+    unlink(path.c_str());
+    return {"script_100k_cached", lines / elapsed, "lines/s", true};
+}
+
+// A 1M-iteration 'for' loop over a built-in, in iterations per second. The body is parsed once,
+// so this is the interpreter's cost per pass.
+static BenchResult benchLoop()
+{
+    char path[] = "/tmp/mish_bench_loop_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        throw ShellError("cannot create benchmark script");
+    }
+    const long iterations = 1000000;
+    string script = "for i in {1.." + to_string(iterations) + "}\ndo\n    true\ndone\n";
+    bool ok = write(fd, script.data(), script.size()) == static_cast<ssize_t>(script.size());
+    close(fd);
+    if (!ok)
+    {
+        unlink(path);
+        throw ShellError("cannot write benchmark script");
+    }
+
+    env.set("MISH_SCRIPT_CACHE", "0");
+    double start = now();
+    scriptMode(path);
+    double elapsed = now() - start;
+    env.unset("MISH_SCRIPT_CACHE");
+    env.unset("i");
+    unlink(path);
+    return {"loop_1m", iterations / elapsed, "iterations/s", true};
+}
+
+// Time in us per 'printf "%600s|\n" x' run by the shell. The output is checked, since a field
+// wider than any fixed buffer must come out whole.
+static BenchResult benchPrintfWide()
+{
+    CommandLine line;
+    tokenize("printf \"%600s|\\\\n\" x", line);
+    parseTokens(line);
+    cout << flush;
+    int saved = dup(STDOUT_FILENO);
+    int output = memfd_create("mish-bench-printf", MFD_CLOEXEC);
+    dup2(output, STDOUT_FILENO);
+
+    const int runs = 1000;
+    double start = now();
+    for (int i = 0; i < runs; i++)
+    {
+        vector<Command> commands = line.commands;
+        executeCommands(commands);
+    }
+    cout << flush;
+    double elapsed = now() - start;
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    string expected = string(599, ' ') + "x|\n";
+    string text(expected.size() * runs + 1, '\0');
+    ssize_t count = pread(output, &text[0], text.size(), 0);
+    close(output);
+    text.resize(count > 0 ? count : 0);
+    for (int i = 0; i < runs; i++)
+    {
+        if (text.compare(i * expected.size(), expected.size(), expected) != 0)
+        {
+            throw ShellError("printf wrote a wide field wrong");
+        }
+    }
+    if (text.size() != expected.size() * runs)
+    {
+        throw ShellError("printf wrote a wide field wrong");
+    }
+    return {"printf_wide", elapsed / runs * 1e6, "us", false};
+}
+
+// Reference tokenizer: the byte-at-a-time loop the lexer backends have to agree with
+static vector<string> referenceTokenize(const string &input)
+{
+    vector<string> tokens;
+    string current;
+    bool inQuotes = false;
+    bool escaped = false;
+
+    for (size_t i = 0; i < input.length(); i++)
+    {
+        char c = input[i];
+        if (c == VAR_MARK)
+        {
+            current += string(2, VAR_MARK);
+            escaped = false;
+            continue;
+        }
+        if (escaped)
+        {
+            current += c;
+            escaped = false;
+            continue;
+        }
+        if (c == '\\')
+        {
+            escaped = true;
+            continue;
+        }
+        if (c == '"')
+        {
+            inQuotes = !inQuotes;
+            continue;
+        }
+        if (c == '$' && i + 1 < input.length())
+        {
+            // $? $$ $NAME ${NAME}
+            string name;
+            size_t skip = 0;
+            char next = input[i + 1];
+            bool braced = next == '{';
+            size_t j = i + 1 + braced;
+            while (j < input.length() && (isalnum(static_cast<unsigned char>(input[j])) || input[j] == '_'))
+            {
+                name += input[j++];
+            }
+            if (next == '?' || next == '$')
+            {
+                name = string(1, '$') + next;
+                skip = 1;
+            }
+            else if (!name.empty() && !isdigit(static_cast<unsigned char>(name[0])) &&
+                     (!braced || (j < input.length() && input[j] == '}')))
+            {
+                skip = name.size() + (braced ? 2 : 0);
+            }
+            if (skip > 0)
+            {
+                current += VAR_MARK + name + VAR_MARK;
+                i += skip;
+                continue;
+            }
+        }
+        if (!inQuotes && (c == '*' || c == '?' || c == '['))
+        {
+            // A run of '*', a '?', or a bracket expression closed before any separator
+            size_t j = i + 1;
+            if (c == '*')
+            {
+                while (j < input.length() && input[j] == '*')
+                    j++;
+            }
+            else if (c == '[')
+            {
+                j += j < input.length() && (input[j] == '!' || input[j] == '^');
+                j += j < input.length() && input[j] == ']';
+                while (j < input.length() && input[j] != ']' && string("|<>&; \t\"\\$/\x01").find(input[j]) == string::npos)
+                    j++;
+                j = j < input.length() && input[j] == ']' ? j + 1 : 0;
+            }
+            if (j > 0)
+            {
+                current += VAR_MARK + input.substr(i, j - i) + VAR_MARK;
+                i = j - 1;
+                continue;
+            }
+        }
+        if (!inQuotes && (c == '|' || c == '>' || c == '<' || c == '&' || c == ';'))
+        {
+            if (!current.empty())
+            {
+                tokens.push_back(current);
+                current.clear();
+            }
+            size_t close = c == '|' && i + 1 < input.length() && input[i + 1] == '[' ? input.find(']', i) : string::npos;
+            bool sized = close != string::npos && close > i + 2;
+            for (size_t j = i + 2; sized && j < close; j++)
+            {
+                bool digit = isdigit(static_cast<unsigned char>(input[j]));
+                sized = digit || (j + 1 == close && j > i + 2 && string("kKmMgG").find(input[j]) != string::npos);
+            }
+            if (c == '>' && i + 1 < input.length() && input[i + 1] == '>')
+            {
+                tokens.push_back(">>");
+                i++;
+            }
+            else if (c == '|' && i + 1 < input.length() && input[i + 1] == '>')
+            {
+                tokens.push_back("|>");
+                i++;
+            }
+            else if (sized)
+            {
+                tokens.push_back(input.substr(i, close - i + 1));
+                i = close;
+            }
+            else
+            {
+                tokens.push_back(string(1, c));
+            }
+            continue;
+        }
+        if (!inQuotes && (c == ' ' || c == '\t'))
+        {
+            if (!current.empty())
+            {
+                tokens.push_back(current);
+                current.clear();
+            }
+            continue;
+        }
+        current += c;
+    }
+    if (!current.empty())
+    {
+        tokens.push_back(current);
+    }
+    if (inQuotes)
+    {
+        throw ShellError("Unterminated quote");
+    }
+    return tokens;
+}
+
+// Function to build a random line biased towards the characters the lexer treats specially
+static string randomLine(mt19937 &rng)
+{
+    static const char alphabet[] = "|><&;\"\\ \t\nabcxyz/._-=$$$***{}??[[]]!^0123456789KM\x01";
+    uniform_int_distribution<int> shape(0, 9);
+    uniform_int_distribution<size_t> pick(0, sizeof(alphabet) - 2);
+    uniform_int_distribution<int> byte(0, 255);
+
+    // Mostly short lines, some long enough to cross many vector blocks
+    size_t length = shape(rng) < 8 ? rng() % 80 : rng() % 3000;
+    bool plainRuns = shape(rng) < 5; // Long ordinary runs exercise the vector loops
+    string line;
+    while (line.size() < length)
+    {
+        int kind = shape(rng);
+        if (plainRuns && kind < 3)
+        {
+            line.append(rng() % 70, static_cast<char>('a' + rng() % 26));
+        }
+        else if (kind == 9)
+        {
+            line += static_cast<char>(byte(rng)); // Any byte, including NUL and high bytes
+        }
+        else
+        {
+            line += alphabet[pick(rng)];
+        }
+    }
+    return line;
+}
+
+// Differential fuzz test: every supported lexer backend must produce the reference tokens
+// (or the same error). Returns non-zero and prints the input on the first mismatch.
+static int fuzzLexer(long iterations, unsigned seed)
+{
+    const vector<pair<string, LexerBackend>> backends = {
+        {"scalar", LexerBackend::Scalar},
+        {"sse2", LexerBackend::SSE2},
+        {"avx2", LexerBackend::AVX2},
+    };
+
+    mt19937 rng(seed);
+    CommandLine parsed;
+    long checked = 0;
+    for (long n = 0; n < iterations; n++)
+    {
+        string line = randomLine(rng);
+        vector<string> expected;
+        bool expectError = false;
+        try
+        {
+            expected = referenceTokenize(line);
+        }
+        catch (const ShellError &)
+        {
+            expectError = true;
+        }
+
+        for (const auto &backend : backends)
+        {
+            if (!lexerBackendSupported(backend.second))
+                continue;
+
+            lexerBackend = backend.second;
+            bool gotError = false;
+            try
+            {
+                tokenize(line, parsed);
+            }
+            catch (const ShellError &)
+            {
+                gotError = true;
+            }
+
+            bool same = gotError == expectError &&
+                        (gotError || vector<string>(parsed.tokens.begin(), parsed.tokens.end()) == expected);
+            if (!same)
+            {
+                cerr << "fuzz: " << backend.first << " lexer disagrees with the reference on \""
+                     << jsonEscape(line) << "\" (seed " << seed << ", iteration " << n << ")" << endl;
+                return 1;
+            }
+            checked++;
+        }
+    }
+    cerr << "fuzz: " << iterations << " lines, " << checked << " backend runs, no mismatches" << endl;
+    return 0;
+}
+
+// Script reading throughput in MB/s: 256 MiB of comments and blank lines run uncached, so the
+// time is spent splitting lines
+static BenchResult benchScriptScan()
+{
+    char path[] = "/tmp/mish_bench_scan_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        throw ShellError("cannot create benchmark script");
+    }
+    string block;
+    while (block.size() < (1 << 20))
+    {
+        block += "# generated comment line with some padding to a typical length of a script line\n\n";
+    }
+    const size_t totalBytes = 256u << 20;
+    size_t written = 0;
+    for (; written < totalBytes; written += block.size())
+    {
+        if (write(fd, block.data(), block.size()) != static_cast<ssize_t>(block.size()))
+        {
+            close(fd);
+            unlink(path);
+            throw ShellError("cannot write benchmark script");
+        }
+    }
+    close(fd);
+
+    env.set("MISH_SCRIPT_CACHE", "0");
+    double start = now();
+    scriptMode(path);
+    double elapsed = now() - start;
+    env.unset("MISH_SCRIPT_CACHE");
+    unlink(path);
+    return {"script_scan", written / elapsed / 1e6, "MB/s", true};
+}
+
+// Function to remove a directory of plain files
+static void removeDirectory(const string &dir)
+{
+    if (DIR *handle = opendir(dir.c_str()))
+    {
+        while (struct dirent *entry = readdir(handle))
+        {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            {
+                unlink((dir + "/" + entry->d_name).c_str());
+            }
+        }
+        closedir(handle);
+    }
+    rmdir(dir.c_str());
+}
+
+// Median time in us to replay 'cache /bin/echo hi' from the output cache, to compare with
+// spawn_true. The store is removed afterwards.
+static BenchResult benchCacheHit()
+{
+    CommandLine line;
+    tokenize("cache /bin/echo hi", line);
+    parseTokens(line);
+    cout << flush;
+    int saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+
+    vector<double> samples;
+    for (int i = 0; i < 301; i++)
+    {
+        vector<Command> commands = line.commands; // Prefixes are stripped from the view
+        double start = now();
+        executeCommands(commands);
+        if (i > 0)
+            samples.push_back((now() - start) * 1e6); // The first run fills the cache
+    }
+    cout << flush;
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    removeDirectory(env.get("MISH_CACHE_DIR") + "/output");
+    sort(samples.begin(), samples.end());
+    return {"cache_hit", samples[samples.size() / 2], "us", false};
+}
+
+// Glob time in ms over a directory of 100k files: 'dir/*7.txt' matched with the listing cached,
+// as in a loop that runs the same pattern over and over
+static BenchResult benchGlob()
+{
+    char dir[] = "/tmp/mish_bench_glob_XXXXXX";
+    if (mkdtemp(dir) == nullptr)
+    {
+        throw ShellError("cannot create glob directory");
+    }
+    const int files = 100000;
+    for (int i = 0; i < files; i++)
+    {
+        string path = string(dir) + "/file" + to_string(i) + (i % 2 ? ".txt" : ".log");
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1)
+        {
+            removeDirectory(dir);
+            throw ShellError("cannot create glob files");
+        }
+        close(fd);
+    }
+
+    string pattern = string(dir) + "/*7.txt";
+    Arena arena;
+    vector<string_view> matches;
+    expandGlob(pattern, arena, matches); // Fills the cache, the directory may be too new to trust
+    expandGlob(pattern, arena, matches);
+    const int rounds = 50;
+    double start = now();
+    for (int i = 0; i < rounds; i++)
+    {
+        arena.reset();
+        matches.clear();
+        expandGlob(pattern, arena, matches);
+    }
+    double elapsed = now() - start;
+    size_t matched = matches.size();
+
+    // A file created in the same time stamp granule as the cached read leaves the directory's
+    // time as it was, it must still be found. Whole-second times stand in for a coarse file system.
+    struct timespec times[2] = {{0, UTIME_OMIT}, {time(nullptr), 0}};
+    utimensat(AT_FDCWD, dir, times, 0);
+    expandGlob(pattern, arena, matches);
+    close(open((string(dir) + "/late7.txt").c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+    utimensat(AT_FDCWD, dir, times, 0);
+    arena.reset();
+    matches.clear();
+    expandGlob(pattern, arena, matches);
+    size_t late = matches.size();
+
+    clearGlobCache();
+    removeDirectory(dir);
+    if (matched != files / 10 || late != files / 10 + 1)
+    {
+        throw ShellError("glob benchmark matched the wrong files");
+    }
+    return {"glob_100k", elapsed / rounds * 1e3, "ms", false};
+}
+
+// Median completion time in us for a two-letter prefix over a PATH directory of 30k executables,
+// with the trie kept current by inotify. The directory is removed afterwards.
+static BenchResult benchComplete()
+{
+    char dir[] = "/tmp/mish_bench_path_XXXXXX";
+    if (mkdtemp(dir) == nullptr)
+    {
+        throw ShellError("cannot create PATH directory");
+    }
+    const int files = 30000;
+    for (int i = 0; i < files; i++)
+    {
+        string path = string(dir) + "/" + static_cast<char>('a' + i % 26) + static_cast<char>('a' + i / 26 % 26) + "cmd" + to_string(i);
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0755);
+        if (fd == -1)
+        {
+            removeDirectory(dir);
+            throw ShellError("cannot create PATH files");
+        }
+        close(fd);
+    }
+
+    string savedPath = env.get("PATH");
+    env.set("PATH", dir);
+    pathTrie.refresh();
+    size_t found = pathTrie.size();
+    vector<double> samples;
+    vector<string> matches;
+    for (int i = 0; i < 1000; i++)
+    {
+        string prefix = {static_cast<char>('a' + i % 26), static_cast<char>('a' + i / 26 % 26)};
+        double start = now();
+        pathTrie.refresh();
+        matches.clear();
+        pathTrie.complete(prefix, matches, 200);
+        pathTrie.commonPrefix(prefix);
+        samples.push_back((now() - start) * 1e6);
+    }
+    env.set("PATH", savedPath);
+    removeDirectory(dir);
+    pathTrie.refresh();
+    if (found != files)
+    {
+        throw ShellError("completion benchmark found the wrong executables");
+    }
+    sort(samples.begin(), samples.end());
+    return {"complete_30k", samples[samples.size() / 2], "us", false};
+}
+
+// Function to write a history file of 'lines' varied command lines with its search index, and
+// point MISH_HISTFILE at it. Returns the path, 'text' gets the contents.
+static string writeHistory(size_t lines, string &text)
+{
+    char path[] = "/tmp/mish_bench_history_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        throw ShellError("cannot create history file");
+    }
+    static const char *const verbs[] = {"git commit -m", "make -C", "grep -rn", "ssh build@", "cat", "ls -la", "vim"};
+    text.clear();
+    for (size_t i = 0; i < lines; i++)
+    {
+        text += string(verbs[i % 7]) + " item" + to_string(i * 7919 % 1000003) + " /srv/project" + to_string(i % 97) + "\n";
+    }
+    bool ok = write(fd, text.data(), text.size()) == static_cast<ssize_t>(text.size());
+    close(fd);
+    if (!ok)
+    {
+        unlink(path);
+        throw ShellError("cannot write history file");
+    }
+    History::buildIndex(path);
+    env.set("MISH_HISTFILE", path);
+    return path;
+}
+
+// Function to remove a history file and its index
+static void removeHistory(const string &path)
+{
+    history.close();
+    env.unset("MISH_HISTFILE");
+    unlink(path.c_str());
+    unlink((path + ".idx").c_str());
+}
+
+// Function to check a search result against a plain scan for the newest line with the query
+static void checkSearch(const string &text, const string &query, size_t found)
+{
+    size_t match = text.rfind(query);
+    size_t expected = match == string::npos ? string::npos : text.rfind('\n', match);
+    expected = match == string::npos ? string::npos : expected == string::npos ? 0 : expected + 1;
+    if (found != expected)
+    {
+        throw ShellError("history search for '" + query + "' found the wrong line");
+    }
+}
+
+// Queries for the history benchmarks: rare, common and missing texts
+static string historyQuery(int i)
+{
+    switch (i % 4)
+    {
+    case 0:
+        return "item" + to_string(i * 131 % 100000);
+    case 1:
+        return "ssh build@ item" + to_string(i % 1000);
+    case 2:
+        return "make -C item" + to_string(i * 17 % 10000) + " ";
+    default:
+        return "nothing" + to_string(i);
+    }
+}
+
+// Median time in us to open a 1M-line history, which should not depend on its length
+static BenchResult benchHistoryOpen()
+{
+    string text;
+    string path = writeHistory(1000000, text);
+    vector<double> samples;
+    for (int i = 0; i < 101; i++)
+    {
+        double start = now();
+        history.open();
+        samples.push_back((now() - start) * 1e6);
+    }
+    size_t end = history.size();
+    removeHistory(path);
+    if (end != text.size())
+    {
+        throw ShellError("history benchmark read the wrong length");
+    }
+    sort(samples.begin(), samples.end());
+    return {"history_open_1m", samples[samples.size() / 2], "us", false};
+}
+
+// Median time in us of the first reverse search of a session over a 1M-line history, the
+// history and its index freshly mapped (the files themselves are in the page cache)
+static BenchResult benchHistorySearchCold()
+{
+    string text;
+    string path = writeHistory(1000000, text);
+    vector<double> samples;
+    for (int i = 0; i < 101; i++)
+    {
+        history.open();
+        string query = historyQuery(i);
+        double start = now();
+        size_t found = history.search(query, history.size());
+        samples.push_back((now() - start) * 1e6);
+        checkSearch(text, query, found);
+        history.close();
+    }
+    removeHistory(path);
+    sort(samples.begin(), samples.end());
+    return {"history_search_cold_1m", samples[samples.size() / 2], "us", false};
+}
+
+// Median reverse search time in us over a 1M-line history, later searches of one session
+static BenchResult benchHistorySearch()
+{
+    string text;
+    string path = writeHistory(1000000, text);
+    history.open();
+    vector<double> samples;
+    for (int i = 0; i < 1000; i++)
+    {
+        string query = historyQuery(i);
+        double start = now();
+        size_t found = history.search(query, history.size());
+        samples.push_back((now() - start) * 1e6);
+        checkSearch(text, query, found);
+    }
+    removeHistory(path);
+    sort(samples.begin(), samples.end());
+    return {"history_search_1m", samples[samples.size() / 2], "us", false};
+}
+
+// Function to write results as JSON lines
+static void writeResults(const vector<BenchResult> &results, ostream &out)
+{
+    for (const auto &r : results)
+    {
+        out << "{\"name\":\"" << r.name << "\",\"value\":" << fixed << setprecision(3) << r.value
+            << ",\"unit\":\"" << r.unit << "\",\"better\":\"" << (r.higherIsBetter ? "higher" : "lower")
+            << "\"}" << endl;
+    }
+}
+
+// Function to extract a string field from one of our JSON lines
+static string field(const string &line, const string &key)
+{
+    string marker = "\"" + key + "\":";
+    size_t pos = line.find(marker);
+    if (pos == string::npos)
+        return "";
+    pos += marker.size();
+    if (line[pos] == '"')
+    {
+        size_t end = line.find('"', pos + 1);
+        return line.substr(pos + 1, end - pos - 1);
+    }
+    size_t end = line.find_first_of(",}", pos);
+    return line.substr(pos, end - pos);
+}
+
+// Function to load a results file into a name -> result map
+static map<string, BenchResult> loadResults(const string &path)
+{
+    ifstream in(path);
+    if (!in)
+    {
+        throw ShellError("cannot open " + path);
+    }
+    map<string, BenchResult> results;
+    string line;
+    while (getline(in, line))
+    {
+        if (line.empty())
+            continue;
+        BenchResult r;
+        r.name = field(line, "name");
+        r.value = atof(field(line, "value").c_str());
+        r.unit = field(line, "unit");
+        r.higherIsBetter = field(line, "better") != "lower";
+        results[r.name] = r;
+    }
+    return results;
+}
+
+// Function to compare results against a baseline, returns non-zero on a regression
+static int compareResults(const string &baselinePath, const string &currentPath, double threshold)
+{
+    map<string, BenchResult> baseline = loadResults(baselinePath);
+    map<string, BenchResult> current = loadResults(currentPath);
+
+    int regressions = 0;
+    cout << left << setw(16) << "benchmark" << right << setw(14) << "baseline" << setw(14) << "current"
+         << setw(10) << "change" << endl;
+    for (const auto &entry : current)
+    {
+        const BenchResult &cur = entry.second;
+        auto it = baseline.find(cur.name);
+        if (it != baseline.end() && it->second.value == 0 && !cur.higherIsBetter)
+        {
+            // A count that should stay at zero, any increase is a regression
+            bool regressed = cur.value > 0;
+            regressions += regressed;
+            cout << left << setw(16) << cur.name << right << fixed << setprecision(3) << setw(14) << 0.0
+                 << setw(14) << cur.value << setw(10) << "" << " " << cur.unit << (regressed ? "  REGRESSION" : "")
+                 << endl;
+            continue;
+        }
+        if (it == baseline.end() || it->second.value == 0)
+        {
+            cout << left << setw(16) << cur.name << right << setw(14) << "-" << setw(14) << cur.value << endl;
+            continue;
+        }
+
+        // Positive change always means "better"
+        double change = (cur.value - it->second.value) / it->second.value * 100.0;
+        if (!cur.higherIsBetter)
+            change = -change;
+        bool regressed = change < -threshold;
+        regressions += regressed;
+
+        ostringstream pct;
+        pct << showpos << fixed << setprecision(1) << change << "%";
+        cout << left << setw(16) << cur.name << right << fixed << setprecision(3) << setw(14)
+             << it->second.value << setw(14) << cur.value << setw(10) << pct.str() << " " << cur.unit
+             << (regressed ? "  REGRESSION" : "") << endl;
+    }
+    return regressions > 0 ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    // spawn_true_zygote starts this binary again as the zygote
+    if (runZygoteServer(argc, argv))
+    {
+        return 0;
+    }
+
+    string outPath;
+    string only;
+    double threshold = 10.0;
+    long fuzzIterations = 0;
+    unsigned seed = random_device()();
+
+    try
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "--out" && i + 1 < argc)
+            {
+                outPath = argv[++i];
+            }
+            else if (arg == "--only" && i + 1 < argc)
+            {
+                only = argv[++i];
+            }
+            else if (arg == "--threshold" && i + 1 < argc)
+            {
+                threshold = atof(argv[++i]);
+            }
+            else if (arg == "--fuzz" && i + 1 < argc)
+            {
+                fuzzIterations = atol(argv[++i]);
+            }
+            else if (arg == "--seed" && i + 1 < argc)
+            {
+                seed = static_cast<unsigned>(strtoul(argv[++i], nullptr, 10));
+            }
+            else if (arg == "--compare" && i + 2 < argc)
+            {
+                string baseline = argv[i + 1];
+                string current = argv[i + 2];
+                for (int j = i + 3; j + 1 < argc; j++)
+                {
+                    if (string(argv[j]) == "--threshold")
+                        threshold = atof(argv[j + 1]);
+                }
+                return compareResults(baseline, current, threshold);
+            }
+            else
+            {
+                cerr << "Usage: mish_bench [--out file] [--only name] | --compare baseline current [--threshold pct]"
+                     << " | --fuzz iterations [--seed n]" << endl;
+                return 2;
+            }
+        }
+
+        // Same initialization as the shell
+        initShell();
+
+        if (fuzzIterations > 0)
+        {
+            return fuzzLexer(fuzzIterations, seed);
+        }
+
+        // Keep script cache entries out of the user's cache
+        char cacheDir[] = "/tmp/mish_bench_cache_XXXXXX";
+        if (mkdtemp(cacheDir) == nullptr)
+        {
+            throw ShellError("cannot create cache directory");
+        }
+        env.set("MISH_CACHE_DIR", cacheDir);
+
+        vector<pair<string, BenchResult (*)()>> benchmarks = {
+            {"tokenize", benchTokenize},
+            {"tokenize_scalar", benchTokenizeScalar},
+            {"tokenize_paths", benchTokenizePaths},
+            {"parse", benchParse},
+            {"parse_allocs", benchParseAllocs},
+            {"spawn_true", benchSpawn},
+            {"spawn_true_zygote", benchSpawnZygote},
+            {"cache_hit", benchCacheHit},
+            {"parallel_true_2k", benchParallel},
+            {"pipeline_cat3", benchPipeline},
+            {"pipeline_cat3_spawned", benchPipelineSpawned},
+            {"pipeline_cat3_1m", benchPipelineLargePipes},
+            {"pipeline_cat3_metered", benchPipelineMetered},
+            {"script_100k", benchScript},
+            {"script_100k_cached", benchScriptCached},
+            {"script_scan", benchScriptScan},
+            {"loop_1m", benchLoop},
+            {"printf_wide", benchPrintfWide},
+            {"glob_100k", benchGlob},
+            {"complete_30k", benchComplete},
+            {"history_open_1m", benchHistoryOpen},
+            {"history_search_cold_1m", benchHistorySearchCold},
+            {"history_search_1m", benchHistorySearch},
+        };
+
+        vector<BenchResult> results;
+        for (const auto &bench : benchmarks)
+        {
+            if (!only.empty() && bench.first != only)
+                continue;
+            BenchResult r = bench.second();
+            cerr << left << setw(16) << r.name << right << fixed << setprecision(3) << setw(14) << r.value << " "
+                 << r.unit << endl;
+            results.push_back(r);
+        }
+        removeDirectory(cacheDir);
+
+        if (outPath.empty())
+        {
+            writeResults(results, cout);
+        }
+        else
+        {
+            ofstream out(outPath);
+            writeResults(results, out);
+        }
+    }
+    catch (const exception &e)
+    {
+        cerr << "Error: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
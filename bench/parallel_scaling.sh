@@ -0,0 +1,31 @@
+#!/bin/sh
+# Wall-clock scaling of `mish -j N` on a batch of independent CPU-bound lines.
+# Usage: bench/parallel_scaling.sh [jobs-per-run] [max-N]
+# Prints one "N seconds speedup" line per concurrency level.
+
+MISH=${MISH:-./mish}
+JOBS=${1:-32}
+CORES=$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)
+MAX=${2:-$((CORES * 2))}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+i=0
+while [ "$i" -lt "$JOBS" ]; do
+    echo 'sh -c "i=0; while [ \$i -lt 200000 ]; do i=\$((i+1)); done" &' >> "$SCRIPT"
+    i=$((i + 1))
+done
+
+now() { date +%s.%N; }
+
+base=""
+n=1
+while [ "$n" -le "$MAX" ]; do
+    start=$(now)
+    "$MISH" -j "$n" "$SCRIPT" > /dev/null
+    end=$(now)
+    secs=$(awk "BEGIN { print $end - $start }")
+    [ -z "$base" ] && base=$secs
+    awk "BEGIN { printf \"%d %.3f %.2f\\n\", $n, $secs, $base / $secs }"
+    n=$((n * 2))
+done
@@ -0,0 +1,590 @@
+#include "mish.h"
+#include <sys/stat.h>
+using namespace std;
+
+// Built-in 'exit': leave the shell
+static int builtinExit(const Command &cmd)
+{
+    if (cmd.tokens.size() > 1)
+    {
+        throw ShellError("exit command takes no arguments");
+    }
+    throw ShellExit(0);
+}
+
+// Built-in 'cd': change the working directory
+static int builtinCd(const Command &cmd)
+{
+    if (cmd.tokens.size() != 2)
+    {
+        throw ShellError("cd command requires exactly one argument");
+    }
+    if (chdir(cmd.tokens[1].data()) != 0) // Change working directory
+    {
+        throw ShellError("cd failed: " + string(strerror(errno)));
+    }
+    return 0;
+}
+
+// Variable assignment: <var>=<value>, an empty value unsets the variable
+static int builtinAssign(const Command &cmd)
+{
+    string_view command = cmd.tokens[0];
+    size_t pos = command.find('=');
+    string var_name(command.substr(0, pos));
+    string var_value(pos + 1 < command.length() ? command.substr(pos + 1) : "");
+
+    if (var_name == "PATH")
+    {
+        env.set("PATH", var_value);
+    }
+    else
+    {
+        if (var_value.empty())
+        {
+            env.unset(var_name);
+        }
+        else
+        {
+            env.set(var_name, var_value);
+        }
+    }
+    return 0;
+}
+
+// Built-in 'hash': list, clear or prefill remembered command locations
+static int builtinHash(const Command &cmd)
+{
+    if (cmd.tokens.size() == 1) // List remembered locations
+    {
+        const auto &entries = commandHash.getAll();
+        if (entries.empty())
+        {
+            cout << "hash: hash table empty" << endl;
+            return 0;
+        }
+
+        map<string, CommandHash::Entry> sorted(entries.begin(), entries.end());
+        cout << "hits\tcommand" << endl;
+        for (const auto &entry : sorted)
+        {
+            cout << setw(4) << entry.second.hits << "\t" << entry.second.path << endl;
+        }
+    }
+    else if (cmd.tokens.size() == 2 && cmd.tokens[1] == "-r") // Clear the table
+    {
+        commandHash.clear();
+    }
+    else // Prefill the table
+    {
+        for (size_t i = 1; i < cmd.tokens.size(); i++)
+        {
+            if (!commandHash.add(string(cmd.tokens[i])))
+            {
+                throw ShellError("hash: " + string(cmd.tokens[i]) + ": not found");
+            }
+        }
+    }
+    return 0;
+}
+
+// Built-in 'jobs': list background jobs
+static int builtinJobs(const Command &cmd)
+{
+    if (cmd.tokens.size() > 1)
+    {
+        throw ShellError("jobs command takes no arguments");
+    }
+    jobs.list();
+    return 0;
+}
+
+// Function to find the job named by an optional argument of fg/bg
+static Job &jobArgument(const Command &cmd)
+{
+    if (cmd.tokens.size() > 2)
+    {
+        throw ShellError(string(cmd.tokens[0]) + " command takes at most one argument");
+    }
+
+    jobs.update();
+    Job *job = jobs.find(cmd.tokens.size() == 2 ? string(cmd.tokens[1]) : "");
+    if (job == nullptr)
+    {
+        throw ShellError(string(cmd.tokens[0]) + ": no such job");
+    }
+    return *job;
+}
+
+// Built-in 'fg': continue a job in the foreground and wait for it
+static int builtinFg(const Command &cmd)
+{
+    Job &job = jobArgument(cmd);
+    cout << job.command << endl;
+
+    int status = jobs.wait(job, true);
+    if (job.state == JOB_DONE)
+    {
+        jobs.remove(job.id);
+    }
+    return status;
+}
+
+// Built-in 'bg': continue a stopped job in the background
+static int builtinBg(const Command &cmd)
+{
+    Job &job = jobArgument(cmd);
+    jobs.resume(job);
+    return 0;
+}
+
+// Built-in 'wait': wait for the given jobs, or for all background jobs
+static int builtinWait(const Command &cmd)
+{
+    int status = 0;
+    if (cmd.tokens.size() == 1)
+    {
+        while (!jobs.getAll().empty())
+        {
+            Job &job = *jobs.find("");
+            status = jobs.wait(job, false);
+            if (job.state != JOB_DONE)
+            {
+                break; // A stopped job never finishes on its own
+            }
+            jobs.remove(job.id);
+        }
+        scheduler.flush();
+        return status;
+    }
+
+    for (size_t i = 1; i < cmd.tokens.size(); i++)
+    {
+        Job *job = jobs.find(string(cmd.tokens[i]));
+        if (job == nullptr)
+        {
+            throw ShellError("wait: no such job: " + string(cmd.tokens[i]));
+        }
+        status = jobs.wait(*job, false);
+        if (job->state == JOB_DONE)
+        {
+            jobs.remove(job->id);
+        }
+    }
+    scheduler.flush();
+    return status;
+}
+
+// Built-in 'true'
+static int builtinTrue(const Command &)
+{
+    return 0;
+}
+
+// Built-in 'false'
+static int builtinFalse(const Command &)
+{
+    return 1;
+}
+
+// Built-in 'echo': print arguments separated by spaces, '-n' drops the newline
+static int builtinEcho(const Command &cmd)
+{
+    size_t first = 1;
+    bool newline = true;
+    if (cmd.tokens.size() > 1 && cmd.tokens[1] == "-n")
+    {
+        newline = false;
+        first = 2;
+    }
+
+    for (size_t i = first; i < cmd.tokens.size(); i++)
+    {
+        if (i > first)
+        {
+            cout << ' ';
+        }
+        cout << cmd.tokens[i];
+    }
+    if (newline)
+    {
+        cout << '\n';
+    }
+    return 0;
+}
+
+// Built-in 'pwd': print the working directory
+static int builtinPwd(const Command &cmd)
+{
+    if (cmd.tokens.size() > 1)
+    {
+        throw ShellError("pwd command takes no arguments");
+    }
+
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr)
+    {
+        throw ShellError("pwd failed: " + string(strerror(errno)));
+    }
+    cout << cwd << '\n';
+    return 0;
+}
+
+// Function to print a printf-style escape sequence, returns the number of characters consumed
+static size_t printEscape(string_view format, size_t i)
+{
+    if (i + 1 >= format.length())
+    {
+        cout << '\\';
+        return 1;
+    }
+
+    switch (format[i + 1])
+    {
+    case 'n':
+        cout << '\n';
+        break;
+    case 't':
+        cout << '\t';
+        break;
+    case 'r':
+        cout << '\r';
+        break;
+    case 'a':
+        cout << '\a';
+        break;
+    case '\\':
+        cout << '\\';
+        break;
+    default:
+        cout << '\\' << format[i + 1];
+        break;
+    }
+    return 2;
+}
+
+// Function to convert a printf argument to a number, with an error for non-numbers.
+// 'value' must be NUL-terminated, as command words are.
+static long long toNumber(string_view value, const string &context)
+{
+    if (value.empty())
+    {
+        return 0;
+    }
+
+    char *end = nullptr;
+    errno = 0;
+    long long number = strtoll(value.data(), &end, 0);
+    if (*end != '\0' || errno != 0)
+    {
+        errno = 0;
+        throw ShellError(context + ": invalid number: " + string(value));
+    }
+    return number;
+}
+
+// Function to print one printf conversion. The text is sized from snprintf's count, so a wide
+// field or a long argument is never cut off.
+template <typename T>
+static void printConversion(const string &spec, T value)
+{
+    int length = snprintf(nullptr, 0, spec.c_str(), value);
+    if (length < 0)
+    {
+        errno = 0;
+        throw ShellError("printf: invalid format: %" + spec.substr(1));
+    }
+    string text(static_cast<size_t>(length) + 1, '\0');
+    snprintf(&text[0], text.size(), spec.c_str(), value);
+    text.pop_back();
+    cout << text;
+}
+
+// Built-in 'printf': supports %s %c %d %i %u %x %X %o and %%, with width and flags.
+// The format is reused until all arguments are consumed, like the POSIX utility.
+static int builtinPrintf(const Command &cmd)
+{
+    if (cmd.tokens.size() < 2)
+    {
+        throw ShellError("printf: usage: printf format [arguments]");
+    }
+
+    string_view format = cmd.tokens[1];
+    size_t arg = 2;
+
+    do
+    {
+        bool consumed = false;
+        for (size_t i = 0; i < format.length();)
+        {
+            char c = format[i];
+            if (c == '\\')
+            {
+                i += printEscape(format, i);
+                continue;
+            }
+            if (c != '%')
+            {
+                cout << c;
+                i++;
+                continue;
+            }
+            if (i + 1 < format.length() && format[i + 1] == '%')
+            {
+                cout << '%';
+                i += 2;
+                continue;
+            }
+
+            // Collect flags, width and precision
+            size_t specStart = i++;
+            while (i < format.length() && strchr("-+ #0123456789.", format[i]) != nullptr)
+            {
+                i++;
+            }
+            if (i >= format.length())
+            {
+                throw ShellError("printf: missing format character");
+            }
+
+            char conversion = format[i++];
+            string spec(format.substr(specStart, i - specStart - 1));
+            string_view value = arg < cmd.tokens.size() ? cmd.tokens[arg++] : "";
+            consumed = true;
+
+            switch (conversion)
+            {
+            case 's':
+                printConversion(spec + "s", value.data());
+                break;
+            case 'c':
+                printConversion(spec + "c", value.empty() ? '\0' : value[0]);
+                break;
+            case 'd':
+            case 'i':
+                printConversion(spec + "lld", toNumber(value, "printf"));
+                break;
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+                printConversion(spec + "ll" + conversion, static_cast<unsigned long long>(toNumber(value, "printf")));
+                break;
+            default:
+                throw ShellError("printf: unsupported format character: " + string(1, conversion));
+            }
+        }
+
+        if (!consumed)
+        {
+            break; // No conversions, so the arguments can never be consumed
+        }
+    } while (arg < cmd.tokens.size());
+
+    return 0;
+}
+
+// Function to evaluate a unary file or string test
+static bool evaluateUnary(string_view op, string_view operand)
+{
+    struct stat st;
+    if (op == "-n")
+        return !operand.empty();
+    if (op == "-z")
+        return operand.empty();
+    if (op == "-e")
+        return stat(operand.data(), &st) == 0;
+    if (op == "-f")
+        return stat(operand.data(), &st) == 0 && S_ISREG(st.st_mode);
+    if (op == "-d")
+        return stat(operand.data(), &st) == 0 && S_ISDIR(st.st_mode);
+    if (op == "-s")
+        return stat(operand.data(), &st) == 0 && st.st_size > 0;
+    if (op == "-L" || op == "-h")
+        return lstat(operand.data(), &st) == 0 && S_ISLNK(st.st_mode);
+    if (op == "-r")
+        return access(operand.data(), R_OK) == 0;
+    if (op == "-w")
+        return access(operand.data(), W_OK) == 0;
+    if (op == "-x")
+        return access(operand.data(), X_OK) == 0;
+    throw ShellError("test: unknown unary operator: " + string(op));
+}
+
+// Function to check whether a token is a binary test operator
+static bool isBinaryOperator(string_view op)
+{
+    return op == "=" || op == "==" || op == "!=" || op == "-eq" || op == "-ne" ||
+           op == "-lt" || op == "-le" || op == "-gt" || op == "-ge";
+}
+
+// Function to evaluate a binary string or integer comparison
+static bool evaluateBinary(string_view left, string_view op, string_view right)
+{
+    if (op == "=" || op == "==")
+        return left == right;
+    if (op == "!=")
+        return left != right;
+
+    long long a = toNumber(left, "test");
+    long long b = toNumber(right, "test");
+    if (op == "-eq")
+        return a == b;
+    if (op == "-ne")
+        return a != b;
+    if (op == "-lt")
+        return a < b;
+    if (op == "-le")
+        return a <= b;
+    if (op == "-gt")
+        return a > b;
+    return a >= b; // -ge
+}
+
+// Function to evaluate test arguments using the POSIX rules for up to four arguments
+static bool evaluateTest(const TokenList &args, size_t first, size_t last)
+{
+    size_t count = last - first;
+    if (count == 0)
+        return false;
+    if (args[first] == "!")
+        return !evaluateTest(args, first + 1, last);
+    if (count == 1)
+        return !args[first].empty();
+    if (count == 2)
+        return evaluateUnary(args[first], args[first + 1]);
+    if (count == 3 && isBinaryOperator(args[first + 1]))
+        return evaluateBinary(args[first], args[first + 1], args[first + 2]);
+    throw ShellError("test: too many arguments");
+}
+
+// Built-in 'test' and '[': evaluate a conditional expression
+static int builtinTest(const Command &cmd)
+{
+    size_t last = cmd.tokens.size();
+    if (cmd.tokens[0] == "[")
+    {
+        if (cmd.tokens.back() != "]")
+        {
+            throw ShellError("[: missing ']'");
+        }
+        last--;
+    }
+
+    return evaluateTest(cmd.tokens, 1, last) ? 0 : 1;
+}
+
+// Dispatch table of built-in commands
+static const unordered_map<string_view, BuiltinFunc> builtins = {
+    {"exit", builtinExit},
+    {"cd", builtinCd},
+    {"hash", builtinHash},
+    {"jobs", builtinJobs},
+    {"fg", builtinFg},
+    {"bg", builtinBg},
+    {"wait", builtinWait},
+    {"true", builtinTrue},
+    {"false", builtinFalse},
+    {"echo", builtinEcho},
+    {"printf", builtinPrintf},
+    {"pwd", builtinPwd},
+    {"test", builtinTest},
+    {"parallel", builtinParallel},
+    {"[", builtinTest},
+};
+
+// Function to look up a built-in, with variable assignments mapped to the assignment handler
+static BuiltinFunc findBuiltIn(string_view cmd)
+{
+    auto it = builtins.find(cmd);
+    if (it != builtins.end())
+    {
+        return it->second;
+    }
+    if (cmd.find('=') != string_view::npos)
+    {
+        return builtinAssign;
+    }
+    return nullptr;
+}
+
+// Function to check if a command is built-in (ex. cd, exit, echo, variable assignment)
+bool isBuiltInCommand(string_view cmd)
+{
+    return findBuiltIn(cmd) != nullptr;
+}
+
+// Function to get the names of the built-ins, in no particular order
+vector<string_view> builtInNames()
+{
+    vector<string_view> names;
+    for (const auto &entry : builtins)
+    {
+        names.push_back(entry.first);
+    }
+    return names;
+}
+
+// Function to execute a built-in command and return its exit status
+int executeBuiltIn(const Command &cmd)
+{
+    if (cmd.tokens.empty())
+        return 0;
+
+    TraceSpan span("builtin");
+    BuiltinFunc builtin = findBuiltIn(cmd.tokens[0]);
+    if (builtin == nullptr)
+    {
+        throw ShellError("Not a built-in command: " + string(cmd.tokens[0]));
+    }
+
+    try
+    {
+        lastStatus = builtin(cmd);
+    }
+    catch (const ShellError &)
+    {
+        lastStatus = 1;
+        throw;
+    }
+    return lastStatus;
+}
+
+// Function to run a built-in inside the shell process, applying the command's redirections
+// to the shell's own stdin/stdout for the duration of the call
+int executeBuiltInRedirected(const Command &cmd)
+{
+    if (!cmd.redirectedInputFromFile() && !cmd.redirectOutputToFile())
+    {
+        int status = executeBuiltIn(cmd);
+        cout << flush;
+        return status;
+    }
+
+    cout << flush;
+    int savedIn = dup(STDIN_FILENO);
+    int savedOut = dup(STDOUT_FILENO);
+
+    // Function to put the shell's stdin/stdout back
+    auto restore = [&]()
+    {
+        cout << flush;
+        dup2(savedIn, STDIN_FILENO);
+        dup2(savedOut, STDOUT_FILENO);
+        close(savedIn);
+        close(savedOut);
+    };
+
+    try
+    {
+        setupRedirection(cmd);
+        int status = executeBuiltIn(cmd);
+        restore();
+        return status;
+    }
+    catch (...)
+    {
+        restore();
+        throw;
+    }
+}
@@ -0,0 +1,110 @@
+#include "mish.h"
+#include <sys/stat.h>
+using namespace std;
+
+// Global command hash table
+CommandHash commandHash;
+
+// Function to check that a path names an executable regular file
+static bool isExecutableFile(const string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(path.c_str(), X_OK) == 0;
+}
+
+// Walk PATH once to find the executable for a command name
+string CommandHash::search(const string &name, bool &cacheable) const
+{
+    string path = env.get("PATH");
+    if (path.empty() && !env.contains("PATH"))
+    {
+        path = "/bin:/usr/bin"; // Same default as execvp
+    }
+
+    size_t start = 0;
+    while (start <= path.length())
+    {
+        size_t end = path.find(':', start);
+        if (end == string::npos)
+        {
+            end = path.length();
+        }
+
+        string dir = path.substr(start, end - start);
+        if (dir.empty())
+        {
+            dir = "."; // An empty PATH entry means the current directory
+        }
+
+        string candidate = dir + "/" + name;
+        if (isExecutableFile(candidate))
+        {
+            // Entries relative to the working directory change meaning after cd
+            cacheable = dir[0] == '/';
+            return candidate;
+        }
+        start = end + 1;
+    }
+    return "";
+}
+
+// Resolve a command name to the path to execute, or "" if it cannot be found
+string CommandHash::resolve(const string &name)
+{
+    if (name.find('/') != string::npos)
+    {
+        return name; // Absolute and relative paths are used as given
+    }
+
+    auto it = table.find(name);
+    if (it != table.end())
+    {
+        if (isExecutableFile(it->second.path))
+        {
+            it->second.hits++;
+            return it->second.path;
+        }
+        table.erase(it); // The cached executable went away, search again
+    }
+
+    bool cacheable = false;
+    string found = search(name, cacheable);
+    if (!found.empty() && cacheable)
+    {
+        table[name] = {found, 1};
+    }
+    return found;
+}
+
+// Look up a command and store it in the table without counting a hit
+bool CommandHash::add(const string &name)
+{
+    if (name.find('/') != string::npos)
+    {
+        return false;
+    }
+
+    bool cacheable = false;
+    string found = search(name, cacheable);
+    if (found.empty())
+    {
+        return false;
+    }
+    if (cacheable)
+    {
+        table[name] = {found, 0};
+    }
+    return true;
+}
+
+// Forget every remembered location
+void CommandHash::clear()
+{
+    table.clear();
+}
+
+// Get all remembered locations
+const unordered_map<string, CommandHash::Entry> &CommandHash::getAll() const
+{
+    return table;
+}
@@ -0,0 +1,250 @@
+#include "mish.h"
+using namespace std;
+
+namespace
+{
+    // Kinds of segments outside the environment's slots
+    const uint32_t LITERAL = UINT32_MAX;        // Literal text
+    const uint32_t VAR_STATUS = UINT32_MAX - 1; // $?
+    const uint32_t VAR_PID = UINT32_MAX - 2;    // $$
+    const uint32_t PATTERN = UINT32_MAX - 3;    // *, **, ? or [...] matched against file names
+
+    // Part of a word: literal text, a pattern or a variable
+    struct Segment
+    {
+        uint32_t offset;   // Literal or pattern text in the template's source
+        uint32_t length;
+        uint32_t variable; // Environment slot, or one of the kinds above
+    };
+
+    // A word compiled into segments, with its source so cache keys can point into it
+    struct WordTemplate
+    {
+        string source;
+        vector<Segment> segments;
+        bool pattern = false; // Some segment is a PATTERN
+    };
+
+    // Templates are kept for the life of the shell up to this many, then rebuilt as they are used
+    const size_t MAX_TEMPLATES = 1 << 16;
+}
+
+static deque<WordTemplate> templates;                        // Compiled words
+static unordered_map<string_view, WordTemplate *> templateIndex; // Word text -> template
+
+// Expanded words of the pipeline being run, replaced by the next expansion
+static Arena expansionArena;
+static vector<string_view> expandedWords;
+
+// Function to compile a word into literal and variable segments, once per distinct word
+static const WordTemplate &compileTemplate(string_view word)
+{
+    auto it = templateIndex.find(word);
+    if (it != templateIndex.end())
+        return *it->second;
+
+    if (templates.size() >= MAX_TEMPLATES)
+    {
+        templateIndex.clear();
+        templates.clear();
+    }
+
+    templates.push_back({string(word), {}, false});
+    WordTemplate &compiled = templates.back();
+    const string &source = compiled.source;
+    size_t pos = 0;
+    while (pos < source.size())
+    {
+        size_t mark = source.find(VAR_MARK, pos);
+        if (mark == string::npos)
+            mark = source.size();
+        if (mark > pos)
+        {
+            compiled.segments.push_back({static_cast<uint32_t>(pos), static_cast<uint32_t>(mark - pos), LITERAL});
+        }
+        if (mark == source.size())
+            break;
+
+        size_t close = source.find(VAR_MARK, mark + 1);
+        if (close == string::npos)
+            close = source.size();
+        string name = source.substr(mark + 1, close - mark - 1);
+        if (name.empty())
+        {
+            // An empty reference stands for a VAR_MARK byte of the input
+            compiled.segments.push_back({static_cast<uint32_t>(mark), 1, LITERAL});
+        }
+        else if (name[0] == '*' || name[0] == '?' || name[0] == '[')
+        {
+            compiled.segments.push_back({static_cast<uint32_t>(mark + 1), static_cast<uint32_t>(name.size()), PATTERN});
+            compiled.pattern = true;
+        }
+        else
+        {
+            uint32_t variable = name == "$?" ? VAR_STATUS : name == "$$" ? VAR_PID : env.intern(name);
+            compiled.segments.push_back({0, 0, variable});
+        }
+        pos = close + 1;
+    }
+
+    templateIndex.emplace(string_view(compiled.source), &compiled);
+    return compiled;
+}
+
+// Function to get the text of a segment. 'number' holds the digits of a special parameter.
+static string_view segmentText(const WordTemplate &compiled, const Segment &segment, char (&number)[24])
+{
+    switch (segment.variable)
+    {
+    case LITERAL:
+    case PATTERN:
+        return string_view(compiled.source.data() + segment.offset, segment.length);
+    case VAR_STATUS:
+        return string_view(number, snprintf(number, sizeof(number), "%d", lastStatus));
+    case VAR_PID:
+        return string_view(number, snprintf(number, sizeof(number), "%d", static_cast<int>(getpid())));
+    default:
+    {
+        const string *value = env.lookup(segment.variable);
+        return value != nullptr ? string_view(*value) : string_view();
+    }
+    }
+}
+
+// Function to build the glob pattern of a word: pattern segments as they are, everything else
+// with the pattern characters escaped so it only matches itself
+static const string &globPattern(const WordTemplate &compiled)
+{
+    static string pattern;
+    pattern.clear();
+    char number[24];
+    for (const auto &segment : compiled.segments)
+    {
+        string_view text = segmentText(compiled, segment, number);
+        if (segment.variable == PATTERN)
+        {
+            pattern.append(text.data(), text.size());
+            continue;
+        }
+        for (char c : text)
+        {
+            if (c == '*' || c == '?' || c == '[' || c == '\\')
+                pattern += '\\';
+            pattern += c;
+        }
+    }
+    return pattern;
+}
+
+// Function to expand one word into the expansion arena, appending the results to 'out'. A word
+// with a pattern becomes the sorted paths it matches, or stays as written if there are none.
+// Unset variables expand to nothing.
+static void expandInArena(string_view word, vector<string_view> &out)
+{
+    if (memchr(word.data(), VAR_MARK, word.size()) == nullptr)
+    {
+        out.push_back(word);
+        return;
+    }
+
+    const WordTemplate &compiled = compileTemplate(word);
+    if (compiled.pattern && expandGlob(globPattern(compiled), expansionArena, out) > 0)
+        return;
+
+    char number[24];
+    size_t length = 0;
+    for (const auto &segment : compiled.segments)
+    {
+        length += segmentText(compiled, segment, number).size();
+    }
+
+    char *text = expansionArena.allocate(length + 1);
+    char *end = text;
+    for (const auto &segment : compiled.segments)
+    {
+        string_view piece = segmentText(compiled, segment, number);
+        memcpy(end, piece.data(), piece.size());
+        end += piece.size();
+    }
+    *end = '\0';
+    out.push_back(string_view(text, length));
+}
+
+// Function to expand a redirection target, which has to stay one word: a pattern is used
+// only if it matches exactly one file
+static string_view expandFileName(string_view word)
+{
+    static vector<string_view> results;
+    results.clear();
+    expandInArena(word, results);
+    if (results.size() == 1)
+        return results[0];
+
+    // Ambiguous, the pattern is kept as written
+    const WordTemplate &compiled = compileTemplate(word);
+    string text;
+    char number[24];
+    for (const auto &segment : compiled.segments)
+    {
+        text.append(segmentText(compiled, segment, number));
+    }
+    return expansionArena.copy(text);
+}
+
+// Function to get the expanded words of one word, appended to 'out'
+void expandWord(string_view word, vector<string> &out)
+{
+    static vector<string_view> results;
+    results.clear();
+    expansionArena.reset();
+    expandInArena(word, results);
+    for (const auto &result : results)
+    {
+        out.emplace_back(result);
+    }
+}
+
+// Function to replace the variable references and patterns of a pipeline's commands just
+// before it runs. Each variable expands within its word, values are not split on blanks;
+// a pattern can turn one word into many. The expanded text stays valid until the next
+// pipeline is expanded.
+void expandCommands(Command *commands, size_t count)
+{
+    TraceSpan span("expand");
+    expansionArena.reset();
+    expandedWords.clear();
+
+    // Patterns can add words, so the commands' views are set once every word is in place
+    static vector<pair<size_t, size_t>> ranges; // First expanded word and count of each command
+    ranges.assign(count, {0, 0});
+    for (size_t c = 0; c < count; c++)
+    {
+        Command &cmd = commands[c];
+        if (!(cmd.flags & CMD_EXPAND))
+            continue;
+
+        ranges[c].first = expandedWords.size();
+        for (const auto &word : cmd.tokens)
+        {
+            expandInArena(word, expandedWords);
+        }
+        ranges[c].second = expandedWords.size() - ranges[c].first;
+        if (cmd.redirectOutputToFile())
+        {
+            cmd.redirectOutputFileName = expandFileName(cmd.redirectOutputFileName);
+        }
+        if (cmd.redirectedInputFromFile())
+        {
+            cmd.redirectedInputFileName = expandFileName(cmd.redirectedInputFileName);
+        }
+    }
+
+    for (size_t c = 0; c < count; c++)
+    {
+        if (commands[c].flags & CMD_EXPAND)
+        {
+            commands[c].tokens = TokenList(expandedWords.data() + ranges[c].first, ranges[c].second);
+            commands[c].flags &= ~CMD_EXPAND;
+        }
+    }
+}
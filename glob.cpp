@@ -0,0 +1,442 @@
+#include "mish.h"
+#include <algorithm>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+using namespace std;
+
+namespace
+{
+    // Bytes asked of each getdents64 call, large enough for thousands of entries
+    const size_t DIRENT_BUFFER = 1 << 20;
+
+    // Name bytes kept across all cached listings before the cache is dropped
+    const size_t CACHE_LIMIT = 64 << 20;
+
+    // Record returned by getdents64
+    struct LinuxDirent64
+    {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+
+    // One name of a listing
+    struct ListingEntry
+    {
+        uint32_t offset; // Name in Listing::names
+        uint8_t type;    // d_type, DT_UNKNOWN if the file system does not say
+    };
+
+    // Names of one directory, sorted once when read so every match comes out in order
+    struct Listing
+    {
+        struct timespec mtime;       // Modification time of the directory when it was read
+        bool settled;                // 'mtime' is old enough that any later change moves it
+        vector<char> names;          // NUL-terminated names
+        vector<ListingEntry> entries; // In byte order of their names
+    };
+
+    // Directories are keyed by device and inode, so the cache survives 'cd' and symlinks
+    struct DirectoryKey
+    {
+        dev_t dev;
+        ino_t ino;
+        bool operator==(const DirectoryKey &other) const { return dev == other.dev && ino == other.ino; }
+    };
+
+    struct DirectoryKeyHash
+    {
+        size_t operator()(const DirectoryKey &key) const { return hash<uint64_t>()(key.ino * 31 + key.dev); }
+    };
+}
+
+// Cached listings. A walk holds its own reference, so a listing replaced meanwhile stays valid.
+static unordered_map<DirectoryKey, shared_ptr<Listing>, DirectoryKeyHash> listings;
+static size_t cachedBytes = 0; // Name bytes in 'listings'
+
+// Function to read every name of a directory with large getdents64 batches
+static bool readListing(int fd, Listing &listing)
+{
+    static unique_ptr<char[]> buffer(new char[DIRENT_BUFFER]);
+    listing.names.clear();
+    listing.entries.clear();
+
+    while (true)
+    {
+        long count = syscall(SYS_getdents64, fd, buffer.get(), DIRENT_BUFFER);
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return count == 0;
+
+        for (long pos = 0; pos < count;)
+        {
+            const LinuxDirent64 *entry = reinterpret_cast<const LinuxDirent64 *>(buffer.get() + pos);
+            pos += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+
+            size_t length = strlen(name);
+            listing.entries.push_back({static_cast<uint32_t>(listing.names.size()), entry->d_type});
+            listing.names.insert(listing.names.end(), name, name + length + 1);
+        }
+    }
+}
+
+// Function to get how coarse a directory's time stamps may be, in nanoseconds: whole seconds
+// on file systems that keep no fraction (FAT keeps two), otherwise the kernel's clock tick
+static int64_t timestampGranule(const struct timespec &mtime)
+{
+    static const int64_t tick = []()
+    {
+        struct timespec resolution;
+        if (clock_getres(CLOCK_REALTIME_COARSE, &resolution) == -1)
+            return int64_t(10000000);
+        return int64_t(resolution.tv_sec) * 1000000000 + resolution.tv_nsec;
+    }();
+    return mtime.tv_nsec == 0 ? 2000000000 : tick;
+}
+
+// Function to get the listing of a directory, reading it again only if its modification time
+// changed. A change in the same timestamp granule as the read leaves the time as it was, so a
+// listing read within one granule of the directory's last change is read again next time.
+static shared_ptr<const Listing> directoryListing(const string &dir)
+{
+    struct stat st;
+    if (stat(dir.c_str(), &st) == -1 || !S_ISDIR(st.st_mode))
+    {
+        errno = 0;
+        return nullptr;
+    }
+
+    DirectoryKey key = {st.st_dev, st.st_ino};
+    auto it = listings.find(key);
+    if (it != listings.end() && it->second->settled && it->second->mtime.tv_sec == st.st_mtim.tv_sec &&
+        it->second->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        return it->second;
+
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        errno = 0;
+        return nullptr;
+    }
+
+    // Read the time before the names, a change while reading makes the next use read again
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    shared_ptr<Listing> listing = make_shared<Listing>();
+    bool ok = fstat(fd, &st) == 0 && readListing(fd, *listing);
+    close(fd);
+    if (!ok)
+    {
+        errno = 0;
+        return nullptr;
+    }
+    listing->mtime = st.st_mtim;
+    int64_t age = (int64_t(now.tv_sec) - st.st_mtim.tv_sec) * 1000000000 + (now.tv_nsec - st.st_mtim.tv_nsec);
+    listing->settled = age >= timestampGranule(st.st_mtim);
+
+    const char *names = listing->names.data();
+    sort(listing->entries.begin(), listing->entries.end(),
+         [names](const ListingEntry &a, const ListingEntry &b) { return strcmp(names + a.offset, names + b.offset) < 0; });
+
+    if (it != listings.end())
+    {
+        cachedBytes -= it->second->names.size();
+    }
+    cachedBytes += listing->names.size();
+    listings[key] = listing;
+    return listing;
+}
+
+// Function to match a character against the bracket expression at p, which ends before 'end'.
+// Sets 'length' to the size of the expression, returns false if it is not one.
+static bool matchBracket(const char *p, const char *end, char c, size_t &length, bool &matched)
+{
+    const char *q = p + 1;
+    bool negate = q < end && (*q == '!' || *q == '^');
+    q += negate ? 1 : 0;
+    const char *first = q; // A ']' right after the '[' is a member
+    bool found = false;
+    while (q < end && (*q != ']' || q == first))
+    {
+        unsigned char low = *q++;
+        if (low == '\\' && q < end)
+            low = *q++;
+        unsigned char high = low;
+        if (q + 1 < end && *q == '-' && q[1] != ']')
+        {
+            q++;
+            high = *q++;
+            if (high == '\\' && q < end)
+                high = *q++;
+        }
+        found = found || (static_cast<unsigned char>(c) >= low && static_cast<unsigned char>(c) <= high);
+    }
+    if (q >= end)
+        return false;
+    length = q - p + 1;
+    matched = found != negate && c != '/';
+    return true;
+}
+
+// Function to match a file name against one component of a pattern. '*' and '?' do not match a
+// leading '.', escaped characters match themselves.
+static bool matchName(const char *p, const char *end, const char *name)
+{
+    if (name[0] == '.' && !(p < end && (*p == '.' || (*p == '\\' && p + 1 < end && p[1] == '.'))))
+        return false;
+
+    const char *starP = nullptr; // Pattern after the last '*'
+    const char *starN = nullptr; // Name position that '*' was last tried at
+    const char *n = name;
+    while (*n != '\0')
+    {
+        if (p < end && *p == '*')
+        {
+            starP = ++p;
+            starN = n;
+            continue;
+        }
+        if (p < end)
+        {
+            char c = *p;
+            size_t length = 1;
+            bool matched = true;
+            if (c != '?' && (c != '[' || !matchBracket(p, end, *n, length, matched)))
+            {
+                if (c == '\\' && p + 1 < end)
+                {
+                    c = p[1];
+                    length = 2;
+                }
+                matched = c == *n;
+            }
+            if (matched)
+            {
+                p += length;
+                n++;
+                continue;
+            }
+        }
+
+        // Let the last '*' take one more character and try again from there
+        if (starP == nullptr)
+            return false;
+        p = starP;
+        n = ++starN;
+    }
+    while (p < end && *p == '*')
+    {
+        p++;
+    }
+    return p == end;
+}
+
+// Function to check whether a pattern component holds an unescaped '*', '?' or '['
+static bool hasPattern(string_view component)
+{
+    for (size_t i = 0; i < component.size(); i++)
+    {
+        if (component[i] == '\\')
+            i++;
+        else if (component[i] == '*' || component[i] == '?' || component[i] == '[')
+            return true;
+    }
+    return false;
+}
+
+// Function to remove the escapes of a component without patterns
+static void appendUnescaped(string &path, string_view component)
+{
+    for (size_t i = 0; i < component.size(); i++)
+    {
+        if (component[i] == '\\' && i + 1 < component.size())
+            i++;
+        path += component[i];
+    }
+}
+
+// Function to check whether a path is a directory and not a symlink to one
+static bool isRealDirectory(const string &path)
+{
+    struct stat st;
+    bool directory = lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    errno = 0;
+    return directory;
+}
+
+// Function to check whether a listed entry is a directory, following symlinks like the shell does
+static bool isDirectory(const string &path, uint8_t type)
+{
+    if (type == DT_DIR)
+        return true;
+    if (type != DT_UNKNOWN && type != DT_LNK)
+        return false;
+    struct stat st;
+    bool directory = stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    errno = 0;
+    return directory;
+}
+
+namespace
+{
+    // State of one glob expansion
+    struct GlobSearch
+    {
+        vector<string_view> components; // Pattern split at '/'
+        bool directoriesOnly;           // The pattern ended in '/'
+        Arena &arena;
+        vector<string_view> &matches;
+        size_t found = 0;
+
+        // Function to add 'path' as a match
+        void emit(const string &path)
+        {
+            string_view match = arena.copy(directoriesOnly ? path + "/" : path);
+            matches.push_back(match);
+            found++;
+        }
+
+        // Function to match components k onward below 'path', which is "" or ends in '/'
+        void walk(string &path, size_t k, bool exists)
+        {
+            if (k == components.size())
+            {
+                if (path.empty())
+                    return;
+                string result = path.substr(0, path.size() - 1);
+                struct stat st;
+                if ((exists || lstat(result.c_str(), &st) == 0) &&
+                    (!directoriesOnly || isDirectory(result, DT_UNKNOWN)))
+                {
+                    emit(result);
+                }
+                errno = 0;
+                return;
+            }
+
+            string_view component = components[k];
+            size_t base = path.size();
+            if (!hasPattern(component))
+            {
+                appendUnescaped(path, component);
+                path += '/';
+                walk(path, k + 1, false);
+                path.resize(base);
+                return;
+            }
+
+            shared_ptr<const Listing> listing = directoryListing(path.empty() ? "." : path);
+            if (listing == nullptr)
+                return;
+
+            // '**' alone matches any number of directories, itself included, without following
+            // symlinks. As the last component it matches everything below.
+            if (component == "**")
+            {
+                bool everything = k + 1 == components.size() && !directoriesOnly;
+                if (!everything)
+                {
+                    walk(path, k + 1, true);
+                }
+                for (const auto &entry : listing->entries)
+                {
+                    const char *name = listing->names.data() + entry.offset;
+                    if (name[0] == '.')
+                        continue;
+                    path.append(name);
+                    if (everything)
+                    {
+                        emit(path);
+                    }
+                    if (entry.type == DT_DIR || (entry.type == DT_UNKNOWN && isRealDirectory(path)))
+                    {
+                        path += '/';
+                        walk(path, k, true);
+                    }
+                    path.resize(base);
+                }
+                return;
+            }
+
+            bool last = k + 1 == components.size();
+            for (const auto &entry : listing->entries)
+            {
+                const char *name = listing->names.data() + entry.offset;
+                if (!matchName(component.data(), component.data() + component.size(), name))
+                    continue;
+                path.append(name);
+                if (last && !directoriesOnly)
+                {
+                    emit(path);
+                }
+                else if (isDirectory(path, entry.type))
+                {
+                    path += '/';
+                    walk(path, k + 1, true);
+                }
+                path.resize(base);
+            }
+        }
+    };
+}
+
+// Function to expand a pattern to the paths it matches, in sorted order, appending them to
+// 'matches' with their text in 'arena'. Escaped characters in the pattern are literal.
+// Returns the number of matches, 0 leaves 'matches' unchanged.
+size_t expandGlob(string_view pattern, Arena &arena, vector<string_view> &matches)
+{
+    TraceSpan span("glob");
+    if (cachedBytes > CACHE_LIMIT)
+    {
+        clearGlobCache();
+    }
+    GlobSearch search = {{}, false, arena, matches};
+    string path;
+    size_t start = 0;
+    if (!pattern.empty() && pattern[0] == '/')
+    {
+        path = "/";
+        start = 1;
+    }
+
+    while (start < pattern.size())
+    {
+        size_t slash = pattern.find('/', start);
+        if (slash == string_view::npos)
+            slash = pattern.size();
+        if (slash > start)
+        {
+            search.components.push_back(pattern.substr(start, slash - start));
+        }
+        search.directoriesOnly = slash < pattern.size() && slash + 1 == pattern.size();
+        start = slash + 1;
+    }
+
+    if (!search.components.empty())
+    {
+        size_t first = matches.size();
+        search.walk(path, 0, true);
+
+        // Each listing is in order, but across directories "a/x" comes out before "a.b/x"
+        // and '**' emits a directory's files before those below it
+        if (search.components.size() > 1)
+        {
+            sort(matches.begin() + first, matches.end());
+        }
+    }
+    return search.found;
+}
+
+// Function to drop every cached directory listing
+void clearGlobCache()
+{
+    listings.clear();
+    cachedBytes = 0;
+}
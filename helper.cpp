@@ -25,44 +25,137 @@ Environment::Environment()
 {
     for (char **env = environ; *env != nullptr; env++)
     {
-        string envStr(*env);
-        size_t pos = envStr.find('=');
-        if (pos != string::npos)
+        const char *equals = strchr(*env, '=');
+        if (equals != nullptr)
         {
-            vars[envStr.substr(0, pos)] = envStr.substr(pos + 1);
+            // Filled directly, the command hash may not be constructed yet
+            Variable &var = slots[intern(string(*env, equals - *env))];
+            setCount += var.set ? 0 : 1;
+            var.value = equals + 1;
+            var.set = true;
         }
     }
 }
 
+// Function to get the slot of a name, adding an unset slot for a new name
+uint32_t Environment::intern(const string &name)
+{
+    auto it = index.find(name);
+    if (it != index.end())
+        return it->second;
+
+    uint32_t slot = static_cast<uint32_t>(slots.size());
+    slots.push_back({name, "", false});
+    index.emplace(name, slot);
+    return slot;
+}
+
+// Function to get the value in a slot, nullptr if the variable is unset
+const string *Environment::lookup(uint32_t slot) const
+{
+    return slot < slots.size() && slots[slot].set ? &slots[slot].value : nullptr;
+}
+
+// Set the variable in a slot. Children see it through envp(), libc's environment is not touched.
+bool Environment::set(uint32_t slot, const string &value)
+{
+    Variable &var = slots[slot];
+    if (var.set && var.value == value)
+        return true;
+    setCount += var.set ? 0 : 1;
+    var.value = value;
+    var.set = true;
+    generation++;
+    if (var.name == "PATH")
+    {
+        commandHash.clear(); // Remembered locations may no longer be first on PATH
+    }
+    return true;
+}
+
 // Set an environment variable
 bool Environment::set(const string &name, const string &value)
 {
-    vars[name] = value;
-    return setenv(name.c_str(), value.c_str(), 1) == 0;
+    return set(intern(name), value);
 }
 
 // Unset an environment variable
 bool Environment::unset(const string &name)
 {
-    auto it = vars.find(name);
-    if (it != vars.end())
+    auto it = index.find(name);
+    if (it == index.end() || !slots[it->second].set)
+        return false;
+
+    Variable &var = slots[it->second];
+    var.set = false;
+    var.value.clear();
+    setCount--;
+    generation++;
+    if (name == "PATH")
     {
-        vars.erase(it);
-        unsetenv(name.c_str());
-        return true;
+        commandHash.clear();
     }
-    return false;
+    return true;
 }
 
 // Retrieve an environment variable's value
 string Environment::get(const string &name) const
 {
-    auto it = vars.find(name);
-    return (it != vars.end()) ? it->second : "";
+    auto it = index.find(name);
+    const string *value = it != index.end() ? lookup(it->second) : nullptr;
+    return value != nullptr ? *value : "";
+}
+
+// Check whether a variable is set, even to an empty value
+bool Environment::contains(const string &name) const
+{
+    auto it = index.find(name);
+    return it != index.end() && lookup(it->second) != nullptr;
 }
 
-// Get all stored environment variables
-const map<string, string> &Environment::getAll() const
+// Get all set variables, sorted by name
+map<string, string> Environment::getAll() const
 {
+    map<string, string> vars;
+    for (const auto &var : slots)
+    {
+        if (var.set)
+        {
+            vars.emplace(var.name, var.value);
+        }
+    }
     return vars;
-}
\ No newline at end of file
+}
+
+// Function to get the NUL-terminated NAME=value array for execve and posix_spawn. It is
+// rebuilt only when a variable changed since the last call.
+char *const *Environment::envp()
+{
+    if (builtGeneration != generation)
+    {
+        entries.resize(setCount);
+        size_t i = 0;
+        for (const auto &var : slots)
+        {
+            if (var.set)
+            {
+                entries[i].assign(var.name).append(1, '=').append(var.value);
+                i++;
+            }
+        }
+        envpArray.resize(setCount + 1);
+        for (i = 0; i < setCount; i++)
+        {
+            envpArray[i] = &entries[i][0];
+        }
+        envpArray[setCount] = nullptr;
+        builtGeneration = generation;
+    }
+    return envpArray.data();
+}
+
+// Function to get a number that changes whenever a variable is set or unset
+uint64_t Environment::version() const
+{
+    return generation;
+}
@@ -0,0 +1,716 @@
+#include "mish.h"
+#include <algorithm>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+using namespace std;
+
+// Global command history
+History history;
+
+namespace
+{
+    // Layout of the index file next to the history: an IndexHeader, then segments. A segment
+    // covers whole records [from, to) of the history and holds, in order, its SegmentHeader, the
+    // history offset of every block, the trigram table sorted by trigram, and the posting lists.
+    // A posting list names the blocks holding a trigram, newest first, as varint gaps.
+    const uint32_t INDEX_MAGIC = 0x5849484d; // "MHIX"
+    const uint32_t INDEX_VERSION = 1;
+    const size_t BLOCK_LINES = 16;           // Lines per block, a block is scanned to confirm a match
+    const size_t SEGMENT_BYTES = 32768;      // Unindexed history worth a segment of its own
+    const size_t BACKGROUND_BYTES = 1 << 21; // Unindexed history left to a background rebuild
+    const size_t MAX_SEGMENTS = 32;          // Past this the index is rebuilt as one segment
+
+    struct IndexHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t device; // History file the index belongs to
+        uint64_t inode;
+    };
+
+    struct SegmentHeader
+    {
+        uint64_t from;     // History bytes covered
+        uint64_t to;
+        uint64_t size;     // Bytes of the segment, a multiple of 8
+        uint32_t blocks;
+        uint32_t trigrams;
+    };
+
+    struct TrigramEntry
+    {
+        uint32_t trigram;
+        uint32_t count;    // Blocks in the posting list
+        uint64_t offset;   // Posting list, from the start of the segment
+    };
+}
+
+// Release the mappings and the files
+History::~History()
+{
+    close();
+}
+
+// Function to get the history file: MISH_HISTFILE, or ~/.mish_history
+static string historyPath()
+{
+    if (env.contains("MISH_HISTFILE"))
+        return env.get("MISH_HISTFILE");
+    string home = env.get("HOME");
+    return home.empty() ? "" : home + "/.mish_history";
+}
+
+// Function to get the key of the three bytes at 'p'
+static uint32_t trigram(const char *p)
+{
+    return static_cast<uint32_t>(static_cast<unsigned char>(p[0])) << 16 |
+           static_cast<uint32_t>(static_cast<unsigned char>(p[1])) << 8 | static_cast<unsigned char>(p[2]);
+}
+
+// Function to append a number in 7-bit groups, low first, the high bit marking that more follow
+static void appendVarint(string &out, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        out += static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+// Function to build the index segment of the whole records in text[from, to)
+static string buildSegment(string_view text, size_t from, size_t to)
+{
+    vector<uint64_t> blockStarts;
+    unordered_map<uint32_t, vector<uint32_t>> lists; // Trigram to its blocks, oldest first
+    vector<uint32_t> seen;
+    for (size_t pos = from; pos < to;)
+    {
+        uint32_t block = static_cast<uint32_t>(blockStarts.size());
+        blockStarts.push_back(pos);
+        seen.clear();
+        for (size_t n = 0; n < BLOCK_LINES && pos < to; n++)
+        {
+            size_t end = text.find('\n', pos);
+            for (size_t i = pos; i + 3 <= end; i++)
+            {
+                seen.push_back(trigram(text.data() + i));
+            }
+            pos = end + 1;
+        }
+        sort(seen.begin(), seen.end());
+        seen.erase(unique(seen.begin(), seen.end()), seen.end());
+        for (uint32_t key : seen)
+        {
+            lists[key].push_back(block);
+        }
+    }
+
+    vector<TrigramEntry> entries;
+    entries.reserve(lists.size());
+    for (const auto &list : lists)
+    {
+        entries.push_back({list.first, static_cast<uint32_t>(list.second.size()), 0});
+    }
+    sort(entries.begin(), entries.end(), [](const TrigramEntry &a, const TrigramEntry &b) { return a.trigram < b.trigram; });
+
+    size_t tableEnd = sizeof(SegmentHeader) + blockStarts.size() * sizeof(uint64_t) + entries.size() * sizeof(TrigramEntry);
+    string postings;
+    for (auto &entry : entries)
+    {
+        entry.offset = tableEnd + postings.size();
+        const auto &blocks = lists[entry.trigram];
+        for (size_t i = blocks.size(); i-- > 0;)
+        {
+            appendVarint(postings, i + 1 == blocks.size() ? blocks[i] : blocks[i + 1] - blocks[i]);
+        }
+    }
+
+    SegmentHeader header = {from, to, 0, static_cast<uint32_t>(blockStarts.size()), static_cast<uint32_t>(entries.size())};
+    header.size = (tableEnd + postings.size() + 7) / 8 * 8;
+    string segment(header.size, '\0');
+    char *out = &segment[0];
+    memcpy(out, &header, sizeof(header));
+    memcpy(out + sizeof(header), blockStarts.data(), blockStarts.size() * sizeof(uint64_t));
+    memcpy(out + sizeof(header) + blockStarts.size() * sizeof(uint64_t), entries.data(), entries.size() * sizeof(TrigramEntry));
+    memcpy(out + tableEnd, postings.data(), postings.size());
+    return segment;
+}
+
+// Function to write a whole buffer, false on failure
+static bool writeAll(int fd, const string &data)
+{
+    size_t written = 0;
+    while (written < data.size())
+    {
+        ssize_t count = write(fd, data.data() + written, data.size() - written);
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        written += count;
+    }
+    return true;
+}
+
+// Function to rebuild the index of a history file as a single segment. The new index is written
+// next to the old one and renamed over it, so sessions reading the old one keep a valid mapping.
+// Holds the index lock meanwhile, so sessions skip appending segments until it is done.
+void History::buildIndex(const string &path)
+{
+    string indexPath = path + ".idx";
+    int lock = ::open(indexPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    int file = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat before, locked, st;
+    if (lock == -1 || file == -1 || fstat(lock, &before) == -1 || flock(lock, LOCK_EX) == -1 ||
+        stat(indexPath.c_str(), &locked) == -1 || locked.st_ino != before.st_ino || fstat(file, &st) == -1)
+    {
+        // Unusable, or another rebuild replaced the index while this one waited
+        if (lock != -1)
+            ::close(lock);
+        if (file != -1)
+            ::close(file);
+        errno = 0;
+        return;
+    }
+
+    size_t size = static_cast<size_t>(st.st_size);
+    void *mapped = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_SHARED, file, 0) : nullptr;
+    if (mapped != MAP_FAILED)
+    {
+        const char *data = static_cast<const char *>(mapped);
+        const char *last = size > 0 ? static_cast<const char *>(memrchr(data, '\n', size)) : nullptr;
+        size_t length = last == nullptr ? 0 : last - data + 1;
+
+        IndexHeader header = {INDEX_MAGIC, INDEX_VERSION, static_cast<uint64_t>(st.st_dev), static_cast<uint64_t>(st.st_ino)};
+        string index(reinterpret_cast<const char *>(&header), sizeof(header));
+        if (length > 0)
+        {
+            index += buildSegment(string_view(data, length), 0, length);
+        }
+        if (mapped != nullptr)
+        {
+            munmap(mapped, size);
+        }
+
+        string temporary = indexPath + ".tmp" + to_string(getpid());
+        int out = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        bool ok = out != -1 && writeAll(out, index);
+        if (out != -1)
+            ::close(out);
+        if (!ok || rename(temporary.c_str(), indexPath.c_str()) == -1)
+        {
+            unlink(temporary.c_str());
+        }
+    }
+    ::close(file);
+    ::close(lock);
+    errno = 0;
+}
+
+// Function to rebuild the index in a detached process, once per index file. The shell only
+// waits for the intermediate child, which exits at once.
+void History::requestRebuild()
+{
+    if (rebuildRequested || path.empty())
+        return;
+    rebuildRequested = true;
+    cout << flush;
+    pid_t child = fork();
+    if (child == 0)
+    {
+        if (fork() == 0)
+        {
+            setsid(); // Out of the terminal's signals
+            buildIndex(path);
+        }
+        _exit(0);
+    }
+    if (child > 0)
+    {
+        while (waitpid(child, nullptr, 0) == -1 && errno == EINTR)
+        {
+        }
+    }
+    errno = 0;
+}
+
+// Function to unmap the index
+void History::closeIndex()
+{
+    if (indexMapping != nullptr)
+    {
+        munmap(indexMapping, indexSize);
+    }
+    if (indexFd != -1)
+    {
+        ::close(indexFd);
+    }
+    indexFd = -1;
+    indexMapping = nullptr;
+    indexSize = 0;
+    indexInode = 0;
+    segments.clear();
+    indexedTo = 0;
+    indexUsable = false;
+}
+
+// Function to map the index and find its segments, reopening it when a rebuild replaced it and
+// remapping it when segments were appended. An index for another file, or for more history than
+// there is, is not used.
+void History::loadIndex()
+{
+    struct stat st;
+    if (stat(indexPath.c_str(), &st) == -1)
+    {
+        errno = 0;
+        closeIndex();
+        indexUsable = true; // None yet, the first segment creates it
+        return;
+    }
+    if (indexFd != -1 && static_cast<uint64_t>(st.st_ino) == indexInode && static_cast<size_t>(st.st_size) == indexSize)
+        return;
+
+    if (indexFd == -1 || static_cast<uint64_t>(st.st_ino) != indexInode)
+    {
+        closeIndex();
+        indexFd = ::open(indexPath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (indexFd == -1 || fstat(indexFd, &st) == -1)
+        {
+            errno = 0;
+            closeIndex();
+            return;
+        }
+        indexInode = static_cast<uint64_t>(st.st_ino);
+        rebuildRequested = false; // A new index file, it may need its own rebuild later
+    }
+    else if (indexMapping != nullptr)
+    {
+        munmap(indexMapping, indexSize);
+        indexMapping = nullptr;
+    }
+
+    // The index only grows while it is this file, a rebuild replaces the file instead
+    indexSize = static_cast<size_t>(st.st_size);
+    segments.clear();
+    indexedTo = 0;
+    indexParsed = 0;
+    indexUsable = indexSize == 0; // Empty until a session writes its first segment
+    if (indexSize == 0)
+        return;
+    void *mapped = mmap(nullptr, indexSize, PROT_READ, MAP_SHARED, indexFd, 0);
+    if (mapped == MAP_FAILED)
+    {
+        errno = 0;
+        indexSize = 0;
+        return;
+    }
+    indexMapping = static_cast<char *>(mapped);
+
+    struct stat file;
+    const IndexHeader *header = reinterpret_cast<const IndexHeader *>(indexMapping);
+    if (indexSize < sizeof(IndexHeader) || header->magic != INDEX_MAGIC || header->version != INDEX_VERSION ||
+        fstat(fd, &file) == -1 || header->device != static_cast<uint64_t>(file.st_dev) ||
+        header->inode != static_cast<uint64_t>(file.st_ino))
+    {
+        errno = 0;
+        return;
+    }
+    indexUsable = true;
+    for (indexParsed = sizeof(IndexHeader); indexParsed + sizeof(SegmentHeader) <= indexSize;)
+    {
+        const SegmentHeader *segment = reinterpret_cast<const SegmentHeader *>(indexMapping + indexParsed);
+        if (segment->from != indexedTo || segment->size < sizeof(SegmentHeader) || segment->size > indexSize - indexParsed)
+        {
+            indexUsable = false; // Damaged, rebuild it
+            break;
+        }
+        if (segment->to > length)
+            break; // Lines appended since this session last looked, used once it sees them
+        segments.push_back(indexParsed);
+        indexedTo = segment->to;
+        indexParsed += segment->size;
+    }
+}
+
+// Function to index the history no segment covers yet. A little is indexed here, as a segment
+// appended under the index lock; a lot, a stale index or too many segments go to a rebuild.
+void History::extendIndex()
+{
+    if (fd == -1 || length - indexedTo < SEGMENT_BYTES)
+        return;
+    if (!indexUsable || length - indexedTo >= BACKGROUND_BYTES || segments.size() >= MAX_SEGMENTS)
+    {
+        requestRebuild();
+        return;
+    }
+
+    int file = ::open(indexPath.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (file == -1)
+    {
+        errno = 0;
+        return;
+    }
+    // Skip this time if a rebuild holds the lock
+    struct stat locked, current;
+    if (flock(file, LOCK_EX | LOCK_NB) == 0 && fstat(file, &locked) == 0 && stat(indexPath.c_str(), &current) == 0 &&
+        locked.st_ino == current.st_ino)
+    {
+        sync(); // Another session may have indexed the same lines meanwhile
+        if (indexUsable && (indexSize == 0 || indexParsed == indexSize) && length - indexedTo >= SEGMENT_BYTES)
+        {
+            string data;
+            if (indexSize == 0)
+            {
+                IndexHeader header = {INDEX_MAGIC, INDEX_VERSION, 0, 0};
+                struct stat st;
+                fstat(fd, &st);
+                header.device = static_cast<uint64_t>(st.st_dev);
+                header.inode = static_cast<uint64_t>(st.st_ino);
+                data.assign(reinterpret_cast<const char *>(&header), sizeof(header));
+            }
+            data += buildSegment(text(), indexedTo, length);
+            writeAll(file, data);
+        }
+        flock(file, LOCK_UN);
+    }
+    ::close(file);
+    errno = 0;
+    loadIndex();
+}
+
+// Function to open the history file. Only the mappings are set up, so opening takes the same
+// time however long the history is. Without a usable file the history lives in memory.
+void History::open()
+{
+    close();
+    path = historyPath();
+    if (!path.empty())
+    {
+        fd = ::open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        indexPath = path + ".idx";
+    }
+    errno = 0;
+    sync();
+}
+
+// Function to unmap and close the history file and its index
+void History::close()
+{
+    closeIndex();
+    if (mapping != nullptr)
+    {
+        munmap(mapping, mappingSize);
+    }
+    if (fd != -1)
+    {
+        ::close(fd);
+    }
+    fd = -1;
+    mapping = nullptr;
+    mappingSize = 0;
+    length = 0;
+    memory.clear();
+    path.clear();
+    indexPath.clear();
+    rebuildRequested = false;
+    errno = 0;
+}
+
+// Function to map whatever other sessions appended since the last call. Only whole records
+// count; a record being written is picked up next time. A file that shrank is mapped afresh and
+// 'generation' changes, since offsets handed out before are no longer valid. Reading a mapped
+// page another process truncated away raises SIGBUS; checking the size here, before every use,
+// leaves only the time between this check and the read.
+void History::sync()
+{
+    if (fd == -1)
+    {
+        length = memory.size();
+        return;
+    }
+    struct stat st;
+    flock(fd, LOCK_SH);
+    int statResult = fstat(fd, &st);
+    flock(fd, LOCK_UN);
+    if (statResult == -1)
+    {
+        errno = 0;
+        return;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    if (size < mappingSize)
+    {
+        // Truncated by someone else, start over
+        munmap(mapping, mappingSize);
+        mapping = nullptr;
+        mappingSize = 0;
+        length = 0;
+        generation++;
+        rebuildRequested = false; // The index describes the old contents
+        shrunk = true;
+    }
+    if (size > mappingSize)
+    {
+        void *grown = mapping == nullptr ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0)
+                                         : mremap(mapping, mappingSize, size, MREMAP_MAYMOVE);
+        if (grown == MAP_FAILED)
+        {
+            errno = 0;
+            return;
+        }
+        mapping = static_cast<char *>(grown);
+        mappingSize = size;
+    }
+    const char *end = mappingSize > 0 ? static_cast<const char *>(memrchr(mapping, '\n', mappingSize)) : nullptr;
+    length = end == nullptr ? 0 : end - mapping + 1;
+
+    loadIndex();
+    if (shrunk || length - indexedTo >= BACKGROUND_BYTES || (!indexUsable && length >= SEGMENT_BYTES))
+    {
+        shrunk = false;
+        requestRebuild();
+    }
+}
+
+// Function to get a number that changes whenever offsets from before are no longer valid
+uint64_t History::version() const
+{
+    return generation;
+}
+
+// Function to get the whole history, one line per record
+string_view History::text() const
+{
+    return fd == -1 ? string_view(memory.data(), length) : string_view(mapping, length);
+}
+
+// Function to get the line starting at 'start', without its newline
+string_view History::line(size_t start) const
+{
+    string_view all = text();
+    size_t end = all.find('\n', start);
+    return all.substr(start, (end == string_view::npos ? all.size() : end) - start);
+}
+
+// Function to find where the line before the one starting at 'start' begins, npos at the oldest
+size_t History::previous(size_t start) const
+{
+    if (start == 0 || start > length)
+        return string_view::npos;
+    const char *data = text().data();
+    const char *newline = start >= 2 ? static_cast<const char *>(memrchr(data, '\n', start - 1)) : nullptr;
+    return newline == nullptr ? 0 : newline - data + 1;
+}
+
+// Function to find where the line after the one starting at 'start' begins, npos at the newest
+size_t History::next(size_t start) const
+{
+    size_t end = text().find('\n', start);
+    return end == string_view::npos || end + 1 >= length ? string_view::npos : end + 1;
+}
+
+// Function to append a line. The record is one O_APPEND write under an exclusive lock, so
+// sessions writing at the same time never interleave. Empty lines and repeats of the last line
+// are skipped.
+void History::add(string_view entry)
+{
+    if (entry.empty() || entry.find('\n') != string_view::npos)
+        return;
+    sync();
+    size_t last = previous(length);
+    if (last != string_view::npos && line(last) == entry)
+        return;
+
+    string record(entry);
+    record += '\n';
+    if (fd == -1)
+    {
+        memory += record;
+        sync();
+        return;
+    }
+    flock(fd, LOCK_EX);
+    ssize_t written;
+    while ((written = write(fd, record.data(), record.size())) == -1 && errno == EINTR)
+    {
+    }
+    flock(fd, LOCK_UN);
+    errno = 0;
+    sync();
+    extendIndex();
+}
+
+// Function to find the last line of text[from, to) containing 'query'. Returns its start, or npos.
+// The range is searched with memmem in chunks from the end, so a recent match is found early.
+static size_t findLast(string_view all, string_view query, size_t from, size_t to)
+{
+    const size_t chunk = 65536;
+    const char *data = all.data();
+    for (size_t end = to; end > from && end - from >= query.size();)
+    {
+        size_t start = end - from > chunk ? end - chunk : from;
+        // Overlap the next chunk by the query, less a byte, for matches across the boundary
+        size_t stop = min(end + query.size() - 1, to);
+        const char *found = nullptr;
+        for (const char *p = data + start; (p = static_cast<const char *>(memmem(p, data + stop - p, query.data(), query.size()))) != nullptr; p++)
+        {
+            found = p;
+        }
+        if (found != nullptr)
+        {
+            // A match never spans lines, the query has no newline
+            const char *newline = static_cast<const char *>(memrchr(data, '\n', found - data));
+            return newline == nullptr ? 0 : newline - data + 1;
+        }
+        end = start;
+    }
+    return string_view::npos;
+}
+
+namespace
+{
+    // Reader of one posting list, newest block first
+    struct PostingCursor
+    {
+        const unsigned char *p;
+        const unsigned char *end;
+        uint32_t remaining;
+        uint32_t block = 0;
+        bool started = false;
+
+        // Function to step to the next older block, false at the end of the list
+        bool next()
+        {
+            if (remaining == 0 || p >= end)
+                return false;
+            uint32_t value = 0;
+            for (int shift = 0; p < end; shift += 7)
+            {
+                value |= static_cast<uint32_t>(*p & 0x7f) << shift;
+                if ((*p++ & 0x80) == 0)
+                    break;
+            }
+            block = started ? block - value : value;
+            started = true;
+            remaining--;
+            return true;
+        }
+
+        // Function to step to the newest block at or below 'target', false if there is none
+        bool seek(uint32_t target)
+        {
+            while (!started || block > target)
+            {
+                if (!next())
+                    return false;
+            }
+            return true;
+        }
+    };
+}
+
+// Function to search one segment for the newest line ending by 'end' that contains 'query', which
+// is at least three bytes. The rarest trigram's blocks are walked newest first; a block also in
+// every other trigram's list is scanned for the query. The other lists are only read as far as
+// the walk has got, so a recent match is found without reading them whole.
+static size_t searchSegment(const char *segment, string_view all, string_view query, size_t end)
+{
+    const SegmentHeader *header = reinterpret_cast<const SegmentHeader *>(segment);
+    const uint64_t *blockStarts = reinterpret_cast<const uint64_t *>(segment + sizeof(SegmentHeader));
+    const TrigramEntry *table = reinterpret_cast<const TrigramEntry *>(blockStarts + header->blocks);
+    const TrigramEntry *tableEnd = table + header->trigrams;
+    const unsigned char *segmentEnd = reinterpret_cast<const unsigned char *>(segment + header->size);
+
+    vector<const TrigramEntry *> entries;
+    for (size_t i = 0; i + 3 <= query.size(); i++)
+    {
+        uint32_t key = trigram(query.data() + i);
+        const TrigramEntry *entry = lower_bound(table, tableEnd, key, [](const TrigramEntry &e, uint32_t k) { return e.trigram < k; });
+        if (entry == tableEnd || entry->trigram != key)
+            return string_view::npos; // Some trigram is in no block
+        if (entry->count < header->blocks) // One in every block rules nothing out
+            entries.push_back(entry);
+    }
+    sort(entries.begin(), entries.end(), [](const TrigramEntry *a, const TrigramEntry *b) { return a->count != b->count ? a->count < b->count : a < b; });
+    entries.erase(unique(entries.begin(), entries.end()), entries.end());
+
+    vector<PostingCursor> cursors;
+    for (const TrigramEntry *entry : entries)
+    {
+        cursors.push_back({reinterpret_cast<const unsigned char *>(segment) + entry->offset, segmentEnd, entry->count});
+    }
+
+    // Without a selective trigram every block is a candidate
+    uint32_t candidate = header->blocks;
+    while (true)
+    {
+        if (cursors.empty())
+        {
+            if (candidate == 0)
+                return string_view::npos;
+            candidate--;
+        }
+        else if (cursors[0].next())
+        {
+            candidate = cursors[0].block;
+        }
+        else
+        {
+            return string_view::npos;
+        }
+        if (blockStarts[candidate] >= end)
+            continue;
+
+        bool everywhere = true;
+        for (size_t k = 1; k < cursors.size() && everywhere; k++)
+        {
+            if (!cursors[k].seek(candidate))
+                return string_view::npos; // That trigram is in no older block
+            everywhere = cursors[k].block == candidate;
+        }
+        if (!everywhere)
+            continue;
+
+        size_t blockEnd = candidate + 1 < header->blocks ? blockStarts[candidate + 1] : header->to;
+        size_t found = findLast(all, query, blockStarts[candidate], min(blockEnd, end));
+        if (found != string_view::npos)
+            return found;
+    }
+}
+
+// Function to find the newest line that starts before 'before' and contains 'query'. Returns its
+// start, or npos. History past the index is scanned, then the index segments newest first.
+// Queries under three bytes have no trigram and scan back from the newest line.
+size_t History::search(string_view query, size_t before)
+{
+    sync();
+    if (query.empty())
+        return string_view::npos;
+    before = min(before, length);
+    string_view all = text();
+    size_t end = before == 0 ? 0 : all.find('\n', before - 1) + 1; // Lines starting before 'before'
+
+    bool indexed = fd != -1 && indexUsable && query.size() >= 3;
+    size_t found = findLast(all, query, indexed ? min(indexedTo, end) : 0, end);
+    if (found != string_view::npos || !indexed)
+        return found;
+
+    for (size_t i = segments.size(); i-- > 0;)
+    {
+        const char *segment = indexMapping + segments[i];
+        if (reinterpret_cast<const SegmentHeader *>(segment)->from >= end)
+            continue;
+        found = searchSegment(segment, all, query, end);
+        if (found != string_view::npos)
+            return found;
+    }
+    return string_view::npos;
+}
+
+// Function to get the end of the history, where browsing and searching start
+size_t History::size() const
+{
+    return length;
+}
@@ -0,0 +1,531 @@
+#include "mish.h"
+#include <algorithm>
+using namespace std;
+
+// Global job table
+JobTable jobs;
+
+// Process slots shared with the SIGCHLD handler. Only background processes are registered here,
+// so the handler never reaps a foreground child that executePipeline is waiting for.
+namespace
+{
+    enum SlotState
+    {
+        SLOT_FREE = 0,
+        SLOT_RUNNING,
+        SLOT_STOPPED,
+        SLOT_EXITED
+    };
+
+    struct ProcSlot
+    {
+        volatile pid_t pid;
+        volatile int status;
+        volatile sig_atomic_t state;
+    };
+
+    const int MAX_SLOTS = 1024;
+    ProcSlot slots[MAX_SLOTS];
+    volatile sig_atomic_t slotsInUse = 0; // Slots not free
+    volatile sig_atomic_t slotLimit = 0;  // No slot at or past this index is in use
+    volatile sig_atomic_t childSignals = 0; // Bumped by every SIGCHLD
+}
+
+// SIGCHLD handler: reap registered background processes without blocking. Processes with a
+// pidfd have no slot, so with pidfds the scan is empty and the handler only wakes the supervisor.
+static void sigchldHandler(int)
+{
+    int savedErrno = errno;
+    childSignals = childSignals + 1;
+    for (int i = 0; i < slotLimit; i++)
+    {
+        if (slots[i].state != SLOT_RUNNING && slots[i].state != SLOT_STOPPED)
+            continue;
+
+        int status;
+        pid_t result = waitpid(slots[i].pid, &status, WNOHANG | WUNTRACED | WCONTINUED);
+        if (result != slots[i].pid)
+            continue;
+
+        if (WIFSTOPPED(status))
+        {
+            slots[i].state = SLOT_STOPPED;
+        }
+        else if (WIFCONTINUED(status))
+        {
+            slots[i].state = SLOT_RUNNING;
+        }
+        else
+        {
+            slots[i].status = status;
+            slots[i].state = SLOT_EXITED;
+        }
+    }
+    errno = savedErrno;
+    notifySupervisor();
+}
+
+// Function to give a process a handler slot, -1 if all are taken. SIGCHLD must be blocked.
+static int claimSlot(pid_t pid, SlotState state)
+{
+    for (int slot = 0; slot < MAX_SLOTS; slot++)
+    {
+        if (slots[slot].state != SLOT_FREE)
+            continue;
+        slots[slot].pid = pid;
+        slots[slot].status = 0;
+        slots[slot].state = state;
+        slotsInUse = slotsInUse + 1;
+        if (slot >= slotLimit)
+        {
+            slotLimit = slot + 1;
+        }
+        return slot;
+    }
+    return -1;
+}
+
+// Function to free a handler slot. SIGCHLD must be blocked.
+static void releaseSlot(int slot)
+{
+    slots[slot].state = SLOT_FREE;
+    slotsInUse = slotsInUse - 1;
+    if (slotsInUse == 0)
+    {
+        slotLimit = 0;
+    }
+}
+
+// Helper to block SIGCHLD while the slots are inspected or changed
+class ChildSignalBlock
+{
+    sigset_t oldMask;
+
+public:
+    ChildSignalBlock()
+    {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mask, &oldMask);
+    }
+    ~ChildSignalBlock()
+    {
+        sigprocmask(SIG_SETMASK, &oldMask, nullptr);
+    }
+};
+
+// Function to convert a wait status into a shell exit status
+int exitStatusOf(int status)
+{
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// Install the SIGCHLD handler and ignore the terminal signals the shell itself must survive
+void JobTable::init()
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchldHandler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, nullptr);
+
+    // Needed to take the terminal back with tcsetpgrp after 'fg'
+    signal(SIGTTOU, SIG_IGN);
+}
+
+// Register a background pipeline, returns the new job
+const Job &JobTable::add(pid_t pgid, const vector<pid_t> &pids, const string &command)
+{
+    Job job;
+    job.id = nextId++;
+    job.serial = nextSerial++;
+    job.pgid = pgid;
+    job.command = command;
+
+    ChildSignalBlock block;
+    for (pid_t pid : pids)
+    {
+        if (pid == -1)
+            continue;
+
+        JobProcess proc;
+        proc.pid = pid;
+        proc.slot = -1;
+
+        // Prefer a pidfd watched by the supervisor, the handler slots are the fallback
+        proc.pidfd = supervisor.watch(pid, true);
+        if (proc.pidfd != -1)
+        {
+            job.procs.push_back(proc);
+            continue;
+        }
+
+        proc.slot = claimSlot(pid, SLOT_RUNNING); // Without one the process is polled from update()
+        job.procs.push_back(proc);
+    }
+    table.push_back(job);
+    for (auto &proc : table.back().procs)
+    {
+        if (proc.pidfd != -1)
+        {
+            processes[proc.pid] = {&table.back(), &proc};
+        }
+    }
+
+    // A child may have exited before it was registered
+    sigchldHandler(SIGCHLD);
+    return table.back();
+}
+
+// Mark a process as finished and stop watching its pidfd
+void JobTable::finish(JobProcess &proc, int status)
+{
+    proc.status = status;
+    proc.done = true;
+    proc.stopped = false;
+    if (proc.pidfd != -1)
+    {
+        processes.erase(proc.pid);
+    }
+    supervisor.unwatch(proc.pidfd);
+    proc.pidfd = -1;
+}
+
+// Reap one background process after the supervisor saw its pidfd become readable. The pid
+// index leads straight to the process, so this costs the same however many jobs there are.
+void JobTable::childExited(pid_t pid)
+{
+    auto it = processes.find(pid);
+    if (it == processes.end())
+        return;
+    Job &job = *it->second.first;
+    JobProcess &proc = *it->second.second;
+
+    int status;
+    if (waitpid(pid, &status, WNOHANG) != pid)
+    {
+        errno = 0;
+        return;
+    }
+    finish(proc, status);
+    if (all_of(job.procs.begin(), job.procs.end(), [](const JobProcess &p) { return p.done; }))
+    {
+        job.state = JOB_DONE;
+        job.status = exitStatusOf(job.procs.back().status);
+    }
+}
+
+// Function to drop a job's processes from the pid index before the job is erased
+void JobTable::forget(Job &job)
+{
+    for (const auto &proc : job.procs)
+    {
+        auto it = processes.find(proc.pid);
+        if (it != processes.end() && it->second.first == &job)
+        {
+            processes.erase(it);
+        }
+    }
+}
+
+// Copy process states from the handler slots into the job table. Every change of a child's
+// state raises SIGCHLD, so without one since the last call there is nothing to collect; script
+// mode calls this once per line. Exits of pidfd-watched processes come through childExited,
+// here they are only checked for stops and continues.
+void JobTable::update()
+{
+    if (table.empty() || childSignals == signalsSeen)
+        return;
+    signalsSeen = childSignals;
+    supervisor.poll();
+
+    ChildSignalBlock block;
+    for (auto &job : table)
+    {
+        if (job.state == JOB_DONE)
+            continue;
+
+        bool allDone = true;
+        bool anyStopped = false;
+        for (auto &proc : job.procs)
+        {
+            if (proc.done)
+                continue;
+
+            if (proc.pidfd != -1)
+            {
+                siginfo_t info;
+                info.si_pid = 0;
+                if (waitid(P_PID, proc.pid, &info, WSTOPPED | WCONTINUED | WNOHANG) == 0 && info.si_pid == proc.pid)
+                {
+                    proc.stopped = info.si_code != CLD_CONTINUED;
+                }
+                errno = 0;
+                anyStopped |= proc.stopped;
+            }
+            else if (proc.slot == -1)
+            {
+                int status;
+                if (waitpid(proc.pid, &status, WNOHANG | WUNTRACED | WCONTINUED) == proc.pid)
+                {
+                    if (WIFSTOPPED(status) || WIFCONTINUED(status))
+                    {
+                        proc.stopped = WIFSTOPPED(status);
+                    }
+                    else
+                    {
+                        finish(proc, status);
+                    }
+                }
+                anyStopped |= !proc.done && proc.stopped;
+            }
+            else if (slots[proc.slot].state == SLOT_EXITED)
+            {
+                finish(proc, slots[proc.slot].status);
+                releaseSlot(proc.slot);
+                proc.slot = -1;
+            }
+            else if (slots[proc.slot].state == SLOT_STOPPED)
+            {
+                anyStopped = true;
+            }
+            allDone &= proc.done;
+        }
+
+        if (allDone)
+        {
+            job.state = JOB_DONE;
+            job.status = job.procs.empty() ? 127 : exitStatusOf(job.procs.back().status);
+        }
+        else
+        {
+            job.state = anyStopped ? JOB_STOPPED : JOB_RUNNING;
+        }
+    }
+}
+
+// Print finished jobs (if requested) and drop them from the table
+void JobTable::report(bool print)
+{
+    update();
+    for (auto it = table.begin(); it != table.end();)
+    {
+        if (it->state != JOB_DONE)
+        {
+            ++it;
+            continue;
+        }
+        if (print)
+        {
+            string state = it->status == 0 ? "Done" : "Exit " + to_string(it->status);
+            cout << "[" << it->id << "]  " << left << setw(12) << state << right << it->command << endl;
+        }
+        forget(*it);
+        it = table.erase(it);
+    }
+    if (table.empty())
+    {
+        nextId = 1;
+    }
+}
+
+// Print all jobs for the 'jobs' built-in
+void JobTable::list()
+{
+    update();
+    for (const auto &job : table)
+    {
+        string state;
+        if (job.state == JOB_RUNNING)
+            state = "Running";
+        else if (job.state == JOB_STOPPED)
+            state = "Stopped";
+        else
+            state = job.status == 0 ? "Done" : "Exit " + to_string(job.status);
+        cout << "[" << job.id << "]  " << job.pgid << "  " << left << setw(12) << state << right
+             << job.command << endl;
+    }
+}
+
+// Find a job from a '%n' or PID argument, or the most recent job for an empty spec
+Job *JobTable::find(const string &spec)
+{
+    if (table.empty())
+    {
+        return nullptr;
+    }
+    if (spec.empty())
+    {
+        return &table.back();
+    }
+
+    bool byId = spec[0] == '%';
+    string number = byId ? spec.substr(1) : spec;
+    char *end = nullptr;
+    long value = strtol(number.c_str(), &end, 10);
+    if (number.empty() || *end != '\0')
+    {
+        throw ShellError("invalid job specification: " + spec);
+    }
+
+    for (auto &job : table)
+    {
+        if (byId ? job.id == value : job.pgid == value)
+        {
+            return &job;
+        }
+        if (!byId)
+        {
+            for (const auto &proc : job.procs)
+            {
+                if (proc.pid == value)
+                    return &job;
+            }
+        }
+    }
+    return nullptr;
+}
+
+// Wait for a job to finish or stop. With 'foreground' the job gets the terminal while it runs.
+// Returns the job's exit status.
+int JobTable::wait(Job &job, bool foreground)
+{
+    bool haveTerminal = foreground && isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+    if (haveTerminal)
+    {
+        tcsetpgrp(STDIN_FILENO, job.pgid);
+    }
+    if (foreground && job.state == JOB_STOPPED)
+    {
+        kill(-job.pgid, SIGCONT);
+    }
+
+    {
+        ChildSignalBlock block;
+        bool stopped = false;
+        for (auto &proc : job.procs)
+        {
+            if (proc.done)
+                continue;
+
+            // Take the process away from the handler and wait for it here
+            if (proc.slot != -1)
+            {
+                if (slots[proc.slot].state == SLOT_EXITED)
+                {
+                    finish(proc, slots[proc.slot].status);
+                }
+                releaseSlot(proc.slot);
+                proc.slot = -1;
+                if (proc.done)
+                    continue;
+            }
+
+            int status;
+            pid_t result;
+            do
+            {
+                result = waitpid(proc.pid, &status, WUNTRACED);
+            } while (result == -1 && errno == EINTR);
+
+            if (result == -1)
+            {
+                errno = 0;
+                finish(proc, 0); // Already reaped elsewhere
+            }
+            else if (WIFSTOPPED(status))
+            {
+                proc.stopped = true;
+                stopped = true;
+                break;
+            }
+            else
+            {
+                finish(proc, status);
+            }
+        }
+
+        // Hand unfinished processes back to the handler, unless a pidfd still watches them
+        for (auto &proc : job.procs)
+        {
+            if (proc.done || proc.slot != -1 || proc.pidfd != -1)
+                continue;
+            proc.slot = claimSlot(proc.pid, stopped ? SLOT_STOPPED : SLOT_RUNNING);
+        }
+    }
+
+    if (haveTerminal)
+    {
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+
+    update();
+    if (job.state == JOB_STOPPED)
+    {
+        cout << endl
+             << "[" << job.id << "]  " << left << setw(12) << "Stopped" << right << job.command << endl;
+        return 128 + SIGTSTP;
+    }
+    return job.status;
+}
+
+// Resume a stopped job in the background
+void JobTable::resume(Job &job)
+{
+    if (kill(-job.pgid, SIGCONT) == -1)
+    {
+        throw ShellError("bg failed: " + string(strerror(errno)));
+    }
+    job.state = JOB_RUNNING;
+    cout << "[" << job.id << "]  " << job.command << " &" << endl;
+}
+
+// Remove a job from the table once it has been waited for
+void JobTable::remove(int id)
+{
+    for (auto it = table.begin(); it != table.end(); ++it)
+    {
+        if (it->id == id)
+        {
+            forget(*it);
+            table.erase(it);
+            break;
+        }
+    }
+    if (table.empty())
+    {
+        nextId = 1;
+    }
+}
+
+// Count jobs that are still running
+int JobTable::countActive() const
+{
+    int count = 0;
+    for (const auto &job : table)
+    {
+        count += job.state == JOB_RUNNING;
+    }
+    return count;
+}
+
+// Check whether a job has finished (jobs that were already dropped count as finished)
+bool JobTable::isFinished(long serial) const
+{
+    for (const auto &job : table)
+    {
+        if (job.serial == serial)
+        {
+            return job.state == JOB_DONE;
+        }
+    }
+    return true;
+}
+
+// Get all jobs
+const std::list<Job> &JobTable::getAll() const
+{
+    return table;
+}
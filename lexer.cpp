@@ -0,0 +1,194 @@
+#include "mish.h"
+#include <cstdlib> // For getenv
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MISH_X86 1
+#endif
+using namespace std;
+
+// Backend used by the tokenizer to skip ordinary characters (scalar until initLexerBackend)
+LexerBackend lexerBackend = LexerBackend::Scalar;
+
+// Characters that end a run outside quotes: operators, quote, escape, whitespace, '$', VAR_MARK
+// and the pattern characters
+static const char SPECIAL[] = "|><&;\"\\ \t$\x01*?[";
+static const size_t SPECIAL_COUNT = sizeof(SPECIAL) - 1;
+
+// Inside quotes only the closing quote, escapes and variable references matter
+static const char QUOTED_SPECIAL[] = "\"\\$\x01";
+static const size_t QUOTED_SPECIAL_COUNT = sizeof(QUOTED_SPECIAL) - 1;
+
+// Function to build a byte lookup table for a set of characters
+static array<bool, 256> makeTable(const char *chars, size_t count)
+{
+    array<bool, 256> table{};
+    for (size_t i = 0; i < count; i++)
+    {
+        table[static_cast<unsigned char>(chars[i])] = true;
+    }
+    return table;
+}
+
+static const array<bool, 256> specialTable = makeTable(SPECIAL, SPECIAL_COUNT);
+static const array<bool, 256> quotedTable = makeTable(QUOTED_SPECIAL, QUOTED_SPECIAL_COUNT);
+
+// Function to scan byte by byte, also used for the tails of the vector scans
+static size_t scanScalar(const char *text, size_t length, size_t i, bool inQuotes)
+{
+    const array<bool, 256> &table = inQuotes ? quotedTable : specialTable;
+    while (i < length && !table[static_cast<unsigned char>(text[i])])
+    {
+        i++;
+    }
+    return i;
+}
+
+#ifdef MISH_X86
+// Function to mark the special characters of a 16-byte block with 0xFF
+static inline __m128i specialSSE2(__m128i block, bool inQuotes)
+{
+    __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('"')),
+                                _mm_cmpeq_epi8(block, _mm_set1_epi8('\\')));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8('$')));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8(VAR_MARK)));
+    if (inQuotes)
+        return hits;
+
+    // '&' '<' '>' ';' '|' ' ' '\t' '*' '?' '[' complete the set outside quotes
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8('&')));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8('<')));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8('>')));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8(';')));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8('|')));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8('*')));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8('?')));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8('[')));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8(' ')));
+    return _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8('\t')));
+}
+
+// Function to scan 16 bytes at a time with SSE2
+static size_t scanSSE2(const char *text, size_t length, bool inQuotes)
+{
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(specialSSE2(block, inQuotes)));
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return scanScalar(text, length, i, inQuotes);
+}
+
+// Function to mark the special characters of a 32-byte block. Outside quotes the fourteen
+// characters are classified with two nibble lookups instead of fourteen compares: a byte is
+// special when the bit for its high nibble is set in the entry for its low nibble.
+__attribute__((target("avx2"))) static inline __m256i specialAVX2(__m256i block, bool inQuotes)
+{
+    if (inQuotes)
+    {
+        __m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('"')),
+                                       _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\\')));
+        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('$')));
+        return _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, _mm256_set1_epi8(VAR_MARK)));
+    }
+
+    // High nibble bits: 0x0 -> 1, 0x2 -> 2, 0x3 -> 4, 0x5 -> 8, 0x7 -> 16
+    const __m256i lowTable = _mm256_setr_epi8(2, 1, 2, 0, 2, 0, 2, 0, 0, 1, 2, 12, 28, 0, 4, 4,
+                                              2, 1, 2, 0, 2, 0, 2, 0, 0, 1, 2, 12, 28, 0, 4, 4);
+    const __m256i highTable = _mm256_setr_epi8(1, 0, 2, 4, 0, 8, 0, 16, 0, 0, 0, 0, 0, 0, 0, 0,
+                                               1, 0, 2, 4, 0, 8, 0, 16, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    __m256i low = _mm256_shuffle_epi8(lowTable, _mm256_and_si256(block, nibble));
+    __m256i high = _mm256_shuffle_epi8(highTable, _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble));
+    return _mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_and_si256(low, high), _mm256_setzero_si256()),
+                            _mm256_set1_epi8(-1));
+}
+
+// Function to scan 32 bytes at a time with AVX2, only called when the CPU supports it
+__attribute__((target("avx2"))) static size_t scanAVX2(const char *text, size_t length, bool inQuotes)
+{
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + i));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(specialAVX2(block, inQuotes)));
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return scanScalar(text, length, i, inQuotes);
+}
+#endif
+
+// Function to get the length of the leading run of characters the tokenizer copies unchanged:
+// everything up to the next operator, quote, escape or blank (only quote or escape in quotes)
+size_t scanPlain(const char *text, size_t length, bool inQuotes)
+{
+    switch (lexerBackend)
+    {
+#ifdef MISH_X86
+    case LexerBackend::AVX2:
+        return scanAVX2(text, length, inQuotes);
+    case LexerBackend::SSE2:
+        return scanSSE2(text, length, inQuotes);
+#endif
+    default:
+        return scanScalar(text, length, 0, inQuotes);
+    }
+}
+
+// Function to check whether this CPU can run a lexer backend
+bool lexerBackendSupported(LexerBackend backend)
+{
+    switch (backend)
+    {
+#ifdef MISH_X86
+    case LexerBackend::AVX2:
+        return __builtin_cpu_supports("avx2");
+    case LexerBackend::SSE2:
+        return __builtin_cpu_supports("sse2");
+#endif
+    case LexerBackend::Scalar:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Function to pick the fastest supported lexer backend. MISH_LEXER=scalar|sse2|avx2 forces one.
+void initLexerBackend()
+{
+    const char *forced = getenv("MISH_LEXER");
+    if (forced != nullptr && *forced != '\0')
+    {
+        string name = forced;
+        LexerBackend backend = name == "avx2" ? LexerBackend::AVX2
+                               : name == "sse2" ? LexerBackend::SSE2
+                                                : LexerBackend::Scalar;
+        if (name != "scalar" && name != "sse2" && name != "avx2")
+        {
+            handleError("Unknown MISH_LEXER backend " + name + ", using scalar");
+        }
+        else if (!lexerBackendSupported(backend))
+        {
+            handleError("MISH_LEXER backend " + name + " is not supported by this CPU, using scalar");
+            backend = LexerBackend::Scalar;
+        }
+        lexerBackend = backend;
+        return;
+    }
+
+    if (lexerBackendSupported(LexerBackend::AVX2))
+    {
+        lexerBackend = LexerBackend::AVX2;
+    }
+    else if (lexerBackendSupported(LexerBackend::SSE2))
+    {
+        lexerBackend = LexerBackend::SSE2;
+    }
+}
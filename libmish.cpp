@@ -0,0 +1,132 @@
+#include "mish.h"
+#include "libmish.h"
+#include <sys/mman.h>
+using namespace std;
+
+// Prepare the shell core once
+void mishInit()
+{
+    static bool initialized = false;
+    if (!initialized)
+    {
+        initShell();
+        initialized = true;
+    }
+}
+
+// Split a command line into tokens
+vector<string> mishTokenize(const string &line)
+{
+    CommandLine parsed;
+    tokenize(line, parsed);
+    return vector<string>(parsed.tokens.begin(), parsed.tokens.end());
+}
+
+// Tokenize and parse a command line, copying the commands out of the shell's own structures
+vector<MishCommand> mishParse(const string &line)
+{
+    CommandLine parsed;
+    tokenize(line, parsed);
+    parseTokens(parsed);
+
+    vector<MishCommand> commands;
+    for (const auto &cmd : parsed.commands)
+    {
+        MishCommand command;
+        command.words.assign(cmd.tokens.begin(), cmd.tokens.end());
+        command.inputFile = string(cmd.redirectedInputFileName);
+        command.outputFile = string(cmd.redirectOutputFileName);
+        command.appendOutput = cmd.appendOutput();
+        command.pipeToNext = cmd.isPipeStart();
+        command.background = cmd.isBackground();
+        commands.push_back(move(command));
+    }
+    return commands;
+}
+
+// Function to read back everything written to a capture file
+static string readCapture(int fd)
+{
+    string data;
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size <= 0)
+        return data;
+
+    data.resize(size);
+    ssize_t total = 0;
+    while (total < size)
+    {
+        ssize_t count = pread(fd, &data[total], size - total, total);
+        if (count <= 0)
+            break;
+        total += count;
+    }
+    data.resize(total);
+    return data;
+}
+
+// Run a command line with stdout/stderr captured into memory files
+MishResult mishRun(const string &line)
+{
+    MishResult result;
+
+    int outFd = memfd_create("mish-stdout", MFD_CLOEXEC);
+    int errFd = memfd_create("mish-stderr", MFD_CLOEXEC);
+    if (outFd == -1 || errFd == -1)
+    {
+        if (outFd != -1)
+            close(outFd);
+        if (errFd != -1)
+            close(errFd);
+        throw ShellError("Cannot create capture buffers: " + string(strerror(errno)));
+    }
+
+    // Point fd 1 and 2 at the capture files, children inherit them
+    cout << flush;
+    cerr << flush;
+    fflush(stdout);
+    fflush(stderr);
+    int savedOut = dup(STDOUT_FILENO);
+    int savedErr = dup(STDERR_FILENO);
+    dup2(outFd, STDOUT_FILENO);
+    dup2(errFd, STDERR_FILENO);
+
+    try
+    {
+        static CommandLine parsed; // Reused by every call, calls never overlap
+        tokenize(line, parsed);
+        if (!parsed.tokens.empty())
+        {
+            parseTokens(parsed);
+            executeCommands(parsed.commands);
+        }
+        result.exitCode = lastStatus;
+    }
+    catch (const ShellExit &e)
+    {
+        result.exitCode = e.status;
+        result.exited = true;
+    }
+    catch (const ShellError &e)
+    {
+        handleError(e.what());
+        errno = 0;
+        result.exitCode = lastStatus = 2;
+    }
+
+    // Put the host's stdout/stderr back
+    cout << flush;
+    cerr << flush;
+    fflush(stdout);
+    fflush(stderr);
+    dup2(savedOut, STDOUT_FILENO);
+    dup2(savedErr, STDERR_FILENO);
+    close(savedOut);
+    close(savedErr);
+
+    result.output = readCapture(outFd);
+    result.errorOutput = readCapture(errFd);
+    close(outFd);
+    close(errFd);
+    return result;
+}
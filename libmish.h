@@ -0,0 +1,52 @@
+#ifndef LIBMISH_H
+#define LIBMISH_H
+
+// Programmatic interface to the mish core (libmish.a / libmish.so).
+//
+// A host process calls mishInit() once and can then tokenize, parse and run command lines
+// without starting an interpreter. Calls are not thread-safe and must not overlap: running a
+// line temporarily points the process's stdout/stderr at capture buffers.
+//
+// This header stands alone: it brings in no shell internals and no using-directives, and the
+// shared library exports only the functions declared here.
+
+#include <string>
+#include <vector>
+
+// Marks the functions libmish.so exports, everything else in it is hidden
+#define MISH_API __attribute__((visibility("default")))
+
+// Result of running one command line
+struct MishResult
+{
+    int exitCode = 0;         // Exit status of the last command (like $?)
+    std::string output;       // Everything written to stdout while the line ran
+    std::string errorOutput;  // Everything written to stderr while the line ran
+    bool exited = false;      // The line ran the 'exit' built-in
+};
+
+// One command of a parsed line
+struct MishCommand
+{
+    std::vector<std::string> words; // Command and its arguments
+    std::string inputFile;          // File after '<', empty if none
+    std::string outputFile;         // File after '>' or '>>', empty if none
+    bool appendOutput = false;      // The output file is opened with '>>'
+    bool pipeToNext = false;        // Stdout goes to the next command through '|'
+    bool background = false;        // Runs in the background, its pipeline ended with '&'
+};
+
+// Prepare the shell core (spawn backend, SIGCHLD handling, child supervision)
+MISH_API void mishInit();
+
+// Split a command line into tokens, throws std::runtime_error on syntax errors
+MISH_API std::vector<std::string> mishTokenize(const std::string &line);
+
+// Tokenize and parse a command line, throws std::runtime_error on syntax errors
+MISH_API std::vector<MishCommand> mishParse(const std::string &line);
+
+// Run a command line and capture its output and exit status. Syntax errors are reported
+// through errorOutput and a non-zero exitCode instead of an exception.
+MISH_API MishResult mishRun(const std::string &line);
+
+#endif // LIBMISH_H
@@ -0,0 +1,588 @@
+#include "mish.h"
+#include <algorithm>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+using namespace std;
+
+// Most completions listed after a second Tab
+static const size_t LIST_LIMIT = 200;
+
+// Words that start a command without being one
+static const char *const PREFIX_WORDS[] = {"time", "place", "cache"};
+
+// Set up an editor for a terminal
+LineEditor::LineEditor(int inputFd) : fd(inputFd)
+{
+}
+
+// Put the terminal back if a line was being edited
+LineEditor::~LineEditor()
+{
+    disableRaw();
+}
+
+// Function to check whether lines can be edited: the input is a terminal that understands
+// cursor movement, and MISH_EDITOR=0 does not turn the editor off
+bool LineEditor::usable(int fd)
+{
+    string term = env.get("TERM");
+    bool ok = isatty(fd) && isatty(STDOUT_FILENO) && !term.empty() && term != "dumb" && env.get("MISH_EDITOR") != "0";
+    errno = 0;
+    return ok;
+}
+
+// Function to switch the terminal to raw mode: bytes arrive one at a time, without echo, and
+// Ctrl-C or Ctrl-D are read as keys
+bool LineEditor::enableRaw()
+{
+    if (raw)
+        return true;
+    if (tcgetattr(fd, &saved) == -1)
+    {
+        errno = 0;
+        return false;
+    }
+    struct termios mode = saved;
+    mode.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    mode.c_cflag |= CS8;
+    mode.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    mode.c_cc[VMIN] = 1;
+    mode.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSADRAIN, &mode) == -1)
+    {
+        errno = 0;
+        return false;
+    }
+    raw = true;
+    return true;
+}
+
+// Function to restore the terminal mode the commands expect
+void LineEditor::disableRaw()
+{
+    if (raw)
+    {
+        tcsetattr(fd, TCSADRAIN, &saved);
+        raw = false;
+        errno = 0;
+    }
+}
+
+// Function to write text to the terminal
+static void writeTerminal(const string &text)
+{
+    size_t written = 0;
+    while (written < text.size())
+    {
+        ssize_t count = write(STDOUT_FILENO, text.data() + written, text.size() - written);
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            break;
+        written += count;
+    }
+    errno = 0;
+}
+
+// Function to get the width of the terminal
+static size_t terminalColumns()
+{
+    struct winsize size;
+    size_t columns = ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 ? size.ws_col : 80;
+    errno = 0;
+    return columns;
+}
+
+// Function to read one key byte, reaping background jobs while none is available
+bool LineEditor::readByte(char &c)
+{
+    while (true)
+    {
+        supervisor.waitForInput(fd);
+        ssize_t count = read(fd, &c, 1);
+        if (count == 1)
+            return true;
+        if (count == -1 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        errno = 0;
+        return false;
+    }
+}
+
+// Function to redraw the line. A line wider than the terminal scrolls to keep the cursor visible.
+void LineEditor::refresh()
+{
+    size_t columns = terminalColumns();
+
+    size_t start = 0, length = buffer.size(), position = cursor;
+    while (prompt.size() + position >= columns && position > 0)
+    {
+        start++;
+        length--;
+        position--;
+    }
+    while (prompt.size() + length > columns && length > 0)
+    {
+        length--;
+    }
+
+    string text = "\r" + prompt + buffer.substr(start, length) + "\x1b[0K\r";
+    if (prompt.size() + position > 0)
+    {
+        text += "\x1b[" + to_string(prompt.size() + position) + "C";
+    }
+    writeTerminal(text);
+}
+
+// Function to insert text at the cursor
+void LineEditor::insert(const string &text)
+{
+    buffer.insert(cursor, text);
+    cursor += text.size();
+}
+
+// Function to get the longest common prefix of two strings
+static string sharedPrefix(const string &a, const string &b)
+{
+    size_t n = 0;
+    while (n < a.size() && n < b.size() && a[n] == b[n])
+    {
+        n++;
+    }
+    return a.substr(0, n);
+}
+
+// Function to collect the commands starting with 'word': executables on PATH, built-ins and
+// prefix words. Returns how many there are, 'extension' is what they all start with.
+static size_t commandMatches(const string &word, vector<string> &matches, string &extension)
+{
+    pathTrie.refresh();
+    size_t total = pathTrie.complete(word, matches, LIST_LIMIT);
+    extension = total > 0 ? pathTrie.commonPrefix(word) : "";
+
+    vector<string_view> extra = builtInNames();
+    extra.insert(extra.end(), begin(PREFIX_WORDS), end(PREFIX_WORDS));
+    for (string_view name : extra)
+    {
+        if (name.compare(0, word.size(), word) != 0 || name.find('=') != string_view::npos)
+            continue;
+        string text(name);
+        vector<string> exact;
+        if (pathTrie.complete(text, exact, 1) > 0 && exact[0] == text)
+            continue; // Also on PATH, e.g. echo
+        if (find(matches.begin(), matches.end(), text) != matches.end())
+            continue;
+        extension = total > 0 ? sharedPrefix(extension, text) : text;
+        total++;
+        if (matches.size() < LIST_LIMIT)
+            matches.push_back(text);
+    }
+    sort(matches.begin(), matches.end());
+    return total;
+}
+
+// Function to collect the file names starting with 'word', directories ending in '/'
+static size_t fileMatches(const string &word, vector<string> &matches, string &extension)
+{
+    size_t slash = word.rfind('/');
+    string dir = slash == string::npos ? "." : slash == 0 ? "/" : word.substr(0, slash);
+    string head = slash == string::npos ? "" : word.substr(0, slash + 1);
+    string base = slash == string::npos ? word : word.substr(slash + 1);
+
+    DIR *listing = opendir(dir.c_str());
+    if (listing == nullptr)
+    {
+        errno = 0;
+        return 0;
+    }
+    size_t total = 0;
+    for (struct dirent *entry; (entry = readdir(listing)) != nullptr;)
+    {
+        string name = entry->d_name;
+        if (name == "." || name == ".." || name.compare(0, base.size(), base) != 0 || (name[0] == '.' && base.empty()))
+            continue;
+        struct stat st;
+        if (fstatat(dirfd(listing), entry->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode))
+            name += '/';
+        string text = head + name;
+        extension = total > 0 ? sharedPrefix(extension, text) : text;
+        total++;
+        matches.push_back(text);
+    }
+    closedir(listing);
+    errno = 0;
+    sort(matches.begin(), matches.end());
+    if (matches.size() > LIST_LIMIT)
+        matches.resize(LIST_LIMIT);
+    return total;
+}
+
+// Function to print completions in columns below the line
+static void listMatches(const vector<string> &matches, size_t total)
+{
+    size_t columns = terminalColumns();
+
+    size_t width = 0;
+    for (const auto &match : matches)
+    {
+        width = max(width, match.size() + 2);
+    }
+    size_t perRow = max<size_t>(1, columns / width);
+    string text = "\n";
+    for (size_t i = 0; i < matches.size(); i++)
+    {
+        text += matches[i];
+        text += (i + 1) % perRow == 0 || i + 1 == matches.size() ? "\n" : string(width - matches[i].size(), ' ');
+    }
+    if (total > matches.size())
+    {
+        text += "... and " + to_string(total - matches.size()) + " more\n";
+    }
+    writeTerminal(text);
+}
+
+// Function to complete the word before the cursor. The first word of a command completes from
+// the PATH trie, other words and paths from the file system. A second Tab lists the choices.
+void LineEditor::complete(bool repeated)
+{
+    size_t start = cursor;
+    while (start > 0 && strchr(" \t|;&<>", buffer[start - 1]) == nullptr)
+    {
+        start--;
+    }
+    string word = buffer.substr(start, cursor - start);
+
+    // A command starts the line, follows a '|', ';' or '&', or follows a prefix word
+    size_t before = start;
+    while (before > 0 && buffer[before - 1] == ' ')
+    {
+        before--;
+    }
+    size_t previousStart = before;
+    while (previousStart > 0 && strchr(" \t|;&<>", buffer[previousStart - 1]) == nullptr)
+    {
+        previousStart--;
+    }
+    string previous = buffer.substr(previousStart, before - previousStart);
+    bool command = before == 0 || strchr("|;&", buffer[before - 1]) != nullptr ||
+                   find(begin(PREFIX_WORDS), end(PREFIX_WORDS), previous) != end(PREFIX_WORDS);
+
+    vector<string> matches;
+    string extension;
+    size_t total = command && word.find('/') == string::npos ? commandMatches(word, matches, extension)
+                                                              : fileMatches(word, matches, extension);
+    if (total == 0)
+    {
+        writeTerminal("\a");
+        return;
+    }
+    if (total == 1)
+    {
+        insert(extension.substr(word.size()) + (extension.back() == '/' ? "" : " "));
+    }
+    else if (extension.size() > word.size())
+    {
+        insert(extension.substr(word.size()));
+    }
+    else if (repeated)
+    {
+        listMatches(matches, total);
+    }
+    else
+    {
+        writeTerminal("\a");
+    }
+}
+
+// Function to read the rest of an escape sequence and act on it
+void LineEditor::escape()
+{
+    char kind = '\0', c = '\0';
+    if (!readByte(kind) || (kind != '[' && kind != 'O'))
+        return;
+    string parameter;
+    while (true)
+    {
+        if (!readByte(c))
+            return; // The input ended inside the sequence
+        if (!isdigit(static_cast<unsigned char>(c)) && c != ';')
+            break;
+        parameter += c;
+    }
+
+    switch (c)
+    {
+    case 'A': // Up
+        browse(true);
+        break;
+    case 'B': // Down
+        browse(false);
+        break;
+    case 'C': // Right
+        cursor = min(cursor + 1, buffer.size());
+        break;
+    case 'D': // Left
+        cursor = cursor > 0 ? cursor - 1 : 0;
+        break;
+    case 'H':
+        cursor = 0;
+        break;
+    case 'F':
+        cursor = buffer.size();
+        break;
+    case '~':
+        if (parameter == "1" || parameter == "7")
+            cursor = 0;
+        else if (parameter == "4" || parameter == "8")
+            cursor = buffer.size();
+        else if (parameter == "3" && cursor < buffer.size())
+            buffer.erase(cursor, 1); // Delete
+        break;
+    }
+}
+
+// Function to show the previous or next history line. Leaving the newest line brings back the
+// line that was being typed.
+void LineEditor::browse(bool older)
+{
+    // Checked before every step: offsets from before the file shrank point at nothing
+    history.sync();
+    if (browsing != string::npos && history.version() != browsedVersion)
+    {
+        browsing = string::npos;
+        buffer = draft;
+        cursor = buffer.size();
+        writeTerminal("\a");
+        return;
+    }
+
+    size_t target;
+    if (older)
+    {
+        if (browsing == string::npos)
+        {
+            draft = buffer;
+            browsing = history.size();
+            browsedVersion = history.version();
+        }
+        target = history.previous(browsing);
+        if (target == string::npos)
+        {
+            writeTerminal("\a");
+            return;
+        }
+    }
+    else
+    {
+        if (browsing == string::npos)
+            return;
+        target = history.next(browsing);
+    }
+
+    browsing = target;
+    buffer = target == string::npos ? draft : string(history.line(target));
+    cursor = buffer.size();
+}
+
+// Function to search the history backwards as the query is typed (Ctrl-R). Ctrl-R again finds
+// an older match, Ctrl-G or Ctrl-C gives up. Returns true if Enter ran the match; any other key
+// leaves it in the line for editing.
+bool LineEditor::reverseSearch()
+{
+    browsing = string::npos;
+    string query;
+    size_t match = string::npos;
+    bool failed = false;
+    uint64_t version = history.version();
+
+    while (true)
+    {
+        string shown = match == string::npos ? "" : string(history.line(match));
+        string text = string(failed ? "(failed reverse-i-search)`" : "(reverse-i-search)`") + query + "': ";
+        size_t columns = terminalColumns();
+        if (text.size() + shown.size() >= columns)
+        {
+            shown.resize(text.size() < columns ? columns - text.size() - 1 : 0);
+        }
+        writeTerminal("\r" + text + shown + "\x1b[0K");
+
+        char c;
+        if (!readByte(c))
+            return false;
+        history.sync();
+        if (history.version() != version)
+        {
+            version = history.version(); // The file shrank, the match is gone
+            match = string::npos;
+        }
+        if (c == 18) // Ctrl-R
+        {
+            size_t older = match == string::npos ? string::npos : history.search(query, match);
+            failed = older == string::npos;
+            match = failed ? match : older;
+            if (failed)
+                writeTerminal("\a");
+        }
+        else if (c == 127 || c == 8)
+        {
+            if (!query.empty())
+                query.pop_back();
+            match = history.search(query, history.size());
+            failed = match == string::npos && !query.empty();
+        }
+        else if (c == 7 || c == 3) // Ctrl-G, Ctrl-C
+        {
+            return false;
+        }
+        else if (static_cast<unsigned char>(c) >= 32)
+        {
+            // The longer query may still match the line shown
+            query += c;
+            size_t found = history.search(query, match == string::npos ? history.size() : match + 1);
+            failed = found == string::npos;
+            match = failed ? match : found;
+        }
+        else
+        {
+            if (match != string::npos)
+            {
+                buffer = history.line(match);
+                cursor = buffer.size();
+            }
+            if (c == 27)
+            {
+                escape(); // An arrow key moves in the match
+            }
+            return c == '\r' || c == '\n';
+        }
+    }
+}
+
+// Function to read a line with editing. Returns false at the end of input (Ctrl-D on an empty
+// line). Ctrl-C drops the line and returns an empty one.
+bool LineEditor::readLine(const string &linePrompt, string &line)
+{
+    cout << flush;
+    prompt = linePrompt;
+    buffer.clear();
+    cursor = 0;
+    browsing = string::npos;
+    if (!enableRaw())
+    {
+        // Not a terminal after all, read a plain line
+        writeTerminal(prompt);
+        char c = '\0';
+        line.clear();
+        while (read(fd, &c, 1) == 1 && c != '\n')
+        {
+            line += c;
+        }
+        errno = 0;
+        return !line.empty() || c == '\n';
+    }
+
+    refresh();
+    bool tabbed = false; // The previous key was a Tab that changed nothing
+    char c;
+    while (readByte(c))
+    {
+        bool tab = false;
+        switch (c)
+        {
+        case '\r':
+        case '\n':
+            disableRaw();
+            writeTerminal("\n");
+            line = buffer;
+            return true;
+        case 1: // Ctrl-A
+            cursor = 0;
+            break;
+        case 2: // Ctrl-B
+            cursor = cursor > 0 ? cursor - 1 : 0;
+            break;
+        case 3: // Ctrl-C
+            disableRaw();
+            writeTerminal("^C\n");
+            line.clear();
+            return true;
+        case 4: // Ctrl-D
+            if (buffer.empty())
+            {
+                disableRaw();
+                return false;
+            }
+            if (cursor < buffer.size())
+                buffer.erase(cursor, 1);
+            break;
+        case 5: // Ctrl-E
+            cursor = buffer.size();
+            break;
+        case 6: // Ctrl-F
+            cursor = min(cursor + 1, buffer.size());
+            break;
+        case 8:
+        case 127: // Backspace
+            if (cursor > 0)
+                buffer.erase(--cursor, 1);
+            break;
+        case '\t':
+        {
+            string before = buffer;
+            complete(tabbed);
+            tab = buffer == before && !tabbed;
+            break;
+        }
+        case 11: // Ctrl-K
+            buffer.erase(cursor);
+            break;
+        case 12: // Ctrl-L
+            writeTerminal("\x1b[H\x1b[2J");
+            break;
+        case 14: // Ctrl-N
+            browse(false);
+            break;
+        case 16: // Ctrl-P
+            browse(true);
+            break;
+        case 18: // Ctrl-R
+            if (reverseSearch())
+            {
+                disableRaw();
+                writeTerminal("\n");
+                line = buffer;
+                return true;
+            }
+            break;
+        case 21: // Ctrl-U
+            buffer.erase(0, cursor);
+            cursor = 0;
+            break;
+        case 23: // Ctrl-W
+        {
+            size_t start = cursor;
+            while (start > 0 && buffer[start - 1] == ' ')
+                start--;
+            while (start > 0 && buffer[start - 1] != ' ')
+                start--;
+            buffer.erase(start, cursor - start);
+            cursor = start;
+            break;
+        }
+        case 27:
+            escape();
+            break;
+        default:
+            if (static_cast<unsigned char>(c) >= 32)
+                insert(string(1, c));
+            break;
+        }
+        tabbed = tab;
+        refresh();
+    }
+
+    // The terminal went away
+    disableRaw();
+    return false;
+}
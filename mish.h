@@ -7,30 +7,117 @@
 #include <string>
 #include <regex>
 #include <sstream>
+#include <iomanip>
 #include <fstream>
 #include <unistd.h>
 #include <limits.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <csignal>
 #include <fcntl.h>
+#include <termios.h>
 #include <map>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
 #include <cstring>
+#include <cstdint>
 #include <memory>
 #include <stdexcept>
 #include <cerrno>
+#include <string_view>
 using namespace std;
 
-// Structure representing a parsed command
+// Bump allocator for the text of one command line. reset() keeps the memory, so once the
+// arena has grown to fit the longest line seen, later lines do not touch the heap.
+class Arena
+{
+private:
+    struct Block
+    {
+        unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    vector<Block> blocks; // Blocks in allocation order, only the last one has free space
+    size_t used = 0;      // Bytes used in the last block
+    size_t total = 0;     // Combined size of all blocks
+
+public:
+    char *allocate(size_t size);        // Uninitialized bytes, valid until reset()
+    string_view copy(string_view text); // NUL-terminated copy of a string
+    void reset();                       // Free everything, keeping the memory for reuse
+    size_t capacity() const;            // Bytes owned by the arena
+};
+
+// Read-only view of a command's words. The words live in the CommandLine the command was
+// parsed from and are NUL-terminated, so data() can be passed where a C string is expected.
+class TokenList
+{
+private:
+    const string_view *first = nullptr;
+    size_t count = 0;
+
+public:
+    TokenList() = default;
+    TokenList(const string_view *words, size_t size) : first(words), count(size) {}
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const string_view &operator[](size_t i) const { return first[i]; }
+    const string_view &back() const { return first[count - 1]; }
+    const string_view *begin() const { return first; }
+    const string_view *end() const { return first + count; }
+    TokenList dropFirst() const { return TokenList(first + 1, count - 1); } // Words after the first
+};
+
+// Flag bits of a parsed command
+enum CommandFlag : uint16_t
+{
+    CMD_REDIRECT_OUT = 1 << 0, // Output goes to redirectOutputFileName
+    CMD_REDIRECT_IN = 1 << 1,  // Input comes from redirectedInputFileName
+    CMD_PIPE_START = 1 << 2,   // Output feeds the next command
+    CMD_PIPE_END = 1 << 3,     // Input comes from the previous command
+    CMD_BACKGROUND = 1 << 4,   // Run in the background
+    CMD_APPEND = 1 << 5,       // Append mode for output redirection
+    CMD_TESTED = 1 << 6,       // Exit status is tested by 'if' or 'while', failing is not an error
+    CMD_EXPAND = 1 << 7,       // Words or file names hold variable references or patterns
+    CMD_METER = 1 << 8         // The pipe to the next command is metered (|> or MISH_PIPESTATS=1)
+};
+
+// Byte marking an expansion in token text: VAR_MARK text VAR_MARK. The tokenizer writes $NAME and
+// ${NAME} as the name, $? and $$ as themselves, an unquoted *, **, ? or [...] as the pattern,
+// and a VAR_MARK byte of the input as an empty reference.
+const char VAR_MARK = '\x01';
+
+// Structure representing a parsed command. It only points into its CommandLine, so it is
+// cheap to copy and valid until that line is tokenized again.
 struct Command
 {
-    vector<string> tokens; // Command and its arguments
-    bool redirectOutputToFile = false;
-    bool redirectedInputFromFile = false;
-    bool isPipeStart = false;
-    bool isPipeEnd = false;
-    bool isBackground = false;
-    string redirectOutputFileName;  // File for output redirection
-    string redirectedInputFileName; // File for input redirection
-    bool appendOutput = false;      // Append mode for output redirection
+    TokenList tokens;                    // Command and its arguments
+    string_view redirectOutputFileName;  // File for output redirection
+    string_view redirectedInputFileName; // File for input redirection
+    uint16_t flags = 0;                  // CommandFlag bits
+    uint32_t pipeSize = 0;               // Buffer of the pipe to the next command, 0 for the default
+
+    bool redirectOutputToFile() const { return flags & CMD_REDIRECT_OUT; }
+    bool redirectedInputFromFile() const { return flags & CMD_REDIRECT_IN; }
+    bool isPipeStart() const { return flags & CMD_PIPE_START; }
+    bool isPipeEnd() const { return flags & CMD_PIPE_END; }
+    bool isBackground() const { return flags & CMD_BACKGROUND; }
+    bool appendOutput() const { return flags & CMD_APPEND; }
+};
+
+// A command line with everything parsed from it. The buffers are reused from line to line,
+// so tokenizing and parsing a line no longer than earlier ones makes no heap allocations.
+struct CommandLine
+{
+    Arena arena;                // Text of the tokens
+    vector<string_view> tokens; // Tokens, operators included
+    vector<string_view> words;  // Command words, each command's tokens are a run of these
+    vector<Command> commands;   // Parsed commands
+    bool expansions = false;    // Some token holds a variable reference or a pattern
 };
 
 // Custom exception class for shell errors
@@ -40,39 +127,692 @@ public:
     ShellError(const string &msg) : runtime_error(msg) {}
 };
 
+// Exception thrown by the 'exit' built-in to unwind back to main (or to a library caller)
+class ShellExit : public exception
+{
+public:
+    int status;
+    explicit ShellExit(int code) : status(code) {}
+    const char *what() const noexcept override { return "exit"; }
+};
+
 // Function to handle errors and optionally terminate the program
 void handleError(const string &message, bool fatal = false);
 
-// Class to manage environment variables
+// Class to manage environment variables. Names are interned into slots, so compiled words
+// refer to a variable by its slot, and the envp handed to children is only rebuilt after a change.
 class Environment
 {
 private:
-    map<string, string> vars; // Stores environment variables
+    struct Variable
+    {
+        string name;
+        string value;
+        bool set = false;
+    };
+
+    unordered_map<string, uint32_t> index; // Interned names -> slots
+    vector<Variable> slots;
+    size_t setCount = 0;                   // Number of slots holding a value
+    uint64_t generation = 0;               // Bumped on every change
+    uint64_t builtGeneration = UINT64_MAX; // Generation 'entries' was built from
+    vector<string> entries;                // NAME=value of every variable, for envp
+    vector<char *> envpArray;
 
 public:
     Environment(); // Constructor to initialize with system environment
 
+    uint32_t intern(const string &name);               // Slot of a name, created unset if new
+    const string *lookup(uint32_t slot) const;         // Value in a slot, nullptr if unset
+    bool set(uint32_t slot, const string &value);      // Set the variable in a slot
     bool set(const string &name, const string &value); // Set an environment variable
     bool unset(const string &name);                    // Unset an environment variable
     string get(const string &name) const;              // Retrieve an environment variable
-    const map<string, string> &getAll() const;         // Get all stored environment variables
+    bool contains(const string &name) const;           // Check if a variable is set
+    map<string, string> getAll() const;                // Get all variables, sorted by name
+    char *const *envp();                               // NAME=value array for execve
+    uint64_t version() const;                          // Changes whenever a variable does
 };
 
 // Global environment object
 extern Environment env;
 
+// Class remembering where commands were found on PATH, so PATH is walked once per name
+class CommandHash
+{
+public:
+    struct Entry
+    {
+        string path;  // Absolute path of the executable
+        long hits;    // Number of times the entry was used
+    };
+
+private:
+    unordered_map<string, Entry> table; // Command name -> location
+
+    string search(const string &name, bool &cacheable) const; // Walk PATH for a name
+
+public:
+    string resolve(const string &name);                    // Path to execute, or "" if not found
+    bool add(const string &name);                          // Prefill an entry
+    void clear();                                          // Forget all entries
+    const unordered_map<string, Entry> &getAll() const;    // Get all remembered locations
+};
+
+// Global command hash table
+extern CommandHash commandHash;
+
+// Prefix tree of the executable names on PATH, for completion. It is built on first use and
+// kept current with inotify, so a lookup never reads a directory; a new PATH rebuilds it.
+class PathTrie
+{
+private:
+    struct Node
+    {
+        vector<pair<char, uint32_t>> children; // By character
+        uint32_t terminal = 0;                 // Directories holding the name ending here
+        uint32_t names = 0;                    // Distinct names in this subtree
+    };
+
+    struct Directory
+    {
+        string path;
+        int watch = -1;                // inotify watch descriptor
+        unordered_set<string> names;   // Executables found in it
+    };
+
+    vector<Node> nodes;                // Node 0 is the root
+    vector<unique_ptr<Directory>> dirs;
+    int inotifyFd = -1;
+    string builtFor;                   // PATH the trie was built for
+    bool built = false;
+
+    uint32_t child(uint32_t node, char c) const;
+    void insert(string_view name);
+    void erase(string_view name);
+    void update(Directory &dir, const string &name);
+    void scan(Directory &dir);
+    void processEvents();
+
+public:
+    PathTrie() = default;
+    PathTrie(const PathTrie &) = delete;
+    PathTrie &operator=(const PathTrie &) = delete;
+    ~PathTrie();
+
+    void build(const string &path);   // Read every directory of a PATH-style list
+    void refresh();                   // Build or update for the current PATH
+    size_t complete(string_view prefix, vector<string> &matches, size_t limit) const; // Names with a prefix
+    string commonPrefix(string_view prefix) const; // Longest extension all matches share
+    size_t size() const;              // Distinct names
+};
+
+// Global trie of the executables on PATH
+extern PathTrie pathTrie;
+
 // Track if path should be shown
 extern bool showPath;
 
+// Exit status of the last command
+extern int lastStatus;
+
+// Signature of a built-in command, returns the exit status
+typedef int (*BuiltinFunc)(const Command &cmd);
+
+// State of a background job
+enum JobState
+{
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE
+};
+
+// One process of a background job
+struct JobProcess
+{
+    pid_t pid = -1;
+    int slot = -1;        // Index in the SIGCHLD handler's process slots, -1 if not registered
+    int pidfd = -1;       // pidfd watched by the supervisor, -1 if not watched
+    int status = 0;       // Wait status once done
+    bool stopped = false; // Stopped by a signal (tracked here for processes without a slot)
+    bool done = false;
+};
+
+// A background pipeline, identified by its process group
+struct Job
+{
+    int id = 0;                 // Job number shown as [n]
+    pid_t pgid = -1;            // Process group of the pipeline
+    long serial = 0;            // Unique number, never reused (job numbers are)
+    string command;             // Command text for reports
+    vector<JobProcess> procs;   // Processes of the pipeline
+    JobState state = JOB_RUNNING;
+    int status = 0;             // Exit status of the last stage once done
+};
+
+// Class tracking background jobs, reaped by a SIGCHLD handler with non-blocking waitpid
+class JobTable
+{
+private:
+    std::list<Job> table; // Jobs in start order, a list so the index below stays valid
+    unordered_map<pid_t, pair<Job *, JobProcess *>> processes; // Processes watched by a pidfd
+    int nextId = 1;    // Number for the next job
+    long nextSerial = 1; // Serial for the next job
+    sig_atomic_t signalsSeen = 0; // SIGCHLD count at the last update
+
+    void finish(JobProcess &proc, int status); // Mark a process as finished
+    void forget(Job &job);                     // Drop a job from the pid index
+
+public:
+    void init();                                                            // Install the SIGCHLD handler
+    const Job &add(pid_t pgid, const vector<pid_t> &pids, const string &command); // Register a background pipeline
+    void update();                                                          // Collect state changes from the handler
+    void childExited(pid_t pid);                                            // Reap a process whose pidfd fired
+    void report(bool print);                                                // Report and drop finished jobs
+    void list();                                                            // Print all jobs
+    Job *find(const string &spec);                                          // Find a job by %n or PID
+    int wait(Job &job, bool foreground);                                    // Wait for a job to finish or stop
+    void resume(Job &job);                                                  // Continue a stopped job in the background
+    void remove(int id);                                                    // Drop a job from the table
+    int countActive() const;                                                // Number of running jobs
+    bool isFinished(long serial) const;                                     // Check if a job is done or gone
+    const std::list<Job> &getAll() const;                                   // Get all jobs
+};
+
+// Global job table
+extern JobTable jobs;
+
+// Function to convert a wait status into a shell exit status
+int exitStatusOf(int status);
+
+// Outcome and resource usage of one reaped pipeline stage
+struct StageResult
+{
+    int status = 0;         // Wait status
+    double wall = 0;        // Seconds from spawn to reap
+    struct rusage usage {}; // Resource usage reported by wait4
+};
+
+// Kinds of file descriptors multiplexed by the supervisor
+enum WatchKind
+{
+    WATCH_SIGNAL,     // Self-pipe written by signal handlers
+    WATCH_FOREGROUND, // pidfd of a foreground pipeline stage
+    WATCH_BACKGROUND, // pidfd of a background job process
+    WATCH_INPUT       // Input the shell is waiting to read
+};
+
+// Class supervising children through one epoll loop over pidfds, stdin and a signal self-pipe
+class Supervisor
+{
+private:
+    struct Watch
+    {
+        WatchKind kind;
+        pid_t pid;
+    };
+
+    int epollFd = -1;                   // epoll instance, -1 if unavailable
+    int signalPipe[2] = {-1, -1};       // Self-pipe for signal wakeups
+    bool pidfdSupported = true;         // Cleared when the kernel lacks pidfd_open
+    unordered_map<int, Watch> watches;  // Registered fd -> what it is
+    static const int MAX_EVENTS = 64;   // Events taken per epoll_wait
+    int lastBatch = 0;                  // Events the last dispatch took
+
+    void addFd(int fd, WatchKind kind, pid_t pid);                  // Register a fd with epoll
+    void removeFd(int fd);                                          // Unregister a fd
+    bool dispatch(vector<pair<pid_t, StageResult>> &exited, int timeout); // Handle one batch of events
+
+public:
+    void init();                                                                      // Create the epoll set
+    int watch(pid_t pid, bool background);                                            // Watch a child, returns its pidfd
+    void unwatch(int pidfd);                                                          // Stop watching a pidfd
+    void poll();                                                                      // Handle events already pending
+    void waitPipeline(const vector<pid_t> &pids, const vector<double> &startTimes,
+                      vector<StageResult> &results, bool pipefail);                   // Wait for a foreground pipeline
+    void waitForInput(int fd);                                                        // Wait for input while supervising
+    void waitForChild();                                                              // Wait for the next child or signal event
+};
+
+// Global child supervisor
+extern Supervisor supervisor;
+
+// Function to wake the supervisor from a signal handler
+void notifySupervisor();
+
+// Class bounding how many background jobs run at once (-j N and parallel blocks)
+class Scheduler
+{
+private:
+    struct Pending
+    {
+        long serial;  // Job serial
+        int outputFd; // Captured stdout, -1 if not captured
+    };
+
+    int limit = 0;          // Maximum concurrent jobs, 0 when -j was not given
+    bool ordered = false;   // Write job output in submission order (-k)
+    int blockDepth = 0;     // Nesting of 'parallel {' blocks
+    deque<Pending> queue;   // Jobs whose output is not written yet
+
+    int effectiveLimit() const; // Limit in effect
+
+public:
+    void configure(int jobLimit, bool keepOrder);  // Set limit and output order
+    bool active() const;                           // Check if background jobs are scheduled
+    int acquire(const Command &last);              // Wait for a slot, maybe get an output capture fd
+    void submitted(long serial, int outputFd);     // Record a started job
+    void flush();                                  // Write output of finished jobs in order
+    void barrier();                                // Wait for all jobs and write all output
+    void beginBlock();                             // Enter a parallel block
+    void endBlock();                               // Leave a parallel block (implicit barrier)
+    bool inBlock() const;                          // Check if inside a parallel block
+};
+
+// Global background job scheduler
+extern Scheduler scheduler;
+void copyToStdout(int fd); // Write a captured output file to the shell's stdout
+
+// Backends available for starting external commands
+enum class SpawnBackend
+{
+    PosixSpawn, // posix_spawn (clone with CLONE_VM | CLONE_VFORK under glibc)
+    Fork,       // fork() followed by execve()
+    Zygote      // Requests to a small pre-started helper process (--zygote)
+};
+
+// How a 'place' prefix spreads a pipeline's stages over CPUs
+enum class PlacementMode
+{
+    None,    // Leave scheduling to the kernel
+    Set,     // Every stage may run on any of the CPUs
+    Spread,  // Stage i runs on CPU i, wrapping around
+    Siblings // Like Spread, with CPUs sharing a core's cache next to each other
+};
+
+// Scheduling and limits applied to every stage of a pipeline, set with the 'place' prefix
+struct Placement
+{
+    PlacementMode mode = PlacementMode::None;
+    vector<int> cpus;                   // CPUs in the order stages take them
+    bool setNice = false;
+    int nice = 0;
+    int ioClass = -1;                   // ioprio class (1 realtime, 2 best-effort, 3 idle), -1 to keep
+    int ioLevel = 0;                    // Level within the class, 0 is highest
+    vector<pair<int, rlim_t>> limits;   // setrlimit resource and value, soft and hard
+};
+
+// Placement functions
+void parsePlacement(TokenList &tokens, Placement &placement); // Options after 'place', leaves the command
+void applyPlacement(const Placement &placement, int stage);   // In the child, before the exec
+
+// Options of a 'cache' prefix
+struct CacheOptions
+{
+    bool byTime = false;      // Key '<' inputs by modification time instead of content (-m)
+    vector<string> variables; // Variables whose values are part of the key (-e NAME)
+};
+
+// Output cache functions
+bool parseCacheOptions(TokenList &tokens, CacheOptions &options); // False if -s or -c ran instead
+void executeCached(const Command *pipeline, int n, const CacheOptions &options, bool timed,
+                   const Placement *placement);
+
+// Standard input/output wiring for one pipeline stage
+struct StageIO
+{
+    int inFd = -1;                             // Pipe read end to use as stdin (-1 to inherit)
+    int outFd = -1;                            // Pipe write end to use as stdout (-1 to inherit)
+    const vector<array<int, 2>> *pipes = nullptr; // All pipe fds of the pipeline, closed in the child
+    pid_t pgid = -1;                           // Process group to join (0 for a new one, -1 to inherit)
+    const Placement *placement = nullptr;      // CPUs, priorities and limits for the stage, if any
+    int stage = 0;                             // Position in the pipeline
+};
+
+// Active spawn backend
+extern SpawnBackend spawnBackend;
+
+// Spawn functions
+void initSpawnBackend();
+pid_t spawnCommand(const Command &cmd, const StageIO &io);
+
+// Stages the shell runs itself instead of starting a process, moving data with splice and tee
+enum class ShellStageKind
+{
+    None,
+    ReadFile,  // Leading 'cat FILE' or 'cat < FILE': file into the first pipe
+    WriteFile, // Trailing 'cat > FILE' or 'cat >> FILE': last pipe into the file
+    Tee,       // 'tee FILE' between two pipes: copy to the next stage and the file
+    Relay      // Metered link after stage 'index': counts bytes and time blocked on each side
+};
+
+// State of one stage run by the shell
+struct ShellStage
+{
+    ShellStageKind kind = ShellStageKind::None;
+    int index = 0;      // Position in the pipeline
+    int in = -1;        // Pipe read end, owned by the stage
+    int out = -1;       // Pipe write end, owned by the stage
+    int file = -1;
+    off_t offset = 0;   // Read position in a ReadFile's file
+    bool copy = false;  // splice is not supported for the file, copy through a buffer
+    bool done = false;
+    int status = 0;     // Wait status, as the command's would have been
+    double wall = 0;    // Seconds from start to finish
+
+    // Relay counters
+    uint64_t bytes = 0;        // Bytes passed on
+    bool waitingWrite = false; // Waiting for room in the next pipe, not for data
+    double waitStart = 0;      // When the current wait began
+    double readWait = 0;       // Seconds waiting for the writing stage
+    double writeWait = 0;      // Seconds waiting for the reading stage (backpressure)
+};
+
+// Pipe functions
+size_t parsePipeSize(string_view text);    // Bytes of a size like 64K or 1M, 0 if invalid
+size_t defaultPipeSize();                   // MISH_PIPESIZE, 0 for the kernel default
+void resizePipe(const array<int, 2> &pipe, size_t size); // F_SETPIPE_SZ, clamped to the system limit
+ShellStageKind shellStageKind(const Command *pipeline, int i, int n); // Whether the shell can run stage i
+void runShellStages(const Command *pipeline, vector<ShellStage> &stages); // Move data until all are done
+
+// Zygote functions. The zygote is the shell's binary re-executed with a small address space,
+// it clones commands on behalf of the shell so the shell's own size never matters.
+bool runZygoteServer(int argc, char *argv[]); // Serve requests if started as the zygote, exits then
+bool startZygote();                           // Start the zygote, false if it is not available
+void stopZygote();                            // Close the zygote's socket and reap it
+int zygoteSpawn(const Command &cmd, const string &path, const StageIO &io, pid_t &pid); // 0, errno, or -1 to spawn directly
+
+// Source of script and stdin lines. Regular files only the user can write are memory-mapped and
+// lines are views into the mapping; other files, pipes and terminals are read in large blocks, so
+// memory use does not grow with the input. load() reads a whole file instead, for the compiler.
+class LineReader
+{
+private:
+    int fd = -1;                    // Descriptor read in blocks, -1 for a mapped file
+    bool ownsFd = false;            // Close 'fd' when done
+    bool mapped = false;            // Input is a whole file in memory, mapped or loaded
+    const char *mapping = nullptr;  // Mapped or loaded file (null when it is empty)
+    unique_ptr<char[]> loaded;      // File read by load(), in place of a mapping
+    size_t mappingSize = 0;
+    size_t position = 0;            // Start of the next line in the mapping
+    size_t released = 0;            // Mapping before this offset has been given back
+    unique_ptr<char[]> buffer;      // Block buffer for unmapped input
+    size_t bufferSize = 0;
+    size_t start = 0;               // Unread data in the buffer is [start, end)
+    size_t end = 0;
+    bool atEnd = false;             // The descriptor reported end of input
+
+    bool nextMapped(string_view &line);
+    bool nextBuffered(string_view &line);
+
+public:
+    LineReader() = default;
+    LineReader(const LineReader &) = delete;
+    LineReader &operator=(const LineReader &) = delete;
+    ~LineReader();
+
+    bool open(const string &path);  // Open a file, false if it cannot be opened
+    bool load(const string &path);  // Read a whole file into memory, false if it cannot be opened
+    void attach(int descriptor);    // Read from a descriptor the caller keeps open
+    void close();                   // Release the current input
+    bool next(string_view &line);   // Next line without its newline, valid until the next call
+    bool lineReady() const;         // Check if a whole line can be returned without reading
+    string_view contents() const;   // Whole file when it is mapped or loaded, empty otherwise
+    bool isWhole() const;           // Check if the whole file is in memory, mapped or loaded
+};
+
+// Command history, one line per record in an append-only file shared by every session. The file
+// is memory-mapped, so startup does not read it. Reverse search goes through a trigram index kept
+// in a second mapped file next to it, which sessions extend as lines arrive.
+class History
+{
+private:
+    int fd = -1;                    // History file, -1 to keep the history in memory
+    char *mapping = nullptr;        // Mapped file
+    size_t mappingSize = 0;
+    size_t length = 0;              // Bytes of whole records
+    string memory;                  // Records when there is no file
+    uint64_t generation = 0;        // Changes when the file shrank under the mapping
+    bool shrunk = false;            // The file shrank since the index was last checked
+    string path;                    // History file
+    string indexPath;               // Its index, path + ".idx"
+    int indexFd = -1;
+    char *indexMapping = nullptr;   // Mapped index
+    size_t indexSize = 0;
+    uint64_t indexInode = 0;        // Index file mapped, a rebuild replaces it
+    vector<size_t> segments;        // Offsets of the usable segments in the index
+    size_t indexedTo = 0;           // History before this offset is indexed
+    size_t indexParsed = 0;         // Index bytes the segments take up
+    bool indexUsable = false;       // The index belongs to this file and is intact
+    bool rebuildRequested = false;  // A rebuild of this index file was started
+
+    void closeIndex();
+    void loadIndex();
+    void extendIndex();
+    void requestRebuild();
+    string_view text() const;
+
+public:
+    History() = default;
+    History(const History &) = delete;
+    History &operator=(const History &) = delete;
+    ~History();
+
+    static void buildIndex(const string &path);    // Rebuild the index of a history file
+    void open();                                   // Map MISH_HISTFILE or ~/.mish_history
+    void close();
+    void sync();                                   // Pick up lines other sessions appended
+    uint64_t version() const;                      // Changes when earlier offsets become invalid
+    void add(string_view entry);                   // Append a line
+    string_view line(size_t start) const;          // Line starting at an offset
+    size_t previous(size_t start) const;           // Line before, npos at the oldest
+    size_t next(size_t start) const;               // Line after, npos at the newest
+    size_t search(string_view query, size_t before); // Newest line before an offset containing a text
+    size_t size() const;                           // End offset of the history
+};
+
+// Global command history
+extern History history;
+
+// Line editor for interactive input. The terminal is in raw mode only while a line is read;
+// Tab completes command names from the PATH trie and other words from the file system, Up/Down
+// and Ctrl-R go through the history.
+class LineEditor
+{
+private:
+    int fd;                         // Terminal being read
+    struct termios saved;           // Mode to restore after a line
+    bool raw = false;               // Raw mode is on
+    string prompt;
+    string buffer;                  // Line being edited
+    size_t cursor = 0;              // Byte offset of the cursor in 'buffer'
+    size_t browsing = string::npos; // History line shown by Up/Down, npos when editing a new line
+    string draft;                   // New line put aside while browsing
+    uint64_t browsedVersion = 0;    // History version the browsing offset belongs to
+
+    bool enableRaw();
+    void disableRaw();
+    bool readByte(char &c);
+    void refresh();
+    void insert(const string &text);
+    void complete(bool repeated);
+    void escape();
+    void browse(bool older);
+    bool reverseSearch();
+
+public:
+    explicit LineEditor(int inputFd = STDIN_FILENO);
+    LineEditor(const LineEditor &) = delete;
+    LineEditor &operator=(const LineEditor &) = delete;
+    ~LineEditor();
+
+    static bool usable(int fd);     // Check if a terminal can be edited on
+    bool readLine(const string &linePrompt, string &line); // False at the end of input
+};
+
+// Instructions of a compiled script
+enum ScriptOp : uint32_t
+{
+    OP_RUN,            // Run commands a to a+b-1, which sets lastStatus
+    OP_SOURCE,         // Run the text at string a (length b), kept as text because it does not parse
+    OP_BLOCK_BEGIN,    // 'parallel {'
+    OP_BLOCK_END,      // '}' closing a parallel block
+    OP_JUMP,           // Continue at instruction a
+    OP_JUMP_IF_FAILED, // Continue at instruction a if lastStatus is not 0
+    OP_JUMP_IF_PASSED, // Continue at instruction a if lastStatus is 0
+    OP_FOR_INIT,       // Restart loop a from its first item
+    OP_FOR_NEXT,       // Set the variable of loop a to its next item, or continue at b when done
+    OP_ERROR           // Report the message at string a (length b)
+};
+
+// One instruction of a compiled script
+struct ScriptInstruction
+{
+    uint32_t op;   // ScriptOp
+    uint32_t line; // Line number in the script
+    uint32_t a;    // Operands, see ScriptOp
+    uint32_t b;
+};
+
+// A 'for' loop of a compiled script: a list of words, or a {first..last} range counted in place
+struct ScriptLoop
+{
+    string_view variable; // Name of the loop variable
+    bool range;           // Items are the numbers first..last
+    int64_t first;
+    int64_t last;
+    uint64_t count;       // Number of items
+};
+
+// A script compiled to bytecode: control flow as jumps, command lines as their parsed commands.
+// The compiled form lives in the script cache, keyed by the script's path, size, modification
+// time and content hash, and is used in place from a mapping.
+class CompiledScript
+{
+private:
+    const char *image = nullptr; // Compiled form, mapped or in 'owned'
+    size_t imageSize = 0;
+    bool mapped = false;         // 'image' is a mapping of the cache entry
+    vector<char> owned;          // Compiled form built by this process
+
+    bool mapEntry(const string &entryPath, const string &scriptPath, const struct stat &st);
+    bool compile(const string &entryPath, const string &scriptPath, const struct stat &st, bool &stored);
+    friend bool precompileScript(const string &path);
+    friend class ScriptCompiler;
+
+public:
+    CompiledScript() = default;
+    CompiledScript(const CompiledScript &) = delete;
+    CompiledScript &operator=(const CompiledScript &) = delete;
+    ~CompiledScript();
+
+    bool open(const string &path);                          // Map the cache entry, compiling it if missing or stale
+    size_t size() const;                                    // Number of instructions
+    const ScriptInstruction &instruction(size_t pc) const;  // Instruction pc, pc < size()
+    string_view text(uint32_t offset, uint32_t length) const; // String of OP_SOURCE and OP_ERROR
+    size_t loops() const;                                   // Number of 'for' loops
+    ScriptLoop loop(uint32_t i) const;                      // Loop i
+    string_view loopWord(uint32_t i, uint64_t item) const;  // Item of a word list loop
+    void load(uint32_t first, uint32_t count, CommandLine &line) const; // Commands of OP_RUN, into 'line'
+};
+
+// Class compiling script lines to a CompiledScript. Lines are added one at a time, so a script
+// read from a pipe can be compiled one control statement at a time.
+class ScriptCompiler
+{
+private:
+    struct State;                 // Code and tables built so far, open statements
+    unique_ptr<State> state;
+
+public:
+    ScriptCompiler();
+    ~ScriptCompiler();
+
+    void addLine(string_view text, uint32_t number); // Compile the next line of the script
+    bool inStatement() const;                        // Check if a control statement is still open
+    void finish();                                   // End of script, drops unterminated statements
+    bool build(CompiledScript &script, const string &path = "") const; // Store the compiled form in 'script'
+    bool empty() const;                              // Check if nothing was compiled
+    void clear();                                    // Start over for the next statement
+};
+
+// Script functions
+bool startsStatement(const vector<string_view> &tokens); // Check if a line holds a control keyword
+bool scriptCacheEnabled();
+bool precompileScript(const string &path);
+
+// Cache directory functions, shared by the script and output caches
+uint64_t hashBytes(const char *data, size_t size); // Fast non-cryptographic hash
+string cacheDirectory();                          // MISH_CACHE_DIR, $XDG_CACHE_HOME/mish or ~/.cache/mish
+bool makeDirectories(const string &dir);
+bool writeCacheFile(const string &entryPath, const vector<char> &image); // Atomic write by rename
+
+// Backends for the tokenizer's scan over ordinary characters
+enum class LexerBackend
+{
+    Scalar, // One byte at a time through a lookup table
+    SSE2,   // 16 bytes per step
+    AVX2    // 32 bytes per step, picked at runtime when the CPU has it
+};
+
+// Active lexer backend
+extern LexerBackend lexerBackend;
+
+// Lexer functions
+void initLexerBackend();
+bool lexerBackendSupported(LexerBackend backend);
+size_t scanPlain(const char *text, size_t length, bool inQuotes);
+
+// Tracing (MISH_TRACE=file.json writes Chrome trace-event JSON at exit)
+extern bool traceEnabled;
+void initTrace();
+uint64_t traceNow();
+void traceRecord(const char *name, const char *category, uint64_t start, uint64_t end, pid_t pid = 0);
+
+// Scoped span in the shell's trace, costs one branch when tracing is off
+class TraceSpan
+{
+    const char *name;
+    uint64_t start;
+
+public:
+    explicit TraceSpan(const char *spanName) : name(spanName), start(traceEnabled ? traceNow() : 0) {}
+    ~TraceSpan()
+    {
+        if (traceEnabled)
+            traceRecord(name, "shell", start, traceNow());
+    }
+};
+
+// Resource accounting functions
+double monotonicNow();
+string jsonEscape(string_view text);
+void accountPipeline(const Command *pipeline, const vector<pid_t> &pids,
+                     const vector<StageResult> &results, double wall, bool timed);
+int timeBuiltIn(const Command &cmd);
+void printPipeStats(const Command *pipeline, const vector<ShellStage> &stages);
+
 // Main functions
-vector<string> tokenize(const string &input);
-bool validateCommand(const Command &cmd);
-vector<Command> parseTokens(const vector<string> &tokens);
-bool isBuiltInCommand(const string &cmd);
-void executeBuiltIn(const Command &cmd);
+void tokenize(string_view input, CommandLine &line);
+bool validateCommand(const Command &cmd, bool report = true);
+void parseTokens(CommandLine &line, bool report = true);
+bool isBuiltInCommand(string_view cmd);
+vector<string_view> builtInNames(); // Names of the built-ins, for completion
+int executeBuiltIn(const Command &cmd);
+int executeBuiltInRedirected(const Command &cmd);
+int builtinParallel(const Command &cmd); // 'parallel': run a command per input line on worker threads
 void setupRedirection(const Command &cmd);
-void executePipeline(vector<Command> &pipeline);
-void executeCommands(const vector<Command> &commands);
+void executePipeline(const Command *pipeline, int n, bool timed = false, const Placement *placement = nullptr);
+void executeCommands(vector<Command> &commands);
+
+// Expansion functions
+void expandCommands(Command *commands, size_t count);     // Replace variables and patterns, in place
+void expandWord(string_view word, vector<string> &out);   // Expanded words of one word, appended
+size_t expandGlob(string_view pattern, Arena &arena, vector<string_view> &matches); // Sorted matches
+void clearGlobCache();                                    // Forget cached directory listings
+bool isBlockStart(const vector<string_view> &tokens);
+bool isBlockEnd(const vector<string_view> &tokens);
+void initShell();
 void interactiveMode();
 void scriptMode(const string &fileName);
 
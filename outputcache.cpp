@@ -0,0 +1,479 @@
+#include "mish.h"
+#include <algorithm>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+using namespace std;
+
+namespace
+{
+    const uint32_t OUTPUT_CACHE_VERSION = 1;
+    const char OUTPUT_CACHE_MAGIC[8] = {'M', 'I', 'S', 'H', 'O', 'U', 'T', '\0'};
+
+    // Bytes of entries and outputs kept when MISH_OUTPUT_CACHE_SIZE is not set
+    const size_t DEFAULT_CACHE_SIZE = 64 << 20;
+
+    // Header of an entry file 'k<key hash>', followed by the key itself. The output is stored
+    // once per distinct content in 'o<content hash>-<size>'.
+    struct EntryHeader
+    {
+        char magic[8];
+        uint32_t version;
+        int32_t status;       // Exit status of the pipeline
+        uint64_t outputHash;  // Content hash of the stdout it wrote
+        uint64_t outputSize;
+        uint32_t keySize;
+    };
+
+    // Hits and misses, kept in the 'stats' file across shells
+    struct CacheStats
+    {
+        uint64_t hits;
+        uint64_t misses;
+    };
+
+    // One file of the store, for eviction
+    struct StoredFile
+    {
+        string name;
+        struct timespec used; // Modification time, set again on every hit
+        off_t size;
+    };
+}
+
+// Function to get the directory of the output cache, empty if there is no cache directory
+static string outputCacheDirectory()
+{
+    string dir = cacheDirectory();
+    return dir.empty() ? dir : dir + "/output";
+}
+
+// Function to get the size limit of the store. MISH_OUTPUT_CACHE_SIZE takes a size like 256M.
+static size_t outputCacheLimit()
+{
+    size_t limit = parsePipeSize(env.get("MISH_OUTPUT_CACHE_SIZE"));
+    return limit != 0 ? limit : DEFAULT_CACHE_SIZE;
+}
+
+// Function to get the name of the file holding an output
+static string outputName(uint64_t hash, uint64_t size)
+{
+    char name[48];
+    snprintf(name, sizeof(name), "o%016llx-%llu", static_cast<unsigned long long>(hash),
+             static_cast<unsigned long long>(size));
+    return name;
+}
+
+// Function to add one to the hit or miss count. The file is locked, as shells share the store.
+static void countLookup(const string &dir, bool hit)
+{
+    if (!makeDirectories(dir))
+    {
+        errno = 0;
+        return;
+    }
+    int fd = open((dir + "/stats").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        errno = 0;
+        return;
+    }
+    flock(fd, LOCK_EX);
+    CacheStats stats = {0, 0};
+    if (pread(fd, &stats, sizeof(stats), 0) != sizeof(stats))
+    {
+        stats = {0, 0};
+    }
+    (hit ? stats.hits : stats.misses)++;
+    pwrite(fd, &stats, sizeof(stats), 0);
+    close(fd); // Releases the lock
+    errno = 0;
+}
+
+// Function to build the key of a pipeline: every stage's words and redirections, the working
+// directory, the selected variables, and the inputs read with '<' by content hash (or by
+// modification time with -m). Returns false if an input cannot be read, so the pipeline runs
+// without the cache and reports the error itself.
+static bool pipelineKey(const Command *pipeline, int n, const CacheOptions &options, string &key)
+{
+    key.clear();
+    for (int i = 0; i < n; i++)
+    {
+        const Command &cmd = pipeline[i];
+        for (const auto &token : cmd.tokens)
+        {
+            key.append(token.data(), token.size());
+            key += '\0';
+        }
+        if (cmd.redirectOutputToFile())
+        {
+            key += cmd.appendOutput() ? ">>" : ">";
+            key.append(cmd.redirectOutputFileName.data(), cmd.redirectOutputFileName.size());
+        }
+        if (cmd.redirectedInputFromFile())
+        {
+            string_view name = cmd.redirectedInputFileName;
+            struct stat st;
+            int fd = open(name.data(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+            {
+                if (fd != -1)
+                    close(fd);
+                errno = 0;
+                return false;
+            }
+
+            char stamp[96];
+            if (options.byTime)
+            {
+                snprintf(stamp, sizeof(stamp), "<%llu:%llu:%lld.%09ld:%lld",
+                         static_cast<unsigned long long>(st.st_dev), static_cast<unsigned long long>(st.st_ino),
+                         static_cast<long long>(st.st_mtim.tv_sec), st.st_mtim.tv_nsec,
+                         static_cast<long long>(st.st_size));
+            }
+            else
+            {
+                uint64_t hash = hashBytes("", 0);
+                if (st.st_size > 0)
+                {
+                    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if (data == MAP_FAILED)
+                    {
+                        close(fd);
+                        errno = 0;
+                        return false;
+                    }
+                    hash = hashBytes(static_cast<const char *>(data), st.st_size);
+                    munmap(data, st.st_size);
+                }
+                snprintf(stamp, sizeof(stamp), "<%016llx:%lld", static_cast<unsigned long long>(hash),
+                         static_cast<long long>(st.st_size));
+            }
+            close(fd);
+            key.append(name.data(), name.size());
+            key += stamp;
+        }
+        key += '\n';
+    }
+
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr)
+    {
+        errno = 0;
+        return false;
+    }
+    key += "cwd=";
+    key += cwd;
+    key += '\n';
+    for (const auto &name : options.variables)
+    {
+        const string *value = env.lookup(env.intern(name));
+        key += name;
+        key += value != nullptr ? "=" + *value : string(" unset");
+        key += '\n';
+    }
+    return true;
+}
+
+// Function to mark a file of the store as just used
+static void touchFile(const string &path)
+{
+    utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    errno = 0;
+}
+
+// Function to write a stored output and set the status it ended with. Returns false on a miss.
+static bool replay(const string &dir, const string &entryPath, const string &key, int &status)
+{
+    int fd = open(entryPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        errno = 0;
+        return false;
+    }
+    EntryHeader header;
+    string stored(key.size(), '\0');
+    bool valid = read(fd, &header, sizeof(header)) == sizeof(header) &&
+                 memcmp(header.magic, OUTPUT_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.version == OUTPUT_CACHE_VERSION && header.keySize == key.size() &&
+                 read(fd, &stored[0], stored.size()) == static_cast<ssize_t>(stored.size()) && stored == key;
+    close(fd);
+    if (!valid)
+    {
+        errno = 0;
+        return false; // A different key with the same hash, or an old entry
+    }
+
+    string outputPath = dir + "/" + outputName(header.outputHash, header.outputSize);
+    int output = open(outputPath.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (output == -1 || fstat(output, &st) == -1 || static_cast<uint64_t>(st.st_size) != header.outputSize)
+    {
+        if (output != -1)
+            close(output);
+        unlink(entryPath.c_str()); // The output was evicted
+        errno = 0;
+        return false;
+    }
+    copyToStdout(output);
+    close(output);
+    touchFile(entryPath);
+    touchFile(outputPath);
+    status = header.status;
+    return true;
+}
+
+// Function to remove the least recently used files until the store fits its limit
+static void evict(const string &dir)
+{
+    DIR *listing = opendir(dir.c_str());
+    if (listing == nullptr)
+    {
+        errno = 0;
+        return;
+    }
+    vector<StoredFile> files;
+    size_t total = 0;
+    for (struct dirent *entry; (entry = readdir(listing)) != nullptr;)
+    {
+        struct stat st;
+        if ((entry->d_name[0] != 'k' && entry->d_name[0] != 'o') ||
+            fstatat(dirfd(listing), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            continue;
+        files.push_back({entry->d_name, st.st_mtim, st.st_size});
+        total += st.st_size;
+    }
+    closedir(listing);
+
+    size_t limit = outputCacheLimit();
+    if (total > limit)
+    {
+        sort(files.begin(), files.end(), [](const StoredFile &a, const StoredFile &b)
+             { return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec; });
+        for (size_t i = 0; i < files.size() && total > limit; i++)
+        {
+            unlink((dir + "/" + files[i].name).c_str());
+            total -= files[i].size;
+        }
+    }
+    errno = 0;
+}
+
+// Function to store the output captured in 'fd' and the status of a pipeline under 'key'
+static void store(const string &dir, const string &entryPath, const string &key, int fd, int status)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) > outputCacheLimit() / 2 || !makeDirectories(dir))
+    {
+        errno = 0;
+        return;
+    }
+
+    vector<char> output(st.st_size);
+    if (!output.empty() && pread(fd, output.data(), output.size(), 0) != static_cast<ssize_t>(output.size()))
+    {
+        errno = 0;
+        return;
+    }
+    uint64_t hash = hashBytes(output.data(), output.size());
+    string outputPath = dir + "/" + outputName(hash, output.size());
+    if (access(outputPath.c_str(), F_OK) == 0)
+        touchFile(outputPath); // Same output as another command, stored once
+    else if (!writeCacheFile(outputPath, output))
+    {
+        errno = 0;
+        return;
+    }
+
+    EntryHeader header;
+    memcpy(header.magic, OUTPUT_CACHE_MAGIC, sizeof(header.magic));
+    header.version = OUTPUT_CACHE_VERSION;
+    header.status = status;
+    header.outputHash = hash;
+    header.outputSize = output.size();
+    header.keySize = static_cast<uint32_t>(key.size());
+    vector<char> entry(sizeof(header) + key.size());
+    memcpy(entry.data(), &header, sizeof(header));
+    memcpy(entry.data() + sizeof(header), key.data(), key.size());
+    writeCacheFile(entryPath, entry);
+    errno = 0;
+    evict(dir);
+}
+
+// Function to print the statistics of the store
+static void printCacheStats(const string &dir)
+{
+    size_t entries = 0, outputs = 0, bytes = 0;
+    DIR *listing = opendir(dir.c_str());
+    if (listing != nullptr)
+    {
+        for (struct dirent *entry; (entry = readdir(listing)) != nullptr;)
+        {
+            struct stat st;
+            if ((entry->d_name[0] != 'k' && entry->d_name[0] != 'o') ||
+                fstatat(dirfd(listing), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+                continue;
+            (entry->d_name[0] == 'k' ? entries : outputs)++;
+            bytes += st.st_size;
+        }
+        closedir(listing);
+    }
+
+    CacheStats stats = {0, 0};
+    int fd = open((dir + "/stats").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd != -1)
+    {
+        flock(fd, LOCK_SH);
+        if (read(fd, &stats, sizeof(stats)) != sizeof(stats))
+        {
+            stats = {0, 0};
+        }
+        close(fd);
+    }
+    errno = 0;
+
+    uint64_t lookups = stats.hits + stats.misses;
+    cout << "entries " << entries << ", outputs " << outputs << ", " << bytes << " of " << outputCacheLimit()
+         << " bytes\n"
+         << "hits " << stats.hits << ", misses " << stats.misses << fixed << setprecision(1) << " ("
+         << (lookups > 0 ? 100.0 * stats.hits / lookups : 0.0) << "% hit rate)\n";
+    cout.unsetf(ios::fixed);
+}
+
+// Function to remove every file of the store
+static void clearOutputCache(const string &dir)
+{
+    DIR *listing = opendir(dir.c_str());
+    if (listing == nullptr)
+    {
+        errno = 0;
+        return;
+    }
+    for (struct dirent *entry; (entry = readdir(listing)) != nullptr;)
+    {
+        if (entry->d_name[0] != '.')
+            unlinkat(dirfd(listing), entry->d_name, 0);
+    }
+    closedir(listing);
+    errno = 0;
+}
+
+// Function to parse the options of a 'cache' prefix, leaving 'tokens' at the command:
+//   cache [-m] [-e NAME]... command    or    cache -s | -c
+// -s prints the statistics and -c empties the store; they take no command, and false is
+// returned once they are done. Throws a ShellError for a bad option.
+bool parseCacheOptions(TokenList &tokens, CacheOptions &options)
+{
+    options = CacheOptions();
+    size_t i = 1;
+    for (; i < tokens.size() && tokens[i].size() > 1 && tokens[i][0] == '-'; i++)
+    {
+        string_view option = tokens[i];
+        if (option == "--")
+        {
+            i++;
+            break;
+        }
+        if (option == "-m")
+        {
+            options.byTime = true;
+        }
+        else if (option == "-e" && i + 1 < tokens.size())
+        {
+            options.variables.emplace_back(tokens[++i]);
+        }
+        else if ((option == "-s" || option == "-c") && i + 1 == tokens.size())
+        {
+            string dir = outputCacheDirectory();
+            if (dir.empty())
+            {
+                throw ShellError("cache: no cache directory");
+            }
+            option == "-s" ? printCacheStats(dir) : clearOutputCache(dir);
+            return false;
+        }
+        else
+        {
+            throw ShellError("cache: bad option " + string(option));
+        }
+    }
+    if (i == tokens.size())
+    {
+        throw ShellError("cache: missing command");
+    }
+    tokens = TokenList(tokens.begin() + i, tokens.size() - i);
+    return true;
+}
+
+// Function to run a foreground pipeline through the output cache. A hit writes the stored
+// stdout and sets the stored status without starting anything. A miss runs the pipeline with
+// its stdout captured, then stores it unless it ended with a signal or a command was not
+// found. Pipelines writing to a file, and background ones, run as usual.
+void executeCached(const Command *pipeline, int n, const CacheOptions &options, bool timed,
+                   const Placement *placement)
+{
+    string dir = outputCacheDirectory();
+    string key;
+    if (dir.empty() || pipeline[n - 1].isBackground() || pipeline[n - 1].redirectOutputToFile() ||
+        !pipelineKey(pipeline, n, options, key))
+    {
+        executePipeline(pipeline, n, timed, placement);
+        return;
+    }
+    TraceSpan span("outputCache");
+    key.insert(0, "v" + to_string(OUTPUT_CACHE_VERSION) + "\n");
+
+    char name[24];
+    snprintf(name, sizeof(name), "/k%016llx", static_cast<unsigned long long>(hashBytes(key.data(), key.size())));
+    string entryPath = dir + name;
+
+    int status;
+    cout << flush;
+    if (replay(dir, entryPath, key, status))
+    {
+        countLookup(dir, true);
+        lastStatus = status;
+        if (status != 0 && !(pipeline[n - 1].flags & CMD_TESTED))
+        {
+            handleError("Command exited with status: " + to_string(status));
+        }
+        return;
+    }
+    countLookup(dir, false);
+
+    int capture = memfd_create("mish-cached-output", MFD_CLOEXEC);
+    if (capture == -1)
+    {
+        errno = 0;
+        executePipeline(pipeline, n, timed, placement);
+        return;
+    }
+
+    // The stages inherit the shell's stdout, so it points at the capture while they run
+    int saved = dup(STDOUT_FILENO);
+    dup2(capture, STDOUT_FILENO);
+    try
+    {
+        executePipeline(pipeline, n, timed, placement);
+    }
+    catch (...)
+    {
+        cout << flush;
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+        copyToStdout(capture);
+        close(capture);
+        throw;
+    }
+    cout << flush;
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    copyToStdout(capture);
+    if (lastStatus < 126)
+    {
+        store(dir, entryPath, key, capture, lastStatus);
+    }
+    close(capture);
+}
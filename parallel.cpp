@@ -0,0 +1,407 @@
+#include "mish.h"
+#include <spawn.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+using namespace std;
+
+namespace
+{
+    // Items read but not yet written out, per worker, before reading waits for output
+    const size_t ITEMS_PER_WORKER = 16;
+
+    // Descriptors left free for the shell and for each child's /dev/null while items are held
+    const size_t SPARE_FDS = 32;
+
+    // One input item and what running the command on it produced
+    struct ParallelItem
+    {
+        string text;
+        string path;      // Resolved command, empty if it was not found
+        vector<string> args;
+        int output = -1;  // memfd holding the command's stdout
+        int status = 0;   // Wait status
+        int captureError = 0; // errno of a failed memfd_create, the command was not run
+        bool done = false;
+    };
+
+    // Items handed to one worker. The worker takes from the front, idle workers steal from the back.
+    struct WorkQueue
+    {
+        mutex lock;
+        deque<ParallelItem *> items;
+    };
+
+    // State shared by the reading thread and the workers
+    struct ParallelRun
+    {
+        vector<unique_ptr<WorkQueue>> queues;
+        char *const *envp = nullptr; // Built once, the environment does not change meanwhile
+        mutex lock;                  // Guards the fields below and every item's 'done'
+        condition_variable workReady;
+        condition_variable itemDone;
+        size_t queued = 0;           // Items in the queues
+        bool closed = false;         // No more items will be queued
+        atomic<size_t> steals{0};
+    };
+}
+
+// Function to take the next item for worker 'w': its own oldest, or the newest of another worker
+static ParallelItem *takeItem(ParallelRun &run, size_t w)
+{
+    size_t count = run.queues.size();
+    for (size_t k = 0; k < count; k++)
+    {
+        WorkQueue &queue = *run.queues[(w + k) % count];
+        ParallelItem *item = nullptr;
+        {
+            lock_guard<mutex> guard(queue.lock);
+            if (queue.items.empty())
+                continue;
+            if (k == 0)
+            {
+                item = queue.items.front();
+                queue.items.pop_front();
+            }
+            else
+            {
+                item = queue.items.back();
+                queue.items.pop_back();
+            }
+        }
+        if (k != 0)
+        {
+            run.steals++;
+        }
+        lock_guard<mutex> guard(run.lock);
+        run.queued--;
+        return item;
+    }
+    return nullptr;
+}
+
+// Function to run the command of one item with its stdout captured in a memfd and stdin
+// from /dev/null, so the children never read the items. Without a memfd the command is not
+// run, since its output could not be kept in order.
+static void runItem(ParallelRun &run, ParallelItem &item)
+{
+    item.output = memfd_create("mish-parallel-output", MFD_CLOEXEC);
+    if (item.output == -1)
+    {
+        item.captureError = errno;
+        item.status = 1 << 8;
+        errno = 0;
+        return;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, item.output, STDOUT_FILENO);
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    vector<char *> argv;
+    for (auto &arg : item.args)
+    {
+        argv.push_back(&arg[0]);
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid;
+    if (posix_spawn(&pid, item.path.c_str(), &actions, &attr, argv.data(), run.envp) != 0)
+    {
+        item.status = 127 << 8;
+    }
+    else
+    {
+        while (waitpid(pid, &item.status, 0) == -1 && errno == EINTR)
+        {
+        }
+    }
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+}
+
+// Function run by each worker thread until the input is exhausted
+static void workerLoop(ParallelRun &run, size_t w)
+{
+    while (true)
+    {
+        ParallelItem *item = takeItem(run, w);
+        if (item == nullptr)
+        {
+            unique_lock<mutex> guard(run.lock);
+            if (run.queued == 0 && run.closed)
+                return;
+            run.workReady.wait(guard, [&run]() { return run.queued > 0 || run.closed; });
+            continue;
+        }
+
+        runItem(run, *item);
+        {
+            lock_guard<mutex> guard(run.lock);
+            item->done = true;
+        }
+        run.itemDone.notify_all();
+    }
+}
+
+// Function to build the arguments of an item: every "{}" in the template replaced by the item,
+// or the item appended if the template has none
+static vector<string> itemArguments(const TokenList &command, const string &item)
+{
+    vector<string> args;
+    bool placed = false;
+    for (const auto &token : command)
+    {
+        string arg(token);
+        for (size_t pos = arg.find("{}"); pos != string::npos; pos = arg.find("{}", pos + item.size()))
+        {
+            arg.replace(pos, 2, item);
+            placed = true;
+        }
+        args.push_back(move(arg));
+    }
+    if (!placed)
+    {
+        args.push_back(item);
+    }
+    return args;
+}
+
+// Function to write out an item's output once it has finished. Returns false if it failed.
+static bool writeItem(ParallelRun &run, ParallelItem &item)
+{
+    {
+        unique_lock<mutex> guard(run.lock);
+        run.itemDone.wait(guard, [&item]() { return item.done; });
+    }
+    if (item.output != -1)
+    {
+        copyToStdout(item.output);
+        close(item.output);
+    }
+    if (item.status == 0)
+        return true;
+
+    errno = item.captureError;
+    if (item.captureError != 0)
+        handleError("parallel: cannot capture the output of '" + item.text + "'");
+    else if (item.path.empty())
+        handleError("parallel: command not found: " + item.args[0]);
+    else
+        handleError("parallel: '" + item.text + "' exited with status " + to_string(exitStatusOf(item.status)));
+    errno = 0;
+    return false;
+}
+
+// Function to choose how many items may be held at once. Each holds a memfd until it is
+// written out, so the count stays under RLIMIT_NOFILE less the descriptors already open.
+static size_t readAheadLimit(size_t workers)
+{
+    size_t limit = workers * ITEMS_PER_WORKER;
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == -1 || nofile.rlim_cur == RLIM_INFINITY)
+    {
+        errno = 0;
+        return limit;
+    }
+    size_t open = 0;
+    if (DIR *dir = opendir("/proc/self/fd"))
+    {
+        while (readdir(dir) != nullptr)
+        {
+            open++;
+        }
+        closedir(dir);
+    }
+    errno = 0;
+    size_t used = open + SPARE_FDS; // Over by "." and "..", which is fine
+    size_t room = nofile.rlim_cur > used ? nofile.rlim_cur - used : 0;
+    return max<size_t>(min(limit, room), 1);
+}
+
+// Built-in 'parallel': run a command once per line of input, several at a time.
+//   parallel [-j N] [-a FILE] command [args...]
+// "{}" in the arguments stands for the line, otherwise it is appended. Each worker keeps a
+// queue of items and steals from the others when it runs dry. Outputs are written in input
+// order, and a throughput summary goes to stderr at the end.
+int builtinParallel(const Command &cmd)
+{
+    size_t workers = thread::hardware_concurrency();
+    string inputFile;
+    size_t first = 1;
+    for (; first + 1 < cmd.tokens.size() && cmd.tokens[first][0] == '-'; first += 2)
+    {
+        string_view option = cmd.tokens[first];
+        string_view value = cmd.tokens[first + 1];
+        if (option == "-j")
+        {
+            char *end;
+            long count = strtol(value.data(), &end, 10);
+            if (*end != '\0' || count < 1 || count > 4096)
+            {
+                throw ShellError("parallel: bad job count " + string(value));
+            }
+            workers = static_cast<size_t>(count);
+        }
+        else if (option == "-a")
+        {
+            inputFile = string(value);
+        }
+        else
+        {
+            throw ShellError("parallel: unknown option " + string(option));
+        }
+    }
+    if (first == cmd.tokens.size())
+    {
+        throw ShellError("parallel: missing command");
+    }
+    TokenList command(cmd.tokens.begin() + first, cmd.tokens.size() - first);
+    workers = max<size_t>(workers, 1);
+    size_t window = readAheadLimit(workers);
+
+    int input = STDIN_FILENO;
+    if (!inputFile.empty())
+    {
+        input = open(inputFile.c_str(), O_RDONLY | O_CLOEXEC);
+        if (input == -1)
+        {
+            throw ShellError("parallel: cannot open " + inputFile);
+        }
+    }
+
+    TraceSpan span("parallel");
+    cout << flush;
+    double start = monotonicNow();
+    ParallelRun run;
+    run.envp = env.envp();
+    for (size_t w = 0; w < workers; w++)
+    {
+        run.queues.push_back(make_unique<WorkQueue>());
+    }
+    vector<thread> threads;
+    for (size_t w = 0; w < workers; w++)
+    {
+        threads.emplace_back(workerLoop, ref(run), w);
+    }
+
+    // Items are only added at the back and removed from the front, so the workers' pointers stay valid
+    deque<ParallelItem> items;
+    size_t total = 0, failed = 0;
+    auto writeFront = [&]()
+    {
+        failed += writeItem(run, items.front()) ? 0 : 1;
+        items.pop_front();
+    };
+
+    // Function to queue one line of input, round robin over the workers
+    auto addItem = [&](string text)
+    {
+        while (items.size() >= window)
+        {
+            writeFront();
+        }
+        items.emplace_back();
+        ParallelItem &item = items.back();
+        item.args = itemArguments(command, text);
+        item.path = commandHash.resolve(item.args[0]); // The hash is not shared with the workers
+        item.text = move(text);
+        if (item.path.empty())
+        {
+            item.status = 127 << 8;
+            item.done = true;
+            total++;
+            return;
+        }
+
+        WorkQueue &queue = *run.queues[total++ % workers];
+        {
+            lock_guard<mutex> guard(queue.lock);
+            queue.items.push_back(&item);
+        }
+        {
+            lock_guard<mutex> guard(run.lock);
+            run.queued++;
+        }
+        run.workReady.notify_one();
+    };
+
+    // Read lines in large blocks, empty lines are skipped
+    string pending;
+    char buffer[65536];
+    ssize_t count;
+    while ((count = read(input, buffer, sizeof(buffer))) != 0)
+    {
+        if (count == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        size_t from = 0;
+        for (const char *nl; (nl = static_cast<const char *>(memchr(buffer + from, '\n', count - from))) != nullptr;)
+        {
+            size_t end = nl - buffer;
+            pending.append(buffer + from, end - from);
+            if (!pending.empty())
+            {
+                addItem(move(pending));
+            }
+            pending.clear();
+            from = end + 1;
+        }
+        pending.append(buffer + from, count - from);
+
+        // Write what has finished so far, without waiting for the rest
+        while (!items.empty())
+        {
+            {
+                lock_guard<mutex> guard(run.lock);
+                if (!items.front().done)
+                    break;
+            }
+            writeFront();
+        }
+    }
+    errno = 0;
+    if (!pending.empty())
+    {
+        addItem(move(pending));
+    }
+    if (input != STDIN_FILENO)
+    {
+        close(input);
+    }
+
+    {
+        lock_guard<mutex> guard(run.lock);
+        run.closed = true;
+    }
+    run.workReady.notify_all();
+    while (!items.empty())
+    {
+        writeFront();
+    }
+    for (auto &worker : threads)
+    {
+        worker.join();
+    }
+
+    double wall = monotonicNow() - start;
+    cerr << fixed << setprecision(3) << "parallel: " << total << " items in " << wall << "s, "
+         << setprecision(1) << (wall > 0 ? total / wall : 0) << " items/s, " << workers << " workers, "
+         << run.steals.load() << " steals, " << failed << " failed" << endl;
+    cerr.unsetf(ios::fixed);
+    return failed == 0 ? 0 : 1;
+}
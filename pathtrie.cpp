@@ -0,0 +1,314 @@
+#include "mish.h"
+#include <algorithm>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+using namespace std;
+
+// Global trie of the executables on PATH
+PathTrie pathTrie;
+
+// Events that can add or remove an executable of a watched directory
+static const uint32_t WATCH_EVENTS = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+                                     IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+// Close the inotify descriptor
+PathTrie::~PathTrie()
+{
+    if (inotifyFd != -1)
+    {
+        close(inotifyFd);
+    }
+}
+
+// Function to find the child of a node for a character, or 0 if there is none
+uint32_t PathTrie::child(uint32_t node, char c) const
+{
+    const auto &children = nodes[node].children;
+    auto it = lower_bound(children.begin(), children.end(), c,
+                          [](const pair<char, uint32_t> &entry, char key) { return entry.first < key; });
+    return it != children.end() && it->first == c ? it->second : 0;
+}
+
+// Function to count one more directory holding 'name'
+void PathTrie::insert(string_view name)
+{
+    static vector<uint32_t> path;
+    path.assign(1, 0);
+    uint32_t node = 0;
+    for (char c : name)
+    {
+        uint32_t next = child(node, c);
+        if (next == 0)
+        {
+            next = static_cast<uint32_t>(nodes.size());
+            nodes.emplace_back();
+            auto &children = nodes[node].children;
+            auto it = lower_bound(children.begin(), children.end(), c,
+                                  [](const pair<char, uint32_t> &entry, char key) { return entry.first < key; });
+            children.insert(it, {c, next});
+        }
+        node = next;
+        path.push_back(node);
+    }
+    if (nodes[node].terminal++ == 0)
+    {
+        for (uint32_t n : path)
+        {
+            nodes[n].names++; // A name in several directories counts once
+        }
+    }
+}
+
+// Function to count one directory fewer holding 'name'. Nodes are kept, an empty subtree is
+// skipped by its count.
+void PathTrie::erase(string_view name)
+{
+    uint32_t node = 0;
+    for (char c : name)
+    {
+        node = child(node, c);
+    }
+    if (--nodes[node].terminal > 0)
+        return;
+
+    node = 0;
+    nodes[0].names--;
+    for (char c : name)
+    {
+        node = child(node, c);
+        nodes[node].names--;
+    }
+}
+
+// Function to check whether a directory entry is an executable file
+static bool isExecutable(int dirFd, const char *name)
+{
+    struct stat st;
+    bool executable = fstatat(dirFd, name, &st, 0) == 0 && S_ISREG(st.st_mode) &&
+                      faccessat(dirFd, name, X_OK, 0) == 0;
+    errno = 0;
+    return executable;
+}
+
+// Function to add or remove one name of a watched directory after a change
+void PathTrie::update(Directory &dir, const string &name)
+{
+    int dirFd = open(dir.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    bool executable = dirFd != -1 && isExecutable(dirFd, name.c_str());
+    if (dirFd != -1)
+    {
+        close(dirFd);
+    }
+    errno = 0;
+
+    bool known = dir.names.count(name) != 0;
+    if (executable && !known)
+    {
+        dir.names.insert(name);
+        insert(name);
+    }
+    else if (!executable && known)
+    {
+        dir.names.erase(name);
+        erase(name);
+    }
+}
+
+// Function to read the executables of a directory and watch it for changes
+void PathTrie::scan(Directory &dir)
+{
+    if (inotifyFd != -1)
+    {
+        dir.watch = inotify_add_watch(inotifyFd, dir.path.c_str(), WATCH_EVENTS);
+    }
+    DIR *listing = opendir(dir.path.c_str());
+    if (listing == nullptr)
+    {
+        errno = 0;
+        return;
+    }
+    for (struct dirent *entry; (entry = readdir(listing)) != nullptr;)
+    {
+        if (entry->d_name[0] == '.' || (entry->d_type != DT_REG && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN))
+            continue;
+        if (isExecutable(dirfd(listing), entry->d_name) && dir.names.insert(entry->d_name).second)
+        {
+            insert(entry->d_name);
+        }
+    }
+    closedir(listing);
+    errno = 0;
+}
+
+// Function to build the trie for a colon-separated list of directories, replacing what it held
+void PathTrie::build(const string &path)
+{
+    TraceSpan span("pathTrie");
+    if (inotifyFd != -1)
+    {
+        close(inotifyFd);
+    }
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    errno = 0;
+    nodes.assign(1, Node());
+    dirs.clear();
+    builtFor = path;
+    built = true;
+
+    size_t start = 0;
+    while (start <= path.size())
+    {
+        size_t end = path.find(':', start);
+        if (end == string::npos)
+            end = path.size();
+        string dir = path.substr(start, end - start);
+        start = end + 1;
+        // The current directory changes with 'cd', so it is not part of the trie
+        if (dir.empty() || dir == "." || any_of(dirs.begin(), dirs.end(), [&dir](const unique_ptr<Directory> &d) { return d->path == dir; }))
+            continue;
+        dirs.push_back(make_unique<Directory>());
+        dirs.back()->path = dir;
+        scan(*dirs.back());
+    }
+}
+
+// Function to apply the changes inotify reported since the last call
+void PathTrie::processEvents()
+{
+    alignas(struct inotify_event) char buffer[16384];
+    ssize_t count;
+    while (inotifyFd != -1 && (count = read(inotifyFd, buffer, sizeof(buffer))) > 0)
+    {
+        for (ssize_t pos = 0; pos < count;)
+        {
+            const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(buffer + pos);
+            pos += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                built = false; // Events were lost, read everything again
+                continue;
+            }
+
+            auto dir = find_if(dirs.begin(), dirs.end(),
+                               [event](const unique_ptr<Directory> &d) { return d->watch == event->wd; });
+            if (dir == dirs.end())
+                continue;
+
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+            {
+                // The directory went away, its names with it
+                for (const auto &name : (*dir)->names)
+                {
+                    erase(name);
+                }
+                (*dir)->names.clear();
+                (*dir)->watch = -1;
+            }
+            else if (event->len > 0)
+            {
+                update(**dir, event->name);
+            }
+        }
+    }
+    if (inotifyFd != -1 && (count == -1 && errno != EAGAIN))
+    {
+        built = false;
+    }
+    errno = 0;
+}
+
+// Function to bring the trie up to date: built on first use, rebuilt when PATH changed,
+// otherwise only the inotify events are applied
+void PathTrie::refresh()
+{
+    processEvents();
+    string path = env.get("PATH");
+    if (!built || path != builtFor)
+    {
+        build(path);
+    }
+}
+
+// Function to collect up to 'limit' names starting with 'prefix', in byte order. Returns how
+// many names start with it in all.
+size_t PathTrie::complete(string_view prefix, vector<string> &matches, size_t limit) const
+{
+    if (nodes.empty())
+        return 0;
+    uint32_t node = 0;
+    for (char c : prefix)
+    {
+        node = child(node, c);
+        if (node == 0)
+            return 0;
+    }
+
+    // Depth-first with an explicit stack, children in order
+    string name(prefix);
+    vector<pair<uint32_t, size_t>> stack = {{node, 0}}; // Node and next child to visit
+    if (nodes[node].terminal > 0 && limit > 0)
+    {
+        matches.push_back(name);
+    }
+    while (!stack.empty() && matches.size() < limit)
+    {
+        auto &top = stack.back();
+        const auto &children = nodes[top.first].children;
+        if (top.second == children.size())
+        {
+            stack.pop_back();
+            if (!stack.empty())
+                name.pop_back();
+            continue;
+        }
+        auto next = children[top.second++];
+        if (nodes[next.second].names == 0)
+            continue;
+        name += next.first;
+        stack.push_back({next.second, 0});
+        if (nodes[next.second].terminal > 0)
+        {
+            matches.push_back(name);
+        }
+    }
+    return nodes[node].names;
+}
+
+// Function to extend 'prefix' as far as every name starting with it agrees
+string PathTrie::commonPrefix(string_view prefix) const
+{
+    string result(prefix);
+    if (nodes.empty())
+        return result;
+    uint32_t node = 0;
+    for (char c : prefix)
+    {
+        node = child(node, c);
+        if (node == 0)
+            return result;
+    }
+    while (nodes[node].terminal == 0)
+    {
+        const pair<char, uint32_t> *only = nullptr;
+        for (const auto &entry : nodes[node].children)
+        {
+            if (nodes[entry.second].names == 0)
+                continue;
+            if (only != nullptr)
+                return result; // Names part here
+            only = &entry;
+        }
+        if (only == nullptr)
+            break;
+        result += only->first;
+        node = only->second;
+    }
+    return result;
+}
+
+// Function to get the number of distinct names in the trie
+size_t PathTrie::size() const
+{
+    return nodes.empty() ? 0 : nodes[0].names;
+}
@@ -0,0 +1,404 @@
+#include "mish.h"
+#include <poll.h>
+#include <sys/stat.h>
+using namespace std;
+
+// Most bytes moved by one splice or tee call
+static const size_t SPLICE_CHUNK = 1 << 20;
+
+// Buffer used where splice is not supported
+static const size_t COPY_BUFFER = 64 << 10;
+
+// Function to parse a pipe size: a number of bytes with an optional K, M or G suffix
+size_t parsePipeSize(string_view text)
+{
+    size_t value = 0;
+    size_t i = 0;
+    for (; i < text.size() && isdigit(static_cast<unsigned char>(text[i])); i++)
+    {
+        value = value * 10 + (text[i] - '0');
+        if (value > (1u << 30))
+            return 0;
+    }
+    if (i == 0)
+        return 0;
+    if (i + 1 == text.size())
+    {
+        switch (text[i])
+        {
+        case 'k':
+        case 'K':
+            value <<= 10;
+            break;
+        case 'm':
+        case 'M':
+            value <<= 20;
+            break;
+        case 'g':
+        case 'G':
+            value <<= 30;
+            break;
+        default:
+            return 0;
+        }
+    }
+    else if (i != text.size())
+    {
+        return 0;
+    }
+    return value <= (1u << 30) ? value : 0;
+}
+
+// Function to get the pipe size set by MISH_PIPESIZE, 0 to keep the kernel's 64 KiB
+size_t defaultPipeSize()
+{
+    return parsePipeSize(env.get("MISH_PIPESIZE"));
+}
+
+// Function to set the buffer size of a pipe. Sizes above /proc/sys/fs/pipe-max-size need
+// privileges, so a refused size is retried at that limit.
+void resizePipe(const array<int, 2> &pipe, size_t size)
+{
+    static long maxSize = -1;
+    if (fcntl(pipe[1], F_SETPIPE_SZ, static_cast<int>(size)) != -1)
+        return;
+
+    if (errno == EPERM)
+    {
+        if (maxSize == -1)
+        {
+            ifstream limit("/proc/sys/fs/pipe-max-size");
+            if (!(limit >> maxSize))
+            {
+                maxSize = 0;
+            }
+        }
+        if (maxSize > 0 && static_cast<size_t>(maxSize) < size)
+        {
+            fcntl(pipe[1], F_SETPIPE_SZ, static_cast<int>(maxSize));
+        }
+    }
+    errno = 0;
+}
+
+// Function to check whether a named file can take spliced output: a regular file, /dev/null,
+// or one that does not exist yet
+static bool spliceableOutput(string_view name)
+{
+    struct stat st;
+    bool ok = stat(name.data(), &st) == -1 || S_ISREG(st.st_mode) || name == "/dev/null";
+    errno = 0;
+    return ok;
+}
+
+// Function to decide whether stage i of an n-stage pipeline is one the shell runs itself:
+// a leading 'cat' of one regular file, a trailing 'cat' into a file, or a 'tee' into one file
+// between two pipes
+ShellStageKind shellStageKind(const Command *pipeline, int i, int n)
+{
+    const Command &cmd = pipeline[i];
+    if (n < 2 || cmd.tokens.empty())
+        return ShellStageKind::None;
+
+    string_view name = cmd.tokens[0];
+    size_t words = cmd.tokens.size();
+    if (i == 0 && name == "cat" && !cmd.redirectOutputToFile())
+    {
+        string_view file;
+        if (words == 2 && !cmd.redirectedInputFromFile() && cmd.tokens[1][0] != '-')
+            file = cmd.tokens[1];
+        else if (words == 1 && cmd.redirectedInputFromFile())
+            file = cmd.redirectedInputFileName;
+        else
+            return ShellStageKind::None;
+
+        struct stat st;
+        bool regular = stat(file.data(), &st) == 0 && S_ISREG(st.st_mode);
+        errno = 0;
+        return regular ? ShellStageKind::ReadFile : ShellStageKind::None;
+    }
+    if (i == n - 1 && name == "cat" && words == 1 && cmd.redirectOutputToFile() &&
+        !cmd.redirectedInputFromFile() && spliceableOutput(cmd.redirectOutputFileName))
+    {
+        return ShellStageKind::WriteFile;
+    }
+    if (i > 0 && i < n - 1 && name == "tee" && words == 2 && cmd.tokens[1][0] != '-' &&
+        !cmd.redirectOutputToFile() && !cmd.redirectedInputFromFile() && spliceableOutput(cmd.tokens[1]))
+    {
+        return ShellStageKind::Tee;
+    }
+    return ShellStageKind::None;
+}
+
+// Function to open the file of a stage, reporting failures the way the command would
+static bool openStage(const Command &cmd, ShellStage &stage)
+{
+    // The stage's pipe ends are only held by the shell, so they can be made non-blocking
+    for (int fd : {stage.in, stage.out})
+    {
+        if (fd != -1)
+        {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+    }
+    if (stage.kind == ShellStageKind::Relay)
+        return true;
+
+    string_view name;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    switch (stage.kind)
+    {
+    case ShellStageKind::ReadFile:
+        name = cmd.tokens.size() == 2 ? cmd.tokens[1] : cmd.redirectedInputFileName;
+        flags = O_RDONLY | O_CLOEXEC;
+        break;
+    case ShellStageKind::WriteFile:
+        name = cmd.redirectOutputFileName;
+        flags = O_WRONLY | O_CREAT | O_CLOEXEC | (cmd.appendOutput() ? O_APPEND : O_TRUNC);
+        break;
+    default:
+        name = cmd.tokens[1];
+        break;
+    }
+
+    stage.file = open(name.data(), flags, 0644);
+    if (stage.file == -1)
+    {
+        string kind = stage.kind == ShellStageKind::ReadFile ? "input" : "output";
+        handleError("Error opening " + kind + " file: " + string(name));
+        errno = 0;
+        return false;
+    }
+    return true;
+}
+
+// Function to write all of a buffer to a file
+static bool writeAll(int fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t count = write(fd, data, size);
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        data += count;
+        size -= count;
+    }
+    return true;
+}
+
+// Function to move up to 'size' bytes from a pipe into the stage's file. Returns the bytes
+// moved, 0 at the end of the input, or -1 with errno set.
+static ssize_t pipeToFile(ShellStage &stage, size_t size)
+{
+    if (!stage.copy)
+    {
+        ssize_t count = splice(stage.in, nullptr, stage.file, nullptr, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (count != -1 || errno != EINVAL)
+            return count;
+        stage.copy = true;
+    }
+
+    static unique_ptr<char[]> buffer(new char[COPY_BUFFER]);
+    ssize_t count = read(stage.in, buffer.get(), min(size, COPY_BUFFER));
+    if (count > 0 && !writeAll(stage.file, buffer.get(), count))
+        return -1;
+    return count;
+}
+
+// Function to move data for one stage that poll found ready. Returns -1 while the stage has
+// more to do, otherwise its wait status.
+static int stepStage(ShellStage &stage)
+{
+    ssize_t count = 0;
+    switch (stage.kind)
+    {
+    case ShellStageKind::ReadFile:
+        if (!stage.copy)
+        {
+            count = splice(stage.file, &stage.offset, stage.out, nullptr, SPLICE_CHUNK,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (count == -1 && errno == EINVAL)
+            {
+                stage.copy = true;
+                return -1;
+            }
+        }
+        else
+        {
+            // A write of at most PIPE_BUF bytes to a writable pipe is all or nothing
+            char buffer[PIPE_BUF];
+            count = pread(stage.file, buffer, sizeof(buffer), stage.offset);
+            if (count > 0)
+            {
+                count = write(stage.out, buffer, count);
+                stage.offset += count > 0 ? count : 0;
+            }
+        }
+        break;
+
+    case ShellStageKind::WriteFile:
+        count = pipeToFile(stage, SPLICE_CHUNK);
+        break;
+
+    case ShellStageKind::Tee:
+        // Like tee, data still flows to the next stage when the file could not be opened
+        if (stage.file == -1)
+        {
+            count = splice(stage.in, nullptr, stage.out, nullptr, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            break;
+        }
+
+        // Duplicate what is in the input pipe to the output pipe, then consume it into the file
+        count = tee(stage.in, stage.out, SPLICE_CHUNK, SPLICE_F_NONBLOCK);
+        for (ssize_t left = count; left > 0;)
+        {
+            ssize_t moved = pipeToFile(stage, left);
+            if (moved == -1 && errno == EAGAIN)
+                continue;
+            if (moved <= 0)
+            {
+                count = -1;
+                break;
+            }
+            left -= moved;
+        }
+        break;
+
+    case ShellStageKind::Relay:
+        // Waiting for data until a splice finds the next pipe full, then for room until one
+        // moves something again
+        count = splice(stage.in, nullptr, stage.out, nullptr, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (count > 0)
+        {
+            stage.bytes += count;
+            stage.waitingWrite = false;
+        }
+        else if (count == -1 && errno == EAGAIN)
+        {
+            stage.waitingWrite = !stage.waitingWrite;
+        }
+        break;
+
+    default:
+        return 1 << 8;
+    }
+
+    if (count > 0 || (count == -1 && (errno == EAGAIN || errno == EINTR)))
+    {
+        errno = 0;
+        return -1;
+    }
+    if (count == 0)
+        return stage.status;
+    if (errno == EPIPE)
+    {
+        errno = 0;
+        return SIGPIPE; // The next stage is gone, end as the command would have on SIGPIPE
+    }
+    if (stage.kind == ShellStageKind::Relay)
+    {
+        errno = 0;
+        return 0; // Nothing to report, the stages on either side do
+    }
+    handleError("Pipeline stage '" + string(stage.kind == ShellStageKind::Tee ? "tee" : "cat") + "' failed");
+    errno = 0;
+    return 1 << 8;
+}
+
+// Function to finish a stage and close its descriptors, so the stages next to it see the end
+static void finishStage(ShellStage &stage, int status, double start)
+{
+    for (int *fd : {&stage.in, &stage.out, &stage.file})
+    {
+        if (*fd != -1)
+        {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+    stage.status = status;
+    stage.wall = monotonicNow() - start;
+    stage.done = true;
+}
+
+// Function to run the stages the shell took over, alongside the pipeline's processes. Data
+// moves between the pipes and files with splice and tee, so it is never copied through the
+// shell. Returns once every stage has finished.
+void runShellStages(const Command *pipeline, vector<ShellStage> &stages)
+{
+    TraceSpan span("shellStages");
+    double start = monotonicNow();
+
+    // A stage whose reader is gone gets EPIPE, not a signal that would end the shell
+    struct sigaction ignore, saved;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGPIPE, &ignore, &saved);
+
+    size_t running = 0;
+    for (auto &stage : stages)
+    {
+        if (openStage(pipeline[stage.index], stage))
+        {
+            running++;
+        }
+        else if (stage.kind == ShellStageKind::Tee)
+        {
+            stage.status = 1 << 8; // Keeps passing data on, and fails at the end
+            running++;
+        }
+        else
+        {
+            finishStage(stage, 1 << 8, start);
+        }
+        stage.waitStart = start;
+    }
+
+    vector<pollfd> fds;
+    while (running > 0)
+    {
+        // Two entries per stage, a negative descriptor is ignored by poll. A relay only waits
+        // on the side it is blocked on, so the time it waits is charged to that side.
+        fds.clear();
+        for (const auto &stage : stages)
+        {
+            bool relay = stage.kind == ShellStageKind::Relay;
+            fds.push_back({stage.done || (relay && stage.waitingWrite) ? -1 : stage.in, POLLIN, 0});
+            fds.push_back({stage.done || (relay && !stage.waitingWrite) ? -1 : stage.out, POLLOUT, 0});
+        }
+        if (poll(fds.data(), fds.size(), -1) == -1)
+        {
+            errno = 0;
+            continue;
+        }
+        double now = monotonicNow();
+
+        for (size_t k = 0; k < stages.size(); k++)
+        {
+            ShellStage &stage = stages[k];
+            short input = fds[2 * k].revents;
+            short output = fds[2 * k + 1].revents;
+            bool ready = (fds[2 * k].fd == -1 || input != 0) && (fds[2 * k + 1].fd == -1 || output != 0);
+            if (stage.done || !(ready || ((input | output) & POLLERR)))
+                continue;
+
+            if (stage.kind == ShellStageKind::Relay)
+            {
+                (stage.waitingWrite ? stage.writeWait : stage.readWait) += now - stage.waitStart;
+                stage.waitStart = now;
+            }
+
+            int status = stepStage(stage);
+            if (status != -1)
+            {
+                finishStage(stage, status, start);
+                running--;
+            }
+        }
+    }
+
+    sigaction(SIGPIPE, &saved, nullptr);
+}
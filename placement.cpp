@@ -0,0 +1,329 @@
+#include "mish.h"
+#include <sched.h>
+#include <sys/syscall.h>
+#include <algorithm>
+using namespace std;
+
+namespace
+{
+    // I/O priority encoding of ioprio_set(2)
+    const int IOPRIO_CLASS_SHIFT = 13;
+    const int IOPRIO_WHO_PROCESS = 1;
+
+    // Resource limits accepted by 'place -l NAME=VALUE'
+    const pair<const char *, int> LIMIT_NAMES[] = {
+        {"as", RLIMIT_AS},         {"core", RLIMIT_CORE},   {"cpu", RLIMIT_CPU},
+        {"data", RLIMIT_DATA},     {"fsize", RLIMIT_FSIZE}, {"memlock", RLIMIT_MEMLOCK},
+        {"nofile", RLIMIT_NOFILE}, {"nproc", RLIMIT_NPROC}, {"stack", RLIMIT_STACK},
+    };
+}
+
+// Function to parse a whole decimal number, false if 'text' is anything else
+static bool parseNumber(string_view text, long long &value)
+{
+    string digits(text);
+    char *end = nullptr;
+    errno = 0;
+    value = strtoll(digits.c_str(), &end, 10);
+    bool ok = !digits.empty() && *end == '\0' && errno == 0;
+    errno = 0;
+    return ok;
+}
+
+// Function to parse a CPU list such as "0-3,8,10-11" into ascending CPU numbers
+static bool parseCpuList(string_view text, vector<int> &cpus)
+{
+    cpus.clear();
+    while (!text.empty())
+    {
+        size_t comma = text.find(',');
+        string_view item = text.substr(0, comma);
+        text = comma == string_view::npos ? string_view() : text.substr(comma + 1);
+
+        size_t dash = item.find('-');
+        long long low, high;
+        if (!parseNumber(item.substr(0, dash), low))
+            return false;
+        high = low;
+        if (dash != string_view::npos && !parseNumber(item.substr(dash + 1), high))
+            return false;
+        if (low < 0 || high < low || high >= CPU_SETSIZE)
+            return false;
+        for (long long cpu = low; cpu <= high; cpu++)
+        {
+            cpus.push_back(static_cast<int>(cpu));
+        }
+    }
+    sort(cpus.begin(), cpus.end());
+    cpus.erase(unique(cpus.begin(), cpus.end()), cpus.end());
+    return !cpus.empty();
+}
+
+// Function to read a CPU list from a sysfs file, empty if it cannot be read
+static vector<int> readCpuList(const string &path)
+{
+    ifstream file(path);
+    string text;
+    vector<int> cpus;
+    if (!(file >> text) || !parseCpuList(text, cpus))
+    {
+        cpus.clear();
+    }
+    errno = 0;
+    return cpus;
+}
+
+// Function to order CPUs so that those sharing a core's L2 cache (or, failing that, SMT
+// siblings) are next to each other. Consecutive stages placed along this order share a cache.
+static vector<int> siblingOrder(const vector<int> &cpus)
+{
+    vector<int> order;
+    vector<bool> placed(CPU_SETSIZE, false);
+    for (int cpu : cpus)
+    {
+        if (placed[cpu])
+            continue;
+        string base = "/sys/devices/system/cpu/cpu" + to_string(cpu);
+        vector<int> group = readCpuList(base + "/cache/index2/shared_cpu_list");
+        if (group.empty())
+        {
+            group = readCpuList(base + "/topology/thread_siblings_list");
+        }
+        group.push_back(cpu);
+        sort(group.begin(), group.end());
+        for (int sibling : group)
+        {
+            if (!placed[sibling] && binary_search(cpus.begin(), cpus.end(), sibling))
+            {
+                placed[sibling] = true;
+                order.push_back(sibling);
+            }
+        }
+    }
+    return order;
+}
+
+// Function to parse a resource limit value: a number with an optional K, M or G suffix, or
+// "unlimited"
+static bool parseLimit(string_view text, rlim_t &value)
+{
+    if (text == "unlimited")
+    {
+        value = RLIM_INFINITY;
+        return true;
+    }
+    int shift = 0;
+    if (!text.empty())
+    {
+        switch (text.back())
+        {
+        case 'k':
+        case 'K':
+            shift = 10;
+            break;
+        case 'm':
+        case 'M':
+            shift = 20;
+            break;
+        case 'g':
+        case 'G':
+            shift = 30;
+            break;
+        }
+    }
+    long long number;
+    if (!parseNumber(text.substr(0, text.size() - (shift != 0 ? 1 : 0)), number) || number < 0 ||
+        number > (LLONG_MAX >> shift))
+        return false;
+    value = static_cast<rlim_t>(number) << shift;
+    return true;
+}
+
+// Function to parse the options of a 'place' prefix, leaving 'tokens' at the command:
+//   place [-c CPUS] [-m set|spread|siblings] [-n NICE] [-i CLASS[:LEVEL]] [-l NAME=VALUE]... command
+// Throws a ShellError for a bad option.
+void parsePlacement(TokenList &tokens, Placement &placement)
+{
+    placement = Placement();
+    size_t i = 1;
+    bool cpusGiven = false;
+    for (; i < tokens.size() && tokens[i].size() > 1 && tokens[i][0] == '-'; i++)
+    {
+        string_view option = tokens[i];
+        if (option == "--")
+        {
+            i++;
+            break;
+        }
+        if (option.size() != 2 || string_view("cmnil").find(option[1]) == string_view::npos)
+        {
+            throw ShellError("place: unknown option " + string(option));
+        }
+        if (i + 1 == tokens.size())
+        {
+            throw ShellError("place: " + string(option) + " needs a value");
+        }
+        string_view value = tokens[++i];
+
+        switch (option[1])
+        {
+        case 'c':
+            if (!parseCpuList(value, placement.cpus))
+            {
+                throw ShellError("place: bad CPU list " + string(value));
+            }
+            cpusGiven = true;
+            break;
+
+        case 'm':
+            if (value == "set")
+                placement.mode = PlacementMode::Set;
+            else if (value == "spread")
+                placement.mode = PlacementMode::Spread;
+            else if (value == "siblings")
+                placement.mode = PlacementMode::Siblings;
+            else
+                throw ShellError("place: unknown mode " + string(value));
+            break;
+
+        case 'n':
+        {
+            long long nice;
+            if (!parseNumber(value, nice) || nice < -20 || nice > 19)
+            {
+                throw ShellError("place: nice value must be -20 to 19");
+            }
+            placement.setNice = true;
+            placement.nice = static_cast<int>(nice);
+            break;
+        }
+
+        case 'i':
+        {
+            size_t colon = value.find(':');
+            string_view name = value.substr(0, colon);
+            long long level = 4;
+            if (name == "rt" || name == "realtime")
+                placement.ioClass = 1;
+            else if (name == "be" || name == "best-effort")
+                placement.ioClass = 2;
+            else if (name == "idle")
+                placement.ioClass = 3;
+            else
+                throw ShellError("place: unknown I/O class " + string(name));
+            if (colon != string_view::npos && (!parseNumber(value.substr(colon + 1), level) || level < 0 || level > 7))
+            {
+                throw ShellError("place: I/O priority level must be 0 to 7");
+            }
+            placement.ioLevel = placement.ioClass == 3 ? 0 : static_cast<int>(level);
+            break;
+        }
+
+        case 'l':
+        {
+            size_t equals = value.find('=');
+            string_view name = value.substr(0, equals);
+            auto known = find_if(begin(LIMIT_NAMES), end(LIMIT_NAMES),
+                                 [name](const pair<const char *, int> &limit) { return name == limit.first; });
+            rlim_t amount;
+            if (known == end(LIMIT_NAMES) || equals == string_view::npos || !parseLimit(value.substr(equals + 1), amount))
+            {
+                throw ShellError("place: bad limit " + string(value));
+            }
+            placement.limits.push_back({known->second, amount});
+            break;
+        }
+        }
+    }
+
+    if (i == tokens.size())
+    {
+        throw ShellError("place: missing command");
+    }
+    tokens = TokenList(tokens.begin() + i, tokens.size() - i);
+
+    // Without -c the stages share the CPUs the shell may use
+    if (cpusGiven || placement.mode != PlacementMode::None)
+    {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+        {
+            errno = 0;
+            throw ShellError("place: cannot read the shell's CPU affinity");
+        }
+        if (!cpusGiven)
+        {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            {
+                if (CPU_ISSET(cpu, &allowed))
+                    placement.cpus.push_back(cpu);
+            }
+        }
+        placement.cpus.erase(remove_if(placement.cpus.begin(), placement.cpus.end(),
+                                       [&allowed](int cpu) { return !CPU_ISSET(cpu, &allowed); }),
+                             placement.cpus.end());
+        if (placement.cpus.empty())
+        {
+            throw ShellError("place: none of the CPUs can be used");
+        }
+        if (placement.mode == PlacementMode::None)
+        {
+            placement.mode = PlacementMode::Set;
+        }
+        if (placement.mode == PlacementMode::Siblings)
+        {
+            placement.cpus = siblingOrder(placement.cpus);
+        }
+    }
+}
+
+// Function to apply a placement to the calling process, which runs stage 'stage' of its
+// pipeline. Called in the forked child before the exec, throws a ShellError on failure.
+void applyPlacement(const Placement &placement, int stage)
+{
+    if (placement.mode != PlacementMode::None)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (placement.mode == PlacementMode::Set)
+        {
+            for (int cpu : placement.cpus)
+            {
+                CPU_SET(cpu, &set);
+            }
+        }
+        else
+        {
+            // One CPU per stage, wrapping around when there are more stages than CPUs
+            CPU_SET(placement.cpus[stage % placement.cpus.size()], &set);
+        }
+        if (sched_setaffinity(0, sizeof(set), &set) == -1)
+        {
+            throw ShellError("place: cannot set CPU affinity");
+        }
+    }
+
+    if (placement.setNice && setpriority(PRIO_PROCESS, 0, placement.nice) == -1)
+    {
+        throw ShellError("place: cannot set nice value " + to_string(placement.nice));
+    }
+
+    if (placement.ioClass != -1)
+    {
+        int priority = placement.ioClass << IOPRIO_CLASS_SHIFT | placement.ioLevel;
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, priority) == -1)
+        {
+            throw ShellError("place: cannot set I/O priority");
+        }
+    }
+
+    for (const auto &limit : placement.limits)
+    {
+        struct rlimit value = {limit.second, limit.second};
+        if (setrlimit(limit.first, &value) == -1)
+        {
+            throw ShellError("place: cannot set resource limit");
+        }
+    }
+}
@@ -0,0 +1,236 @@
+#include "mish.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+using namespace std;
+
+// Size of a read from a pipe or terminal
+static const size_t READ_BLOCK = 1 << 20;
+
+// Consumed parts of a mapping are dropped in steps of this size, so a long script does not
+// keep every page it has already run resident
+static const size_t RELEASE_STEP = 8 << 20;
+
+// Close the file and drop the mapping
+LineReader::~LineReader()
+{
+    close();
+}
+
+// Function to release the current input
+void LineReader::close()
+{
+    if (mapping != nullptr && !loaded)
+    {
+        munmap(const_cast<char *>(mapping), mappingSize);
+    }
+    mapping = nullptr;
+    loaded.reset();
+    if (fd != -1 && ownsFd)
+    {
+        ::close(fd);
+    }
+    fd = -1;
+    ownsFd = false;
+    mapped = false;
+    mappingSize = position = released = 0;
+    start = end = 0;
+    atEnd = false;
+}
+
+// Function to open a file. Regular files only the user can write are mapped, anything else is
+// read in blocks.
+bool LineReader::open(const string &path)
+{
+    close();
+    int file = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file == -1)
+        return false;
+
+    // Reading a mapped page that a truncation removed raises SIGBUS, so files someone else can
+    // change under the shell are not mapped
+    struct stat st;
+    if (fstat(file, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == geteuid() &&
+        (st.st_mode & (S_IWGRP | S_IWOTH)) == 0)
+    {
+        mapped = true;
+        mappingSize = static_cast<size_t>(st.st_size);
+        if (mappingSize > 0)
+        {
+            void *memory = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, file, 0);
+            if (memory == MAP_FAILED)
+            {
+                ::close(file);
+                mapped = false;
+                mappingSize = 0;
+                return false;
+            }
+            madvise(memory, mappingSize, MADV_SEQUENTIAL);
+            mapping = static_cast<const char *>(memory);
+        }
+        ::close(file);
+        return true;
+    }
+
+    fd = file;
+    ownsFd = true;
+    return true;
+}
+
+// Function to read a whole file into memory, for callers that need all of it at once but must
+// not map it. A file truncated meanwhile just yields what was there.
+bool LineReader::load(const string &path)
+{
+    close();
+    int file = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file == -1)
+        return false;
+
+    struct stat st;
+    if (fstat(file, &st) == -1)
+    {
+        ::close(file);
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    loaded.reset(new char[max<size_t>(size, 1)]);
+    size_t have = 0;
+    while (have < size)
+    {
+        ssize_t count = pread(file, loaded.get() + have, size - have, have);
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            break;
+        have += count;
+    }
+    ::close(file);
+    errno = 0;
+
+    mapped = true;
+    mapping = loaded.get();
+    mappingSize = have;
+    return true;
+}
+
+// Function to read from a descriptor the caller keeps open (stdin)
+void LineReader::attach(int descriptor)
+{
+    close();
+    fd = descriptor;
+    ownsFd = false;
+}
+
+// Function to get the next line without its newline. The view stays valid until the next call.
+bool LineReader::next(string_view &line)
+{
+    return mapped ? nextMapped(line) : nextBuffered(line);
+}
+
+// Function to cut the next line out of the mapping
+bool LineReader::nextMapped(string_view &line)
+{
+    if (position >= mappingSize)
+        return false;
+
+    // Lines handed out earlier are no longer in use, give their pages back
+    static const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t consumed = position / page * page;
+    if (!loaded && consumed - released >= RELEASE_STEP)
+    {
+        madvise(const_cast<char *>(mapping) + released, consumed - released, MADV_DONTNEED);
+        released = consumed;
+    }
+
+    const char *begin = mapping + position;
+    const char *newline = static_cast<const char *>(memchr(begin, '\n', mappingSize - position));
+    size_t length = newline != nullptr ? newline - begin : mappingSize - position;
+    line = string_view(begin, length);
+    position += length + 1;
+    return true;
+}
+
+// Function to cut the next line out of the block buffer, reading more input as needed
+bool LineReader::nextBuffered(string_view &line)
+{
+    if (!buffer)
+    {
+        buffer.reset(new char[READ_BLOCK]);
+        bufferSize = READ_BLOCK;
+    }
+
+    size_t scanned = start; // Bytes before this offset hold no newline
+    while (true)
+    {
+        const char *newline = static_cast<const char *>(memchr(buffer.get() + scanned, '\n', end - scanned));
+        if (newline != nullptr)
+        {
+            size_t length = newline - (buffer.get() + start);
+            line = string_view(buffer.get() + start, length);
+            start += length + 1;
+            return true;
+        }
+        scanned = end;
+
+        if (atEnd || fd == -1)
+        {
+            // The last line may lack its newline
+            if (start == end)
+                return false;
+            line = string_view(buffer.get() + start, end - start);
+            start = end;
+            return true;
+        }
+
+        // Move the partial line to the front, growing the buffer only for lines longer than it
+        if (start > 0)
+        {
+            memmove(buffer.get(), buffer.get() + start, end - start);
+            scanned -= start;
+            end -= start;
+            start = 0;
+        }
+        if (end == bufferSize)
+        {
+            unique_ptr<char[]> larger(new char[bufferSize * 2]);
+            memcpy(larger.get(), buffer.get(), end);
+            buffer = move(larger);
+            bufferSize *= 2;
+        }
+
+        ssize_t count = read(fd, buffer.get() + end, bufferSize - end);
+        if (count == -1 && errno == EINTR)
+        {
+            errno = 0;
+            continue;
+        }
+        if (count <= 0)
+        {
+            atEnd = true;
+            errno = 0;
+            continue;
+        }
+        end += count;
+    }
+}
+
+// Function to check whether a complete line is buffered, so reading it will not block
+bool LineReader::lineReady() const
+{
+    if (mapped)
+        return true;
+    if (!buffer)
+        return false;
+    return memchr(buffer.get() + start, '\n', end - start) != nullptr;
+}
+
+// Function to get the whole file when it is mapped or loaded, empty otherwise
+string_view LineReader::contents() const
+{
+    return mapping != nullptr ? string_view(mapping, mappingSize) : string_view();
+}
+
+// Function to check whether the whole file is in memory, mapped or loaded
+bool LineReader::isWhole() const
+{
+    return mapped;
+}
@@ -0,0 +1,145 @@
+#include "mish.h"
+#include <sys/mman.h>
+#include <thread>
+using namespace std;
+
+// Global background job scheduler
+Scheduler scheduler;
+
+// Set the concurrency limit (0 disables the scheduler) and whether output keeps submission order
+void Scheduler::configure(int jobLimit, bool keepOrder)
+{
+    limit = jobLimit;
+    ordered = keepOrder;
+}
+
+// Check whether background pipelines go through the scheduler
+bool Scheduler::active() const
+{
+    return limit > 0 || blockDepth > 0;
+}
+
+// Concurrency limit in effect, defaulting to the number of cores inside a parallel block
+int Scheduler::effectiveLimit() const
+{
+    if (limit > 0)
+    {
+        return limit;
+    }
+    unsigned cores = thread::hardware_concurrency();
+    return cores > 0 ? static_cast<int>(cores) : 1;
+}
+
+// Wait for a free slot before a background pipeline starts. In ordered mode, returns a
+// memfd that should receive the pipeline's stdout, or -1 to leave stdout alone.
+int Scheduler::acquire(const Command &last)
+{
+    jobs.update();
+    while (jobs.countActive() >= effectiveLimit())
+    {
+        supervisor.waitForChild();
+        jobs.update();
+        flush();
+    }
+
+    if (!ordered || last.redirectOutputToFile())
+    {
+        return -1;
+    }
+
+    int fd = memfd_create("mish-job-output", MFD_CLOEXEC);
+    if (fd == -1)
+    {
+        errno = 0; // Output is written directly when it cannot be captured
+    }
+    return fd;
+}
+
+// Remember a started job so its captured output can be written in submission order
+void Scheduler::submitted(long serial, int outputFd)
+{
+    if (ordered)
+    {
+        queue.push_back({serial, outputFd});
+    }
+    else if (outputFd != -1)
+    {
+        close(outputFd);
+    }
+}
+
+// Function to copy a captured output file to the shell's stdout
+void copyToStdout(int fd)
+{
+    cout << flush;
+    lseek(fd, 0, SEEK_SET);
+
+    char buffer[65536];
+    ssize_t count;
+    while ((count = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        ssize_t written = 0;
+        while (written < count)
+        {
+            ssize_t result = write(STDOUT_FILENO, buffer + written, count - written);
+            if (result == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                errno = 0;
+                return;
+            }
+            written += result;
+        }
+    }
+}
+
+// Write out the captured output of finished jobs at the head of the queue
+void Scheduler::flush()
+{
+    while (!queue.empty() && jobs.isFinished(queue.front().serial))
+    {
+        if (queue.front().outputFd != -1)
+        {
+            copyToStdout(queue.front().outputFd);
+            close(queue.front().outputFd);
+        }
+        queue.pop_front();
+    }
+}
+
+// Barrier: wait until every background job has finished, then write all pending output
+void Scheduler::barrier()
+{
+    jobs.update();
+    while (jobs.countActive() > 0)
+    {
+        supervisor.waitForChild();
+        jobs.update();
+        flush();
+    }
+    flush();
+}
+
+// Enter a 'parallel {' block, every line inside runs as a background job
+void Scheduler::beginBlock()
+{
+    blockDepth++;
+}
+
+// Leave a parallel block with an implicit barrier
+void Scheduler::endBlock()
+{
+    if (blockDepth == 0)
+    {
+        throw ShellError("Unexpected '}' outside a parallel block");
+    }
+    blockDepth--;
+    barrier();
+}
+
+// Check whether lines are currently collected by a parallel block
+bool Scheduler::inBlock() const
+{
+    return blockDepth > 0;
+}
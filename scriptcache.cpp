@@ -0,0 +1,1019 @@
+#include "mish.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstdlib> // For realpath
+using namespace std;
+
+namespace
+{
+    // Version of the compiled format, bump whenever the layout or the meaning of an instruction changes
+    const uint32_t SCRIPT_CACHE_VERSION = 6;
+    const char SCRIPT_CACHE_MAGIC[8] = {'M', 'I', 'S', 'H', 'S', 'C', 'R', '\0'};
+    const uint32_t NO_STRING = UINT32_MAX; // String offset of an absent redirection target
+
+    // Start of a compiled script. All fields are native-endian and every section is 8-byte
+    // aligned, so the file is used in place once it is mapped.
+    struct FileHeader
+    {
+        char magic[8];            // SCRIPT_CACHE_MAGIC
+        uint32_t version;         // SCRIPT_CACHE_VERSION
+        uint32_t headerSize;      // sizeof(FileHeader), catches layout differences between builds
+        uint64_t fileSize;        // Size of the whole compiled file
+        uint64_t sourceSize;      // Size of the script when it was compiled
+        int64_t mtimeSec;         // Modification time of the script when it was compiled
+        int64_t mtimeNsec;
+        uint64_t contentHash;     // hashBytes() of the script's contents
+        uint32_t pathOffset;      // Absolute path of the script in the string table
+        uint32_t pathLength;
+        uint64_t instructionCount;
+        uint64_t commandCount;
+        uint64_t wordCount;
+        uint64_t loopCount;
+        uint64_t stringBytes;     // Size of the string table, every string is NUL-terminated
+        uint64_t instructionOffset; // Section offsets from the start of the file
+        uint64_t commandOffset;
+        uint64_t wordOffset;
+        uint64_t loopOffset;
+        uint64_t stringOffset;
+    };
+
+    // One parsed command
+    struct FileCommand
+    {
+        uint32_t firstWord;
+        uint32_t wordCount;
+        uint32_t output;       // String offset of the output file, NO_STRING if none
+        uint32_t outputLength;
+        uint32_t input;        // String offset of the input file, NO_STRING if none
+        uint32_t inputLength;
+        uint32_t flags;        // CommandFlag bits
+        uint32_t pipeSize;     // Buffer of the pipe to the next command, 0 for the default
+    };
+
+    // One command word or loop item in the string table
+    struct FileWord
+    {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    // One 'for' loop
+    struct FileLoop
+    {
+        uint32_t variable;       // String offset of the variable name
+        uint32_t variableLength;
+        uint32_t firstWord;      // Items of a word list
+        uint32_t wordCount;
+        int64_t first;           // Bounds of a {first..last} range
+        int64_t last;
+        uint32_t range;          // 1 for a range, 0 for a word list
+        uint32_t reserved;
+    };
+}
+
+// Compiler state: the sections built so far and the control statements still open
+struct ScriptCompiler::State
+{
+    // An open 'for', 'while', 'until' or 'if' statement
+    struct Statement
+    {
+        string_view keyword;  // 'for', 'while', 'until' or 'if'
+        uint32_t line;        // Line the statement starts on
+        size_t start;         // First instruction of the statement
+        size_t top;           // Target of 'continue': the loop test
+        bool awaitingBody;    // Still in the condition, before 'do' or 'then'
+        bool negated;         // The body runs while the test fails ('until', '!')
+        bool sawElse;
+        size_t falseJump;     // Jump of an 'if' test to the next branch, NO_JUMP if none
+        vector<size_t> exits; // Jumps to the end of the statement, patched when it closes
+    };
+    static const size_t NO_JUMP = SIZE_MAX;
+
+    vector<ScriptInstruction> code;
+    vector<FileCommand> commands;
+    vector<FileWord> words;
+    vector<FileLoop> loops;
+    string strings;
+    vector<Statement> open;
+    CommandLine line;    // Line being compiled
+    CommandLine segment; // Statement of the line between ';' separators
+    uint32_t lineNumber = 0;
+
+    uint32_t addString(string_view text);
+    void emit(uint32_t op, uint32_t a = 0, uint32_t b = 0);
+    void patch(size_t at, size_t target);
+    void error(const string &message);
+    void compileLine(string_view text);
+    void compileSegment(const string_view *tokens, size_t count);
+    void compileStatement(const string_view *tokens, size_t count, bool tested);
+    void compileCommands(CommandLine &parsed, bool tested);
+    void compileFor(const string_view *tokens, size_t count);
+    void beginBody();
+    Statement *innermostLoop();
+};
+
+// Function to add a NUL-terminated string to the string table
+uint32_t ScriptCompiler::State::addString(string_view text)
+{
+    uint32_t offset = static_cast<uint32_t>(strings.size());
+    strings.append(text.data(), text.size());
+    strings += '\0';
+    return offset;
+}
+
+// Function to append an instruction for the current line
+void ScriptCompiler::State::emit(uint32_t op, uint32_t a, uint32_t b)
+{
+    code.push_back({op, lineNumber, a, b});
+}
+
+// Function to point a forward jump at 'target'
+void ScriptCompiler::State::patch(size_t at, size_t target)
+{
+    if (code[at].op == OP_FOR_NEXT)
+        code[at].b = static_cast<uint32_t>(target);
+    else
+        code[at].a = static_cast<uint32_t>(target);
+}
+
+// Function to compile an error that is reported when execution reaches it
+void ScriptCompiler::State::error(const string &message)
+{
+    emit(OP_ERROR, addString(message), static_cast<uint32_t>(message.size()));
+}
+
+// Function to add parsed commands to the command table and run them with OP_RUN
+void ScriptCompiler::State::compileCommands(CommandLine &parsed, bool tested)
+{
+    if (parsed.commands.empty())
+        return;
+
+    emit(OP_RUN, static_cast<uint32_t>(commands.size()), static_cast<uint32_t>(parsed.commands.size()));
+    for (const auto &cmd : parsed.commands)
+    {
+        FileCommand compiled = {static_cast<uint32_t>(words.size()), static_cast<uint32_t>(cmd.tokens.size()),
+                                NO_STRING, 0, NO_STRING, 0, static_cast<uint32_t>(cmd.flags | (tested ? CMD_TESTED : 0)),
+                                cmd.pipeSize};
+        for (const auto &word : cmd.tokens)
+        {
+            words.push_back({addString(word), static_cast<uint32_t>(word.size())});
+        }
+        if (cmd.redirectOutputToFile())
+        {
+            compiled.output = addString(cmd.redirectOutputFileName);
+            compiled.outputLength = static_cast<uint32_t>(cmd.redirectOutputFileName.size());
+        }
+        if (cmd.redirectedInputFromFile())
+        {
+            compiled.input = addString(cmd.redirectedInputFileName);
+            compiled.inputLength = static_cast<uint32_t>(cmd.redirectedInputFileName.size());
+        }
+        commands.push_back(compiled);
+    }
+}
+
+// Function to compile the commands of one statement. A statement that does not parse becomes an
+// error at its place, so it is reported each time it is reached.
+void ScriptCompiler::State::compileStatement(const string_view *tokens, size_t count, bool tested)
+{
+    if (count == 0)
+        return;
+
+    segment.tokens.assign(tokens, tokens + count);
+    segment.expansions = line.expansions;
+    try
+    {
+        parseTokens(segment, false);
+    }
+    catch (const ShellError &e)
+    {
+        error(e.what());
+        return;
+    }
+    compileCommands(segment, tested);
+}
+
+// Function to get the innermost open loop, nullptr outside loops
+ScriptCompiler::State::Statement *ScriptCompiler::State::innermostLoop()
+{
+    for (auto it = open.rbegin(); it != open.rend(); ++it)
+    {
+        if (it->keyword != "if")
+            return &*it;
+    }
+    return nullptr;
+}
+
+// Function to check that a word is a variable name
+static bool isVariableName(string_view word)
+{
+    if (word.empty() || isdigit(static_cast<unsigned char>(word[0])))
+        return false;
+    for (char c : word)
+    {
+        if (!isalnum(static_cast<unsigned char>(c)) && c != '_')
+            return false;
+    }
+    return true;
+}
+
+// Function to read a {first..last} range word
+static bool parseRange(string_view word, int64_t &first, int64_t &last)
+{
+    if (word.size() < 6 || word.front() != '{' || word.back() != '}')
+        return false;
+    size_t dots = word.find("..");
+    if (dots == string_view::npos)
+        return false;
+
+    string bounds(word.substr(1, word.size() - 2));
+    dots--;
+    char *end;
+    errno = 0;
+    first = strtoll(bounds.c_str(), &end, 10);
+    if (end != bounds.c_str() + dots || end == bounds.c_str())
+        return false;
+    const char *second = bounds.c_str() + dots + 2;
+    last = strtoll(second, &end, 10);
+    bool valid = *end == '\0' && end != second && errno == 0;
+    errno = 0;
+    return valid;
+}
+
+// Function to compile 'for NAME in WORDS...'. A single {first..last} word is counted in place
+// instead of being expanded into its items.
+void ScriptCompiler::State::compileFor(const string_view *tokens, size_t count)
+{
+    FileLoop loop = {0, 0, static_cast<uint32_t>(words.size()), 0, 0, 0, 0, 0};
+    if (count < 2 || !isVariableName(tokens[0]) || tokens[1] != "in")
+    {
+        // Still opens a loop, with no items, so its 'do' and 'done' match up
+        error("Expected 'for NAME in WORDS'");
+        loop.variable = addString("");
+    }
+    else
+    {
+        loop.variable = addString(tokens[0]);
+        loop.variableLength = static_cast<uint32_t>(tokens[0].size());
+        if (count == 3 && parseRange(tokens[2], loop.first, loop.last))
+        {
+            loop.range = 1;
+        }
+        else
+        {
+            for (size_t i = 2; i < count; i++)
+            {
+                words.push_back({addString(tokens[i]), static_cast<uint32_t>(tokens[i].size())});
+            }
+            loop.wordCount = static_cast<uint32_t>(count - 2);
+        }
+    }
+
+    uint32_t index = static_cast<uint32_t>(loops.size());
+    loops.push_back(loop);
+    open.push_back({"for", lineNumber, code.size(), 0, true, false, false, NO_JUMP, {}});
+    emit(OP_FOR_INIT, index);
+    open.back().top = code.size();
+    open.back().exits.push_back(code.size());
+    emit(OP_FOR_NEXT, index);
+}
+
+// Function to end the condition of the innermost statement at 'do' or 'then'
+void ScriptCompiler::State::beginBody()
+{
+    Statement &statement = open.back();
+    statement.awaitingBody = false;
+    if (statement.keyword == "for")
+        return;
+
+    size_t jump = code.size();
+    emit(statement.negated ? OP_JUMP_IF_PASSED : OP_JUMP_IF_FAILED);
+    if (statement.keyword == "if")
+        statement.falseJump = jump;
+    else
+        statement.exits.push_back(jump);
+}
+
+// Function to compile one statement of a line, up to the next ';'
+void ScriptCompiler::State::compileSegment(const string_view *tokens, size_t count)
+{
+    if (count == 0)
+        return;
+
+    string_view word = tokens[0];
+    Statement *statement = open.empty() ? nullptr : &open.back();
+
+    // Between 'while', 'until' or 'if' and 'do' or 'then' statements are the condition
+    if (statement != nullptr && statement->awaitingBody)
+    {
+        if (word == (statement->keyword == "if" ? "then" : "do"))
+        {
+            beginBody();
+            compileSegment(tokens + 1, count - 1);
+        }
+        else if (statement->keyword == "for")
+        {
+            error("Expected 'do'");
+        }
+        else
+        {
+            bool bang = word == "!";
+            statement->negated = (statement->keyword == "until") != bang;
+            compileStatement(tokens + bang, count - bang, true);
+        }
+        return;
+    }
+
+    if (word == "for")
+    {
+        compileFor(tokens + 1, count - 1);
+    }
+    else if (word == "while" || word == "until" || word == "if")
+    {
+        open.push_back({word == "while" ? "while" : word == "until" ? "until" : "if", lineNumber, code.size(),
+                        code.size(), true, false, false, NO_JUMP, {}});
+        compileSegment(tokens + 1, count - 1);
+    }
+    else if (word == "elif" || word == "else")
+    {
+        if (statement == nullptr || statement->keyword != "if" || statement->sawElse)
+        {
+            error("Unexpected '" + string(word) + "'");
+            return;
+        }
+        statement->exits.push_back(code.size());
+        emit(OP_JUMP);
+        patch(statement->falseJump, code.size());
+        statement->falseJump = NO_JUMP;
+        statement->sawElse = word == "else";
+        statement->awaitingBody = word == "elif";
+        statement->negated = false;
+        compileSegment(tokens + 1, count - 1);
+    }
+    else if (word == "fi" || word == "done")
+    {
+        bool closesIf = statement != nullptr && statement->keyword == "if";
+        if (statement == nullptr || closesIf != (word == "fi") || count > 1)
+        {
+            error("Unexpected '" + string(word) + "'");
+            return;
+        }
+        if (word == "done")
+        {
+            emit(OP_JUMP, static_cast<uint32_t>(statement->top));
+        }
+        else if (statement->falseJump != NO_JUMP)
+        {
+            patch(statement->falseJump, code.size());
+        }
+        for (size_t jump : statement->exits)
+        {
+            patch(jump, code.size());
+        }
+        open.pop_back();
+    }
+    else if (word == "break" || word == "continue")
+    {
+        Statement *loop = innermostLoop();
+        if (loop == nullptr || count > 1)
+        {
+            error("Unexpected '" + string(word) + "'");
+            return;
+        }
+        if (word == "break")
+            loop->exits.push_back(code.size());
+        emit(OP_JUMP, word == "continue" ? static_cast<uint32_t>(loop->top) : 0);
+    }
+    else if (word == "do" || word == "then")
+    {
+        error("Unexpected '" + string(word) + "'");
+    }
+    else
+    {
+        compileStatement(tokens, count, false);
+    }
+}
+
+// Function to compile one script line. Lines that do not tokenize or parse are kept as text,
+// so running them reports the same error at the same point as an uncompiled run.
+void ScriptCompiler::State::compileLine(string_view text)
+{
+    if (text.empty() || text[0] == '#')
+        return;
+
+    try
+    {
+        tokenize(text, line);
+    }
+    catch (const ShellError &)
+    {
+        emit(OP_SOURCE, addString(text), static_cast<uint32_t>(text.size()));
+        return;
+    }
+    if (line.tokens.empty())
+        return;
+
+    // Lines holding control keywords are compiled statement by statement
+    if (startsStatement(line.tokens) || (!open.empty() && open.back().awaitingBody))
+    {
+        size_t first = 0;
+        for (size_t i = 0; i <= line.tokens.size(); i++)
+        {
+            if (i == line.tokens.size() || line.tokens[i] == ";")
+            {
+                compileSegment(line.tokens.data() + first, i - first);
+                first = i + 1;
+            }
+        }
+        return;
+    }
+
+    if (isBlockStart(line.tokens) || isBlockEnd(line.tokens))
+    {
+        emit(isBlockStart(line.tokens) ? OP_BLOCK_BEGIN : OP_BLOCK_END);
+        return;
+    }
+
+    try
+    {
+        parseTokens(line, false);
+    }
+    catch (const ShellError &)
+    {
+        emit(OP_SOURCE, addString(text), static_cast<uint32_t>(text.size()));
+        return;
+    }
+    compileCommands(line, false);
+}
+
+// Start with an empty script
+ScriptCompiler::ScriptCompiler() : state(new State)
+{
+}
+
+ScriptCompiler::~ScriptCompiler() = default;
+
+// Function to compile the next line of the script
+void ScriptCompiler::addLine(string_view text, uint32_t number)
+{
+    state->lineNumber = number;
+    state->compileLine(text);
+}
+
+// Function to check whether a control statement is still waiting for its end
+bool ScriptCompiler::inStatement() const
+{
+    return !state->open.empty();
+}
+
+// Function to end the script. An unterminated statement is dropped and replaced by an error,
+// so none of it runs, the same as a script read one statement at a time.
+void ScriptCompiler::finish()
+{
+    if (state->open.empty())
+        return;
+
+    const State::Statement &outer = state->open.front();
+    string_view closer = outer.keyword == "if" ? "fi" : "done";
+    state->code.resize(outer.start);
+    state->lineNumber = outer.line;
+    state->error("'" + string(outer.keyword) + "' without '" + string(closer) + "'");
+    state->open.clear();
+}
+
+// Function to check whether anything was compiled
+bool ScriptCompiler::empty() const
+{
+    return state->code.empty();
+}
+
+// Function to forget everything compiled so far, keeping the buffers
+void ScriptCompiler::clear()
+{
+    state->code.clear();
+    state->commands.clear();
+    state->words.clear();
+    state->loops.clear();
+    state->strings.clear();
+    state->open.clear();
+}
+
+// Function to round a section offset up to 8 bytes
+static size_t align8(size_t offset)
+{
+    return (offset + 7) & ~static_cast<size_t>(7);
+}
+
+// Function to lay out the compiled sections as an image 'script' can run. 'path' names the
+// script in the image, for cache entries.
+bool ScriptCompiler::build(CompiledScript &script, const string &path) const
+{
+    const State &s = *state;
+
+    // Offsets are 32-bit, larger scripts run uncached
+    if (s.strings.size() + path.size() >= NO_STRING || s.words.size() >= NO_STRING ||
+        s.commands.size() >= NO_STRING || s.code.size() >= NO_STRING || s.loops.size() >= NO_STRING)
+        return false;
+
+    FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCRIPT_CACHE_MAGIC, sizeof(header.magic));
+    header.version = SCRIPT_CACHE_VERSION;
+    header.headerSize = sizeof(FileHeader);
+    header.pathOffset = static_cast<uint32_t>(s.strings.size());
+    header.pathLength = static_cast<uint32_t>(path.size());
+    header.instructionCount = s.code.size();
+    header.commandCount = s.commands.size();
+    header.wordCount = s.words.size();
+    header.loopCount = s.loops.size();
+    header.stringBytes = s.strings.size() + path.size() + 1;
+    header.instructionOffset = align8(sizeof(FileHeader));
+    header.commandOffset = align8(header.instructionOffset + s.code.size() * sizeof(ScriptInstruction));
+    header.wordOffset = align8(header.commandOffset + s.commands.size() * sizeof(FileCommand));
+    header.loopOffset = align8(header.wordOffset + s.words.size() * sizeof(FileWord));
+    header.stringOffset = align8(header.loopOffset + s.loops.size() * sizeof(FileLoop));
+    header.fileSize = header.stringOffset + header.stringBytes;
+
+    vector<char> &image = script.owned;
+    image.assign(header.fileSize, 0);
+    memcpy(image.data(), &header, sizeof(header));
+    if (!s.code.empty())
+        memcpy(image.data() + header.instructionOffset, s.code.data(), s.code.size() * sizeof(ScriptInstruction));
+    if (!s.commands.empty())
+        memcpy(image.data() + header.commandOffset, s.commands.data(), s.commands.size() * sizeof(FileCommand));
+    if (!s.words.empty())
+        memcpy(image.data() + header.wordOffset, s.words.data(), s.words.size() * sizeof(FileWord));
+    if (!s.loops.empty())
+        memcpy(image.data() + header.loopOffset, s.loops.data(), s.loops.size() * sizeof(FileLoop));
+    memcpy(image.data() + header.stringOffset, s.strings.data(), s.strings.size());
+    memcpy(image.data() + header.stringOffset + header.pathOffset, path.data(), path.size());
+
+    script.image = image.data();
+    script.imageSize = image.size();
+    return true;
+}
+
+// Function to check for a line holding a control keyword: at its start or after a ';'
+bool startsStatement(const vector<string_view> &tokens)
+{
+    static const char *const keywords[] = {"for", "while", "until", "if", "then", "elif", "else",
+                                           "fi", "do", "done", "break", "continue"};
+    for (size_t i = 0; i < tokens.size(); i++)
+    {
+        if (i > 0 && tokens[i - 1] != ";")
+            continue;
+        for (const char *keyword : keywords)
+        {
+            if (tokens[i] == keyword)
+                return true;
+        }
+    }
+    return false;
+}
+
+// Function to hash a buffer 8 bytes at a time. Not cryptographic, it only has to notice that
+// a script changed when its size and modification time did not.
+uint64_t hashBytes(const char *data, size_t size)
+{
+    const uint64_t multiplier = 0x9E3779B97F4A7C15ull;
+    uint64_t hash = size * multiplier;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 29;
+    }
+    uint64_t tail = 0;
+    if (size > i)
+        memcpy(&tail, data + i, size - i);
+    hash = (hash ^ tail) * multiplier;
+    return hash ^ (hash >> 32);
+}
+
+// Function to check whether script caching is on (MISH_SCRIPT_CACHE=0 turns it off)
+bool scriptCacheEnabled()
+{
+    return env.get("MISH_SCRIPT_CACHE") != "0";
+}
+
+// Function to find the cache directory: MISH_CACHE_DIR, $XDG_CACHE_HOME/mish or ~/.cache/mish
+string cacheDirectory()
+{
+    string dir = env.get("MISH_CACHE_DIR");
+    if (!dir.empty())
+        return dir;
+    dir = env.get("XDG_CACHE_HOME");
+    if (!dir.empty())
+        return dir + "/mish";
+    dir = env.get("HOME");
+    if (!dir.empty())
+        return dir + "/.cache/mish";
+    return "";
+}
+
+// Function to get the cache file of a script, named after a hash of its absolute path
+static string cacheEntryPath(const string &scriptPath)
+{
+    string dir = cacheDirectory();
+    if (dir.empty())
+        return "";
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.mishc",
+             static_cast<unsigned long long>(hashBytes(scriptPath.data(), scriptPath.size())));
+    return dir + name;
+}
+
+// Function to create a directory and its missing parents
+bool makeDirectories(const string &dir)
+{
+    for (size_t pos = 1; pos <= dir.size(); pos++)
+    {
+        if (pos == dir.size() || dir[pos] == '/')
+        {
+            if (mkdir(dir.substr(0, pos).c_str(), 0700) == -1 && errno != EEXIST)
+            {
+                return false;
+            }
+        }
+    }
+    errno = 0;
+    return true;
+}
+
+// Function to store a cache file, such as a compiled image. It is written to a temporary file
+// and renamed into place, so concurrent runs never see a partial entry.
+bool writeCacheFile(const string &entryPath, const vector<char> &image)
+{
+    if (!makeDirectories(entryPath.substr(0, entryPath.rfind('/'))))
+        return false;
+
+    string temporary = entryPath + ".tmp." + to_string(getpid());
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return false;
+
+    size_t written = 0;
+    while (written < image.size())
+    {
+        ssize_t count = write(fd, image.data() + written, image.size() - written);
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count <= 0)
+        {
+            close(fd);
+            unlink(temporary.c_str());
+            return false;
+        }
+        written += count;
+    }
+    close(fd);
+
+    if (rename(temporary.c_str(), entryPath.c_str()) == -1)
+    {
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Function to get the header of a compiled image
+static const FileHeader &headerOf(const char *image)
+{
+    return *reinterpret_cast<const FileHeader *>(image);
+}
+
+// Function to check that an image is a complete compile of the script at 'scriptPath'
+static bool validImage(const char *image, size_t size, const string &scriptPath)
+{
+    if (size < sizeof(FileHeader))
+        return false;
+
+    const FileHeader &header = headerOf(image);
+    if (memcmp(header.magic, SCRIPT_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SCRIPT_CACHE_VERSION || header.headerSize != sizeof(FileHeader) ||
+        header.fileSize != size)
+        return false;
+
+    // Sections have to lie inside the file, in order
+    if (header.instructionOffset < sizeof(FileHeader) ||
+        header.instructionOffset + header.instructionCount * sizeof(ScriptInstruction) > header.commandOffset ||
+        header.commandOffset + header.commandCount * sizeof(FileCommand) > header.wordOffset ||
+        header.wordOffset + header.wordCount * sizeof(FileWord) > header.loopOffset ||
+        header.loopOffset + header.loopCount * sizeof(FileLoop) > header.stringOffset ||
+        header.stringOffset + header.stringBytes != size || header.stringBytes == 0 ||
+        (header.instructionOffset | header.commandOffset | header.wordOffset | header.loopOffset) % 8 != 0)
+        return false;
+
+    // Two scripts could share a cache file name, the stored path tells them apart
+    const char *strings = image + header.stringOffset;
+    return static_cast<uint64_t>(header.pathOffset) + header.pathLength < header.stringBytes &&
+           string_view(strings + header.pathOffset, header.pathLength) == scriptPath;
+}
+
+// Function to check that a valid image still matches its script. A changed modification time
+// with unchanged contents (a touch, a fresh checkout) refreshes the stored time in the entry.
+static bool currentImage(const char *image, const struct stat &st, const string &scriptPath,
+                         const string &entryPath)
+{
+    const FileHeader &header = headerOf(image);
+    if (header.sourceSize != static_cast<uint64_t>(st.st_size))
+        return false;
+    if (header.mtimeSec == st.st_mtim.tv_sec && header.mtimeNsec == st.st_mtim.tv_nsec)
+        return true;
+
+    LineReader source;
+    if (!source.open(scriptPath) || (!source.isWhole() && !source.load(scriptPath)) ||
+        hashBytes(source.contents().data(), source.contents().size()) != header.contentHash)
+        return false;
+
+    int fd = open(entryPath.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd != -1)
+    {
+        int64_t mtime[2] = {st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+        ssize_t ignored = pwrite(fd, mtime, sizeof(mtime), offsetof(FileHeader, mtimeSec));
+        (void)ignored;
+        close(fd);
+    }
+    errno = 0;
+    return true;
+}
+
+// Release the mapping
+CompiledScript::~CompiledScript()
+{
+    if (mapped)
+    {
+        munmap(const_cast<char *>(image), imageSize);
+    }
+}
+
+// Function to map the cache entry of a script if it is valid and current
+bool CompiledScript::mapEntry(const string &entryPath, const string &scriptPath, const struct stat &st)
+{
+    int fd = ::open(entryPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        errno = 0;
+        return false;
+    }
+
+    struct stat entry;
+    if (fstat(fd, &entry) == -1 || entry.st_size < static_cast<off_t>(sizeof(FileHeader)))
+    {
+        close(fd);
+        errno = 0;
+        return false;
+    }
+
+    void *memory = mmap(nullptr, entry.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED)
+    {
+        errno = 0;
+        return false;
+    }
+
+    const char *candidate = static_cast<const char *>(memory);
+    if (!validImage(candidate, entry.st_size, scriptPath) || !currentImage(candidate, st, scriptPath, entryPath))
+    {
+        munmap(memory, entry.st_size);
+        return false;
+    }
+
+    image = candidate;
+    imageSize = entry.st_size;
+    mapped = true;
+    return true;
+}
+
+// Function to compile a script and store the result in the cache. The compiled image is kept
+// in memory so the script can run even when the cache cannot be written.
+bool CompiledScript::compile(const string &entryPath, const string &scriptPath, const struct stat &st,
+                             bool &stored)
+{
+    LineReader source; // Files it will not map are read whole, the hash needs all of them
+    if (!source.open(scriptPath) || (!source.isWhole() && !source.load(scriptPath)))
+        return false;
+
+    uint64_t contentHash = hashBytes(source.contents().data(), source.contents().size());
+    ScriptCompiler compiler;
+    {
+        TraceSpan span("compileScript");
+        string_view text;
+        uint32_t lineNumber = 0;
+        while (source.next(text))
+        {
+            compiler.addLine(text, ++lineNumber);
+        }
+        compiler.finish();
+    }
+    if (!compiler.build(*this, scriptPath))
+        return false;
+
+    // Key the entry to the script it came from
+    FileHeader &header = *reinterpret_cast<FileHeader *>(owned.data());
+    header.sourceSize = static_cast<uint64_t>(st.st_size);
+    header.mtimeSec = st.st_mtim.tv_sec;
+    header.mtimeNsec = st.st_mtim.tv_nsec;
+    header.contentHash = contentHash;
+
+    stored = !entryPath.empty() && writeCacheFile(entryPath, owned);
+    errno = 0;
+    image = owned.data();
+    imageSize = owned.size();
+    return true;
+}
+
+// Function to get a script ready to run from its cache entry, compiling it when the entry is
+// missing or stale. Returns false if the script cannot be read.
+bool CompiledScript::open(const string &path)
+{
+    char resolved[PATH_MAX];
+    struct stat st;
+    if (realpath(path.c_str(), resolved) == nullptr || stat(resolved, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        errno = 0;
+        return false;
+    }
+
+    string entryPath = cacheEntryPath(resolved);
+    if (!entryPath.empty() && mapEntry(entryPath, resolved, st))
+        return true;
+
+    bool stored = false;
+    return compile(entryPath, resolved, st, stored);
+}
+
+// Function to compile a script into the cache ahead of time (mish --compile)
+bool precompileScript(const string &path)
+{
+    char resolved[PATH_MAX];
+    struct stat st;
+    if (realpath(path.c_str(), resolved) == nullptr || stat(resolved, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        handleError("Cannot open file " + path);
+        errno = 0;
+        return false;
+    }
+
+    string entryPath = cacheEntryPath(resolved);
+    if (entryPath.empty())
+    {
+        handleError("No cache directory, set MISH_CACHE_DIR or HOME");
+        return false;
+    }
+
+    CompiledScript script;
+    bool stored = false;
+    if (!script.compile(entryPath, resolved, st, stored))
+    {
+        handleError("Cannot compile " + path);
+        return false;
+    }
+    if (!stored)
+    {
+        handleError("Cannot write " + entryPath);
+        errno = 0;
+        return false;
+    }
+    return true;
+}
+
+// Function to get the number of instructions
+size_t CompiledScript::size() const
+{
+    return headerOf(image).instructionCount;
+}
+
+// Function to get one instruction, pc < size()
+const ScriptInstruction &CompiledScript::instruction(size_t pc) const
+{
+    return reinterpret_cast<const ScriptInstruction *>(image + headerOf(image).instructionOffset)[pc];
+}
+
+// Function to get a NUL-terminated string from the string table, checking it lies inside
+static string_view stringAt(const char *image, uint32_t offset, uint32_t length)
+{
+    const FileHeader &header = headerOf(image);
+    const char *strings = image + header.stringOffset;
+    if (static_cast<uint64_t>(offset) + length >= header.stringBytes || strings[offset + length] != '\0')
+    {
+        throw ShellError("Corrupt script cache entry");
+    }
+    return string_view(strings + offset, length);
+}
+
+// Function to get the text of OP_SOURCE or the message of OP_ERROR
+string_view CompiledScript::text(uint32_t offset, uint32_t length) const
+{
+    return stringAt(image, offset, length);
+}
+
+// Function to get the number of 'for' loops
+size_t CompiledScript::loops() const
+{
+    return headerOf(image).loopCount;
+}
+
+// Function to get the compiled loop at 'i'
+static const FileLoop &loopAt(const char *image, uint32_t i)
+{
+    const FileHeader &header = headerOf(image);
+    if (i >= header.loopCount)
+    {
+        throw ShellError("Corrupt script cache entry");
+    }
+    return reinterpret_cast<const FileLoop *>(image + header.loopOffset)[i];
+}
+
+// Function to describe loop i
+ScriptLoop CompiledScript::loop(uint32_t i) const
+{
+    const FileLoop &compiled = loopAt(image, i);
+    ScriptLoop loop;
+    loop.variable = stringAt(image, compiled.variable, compiled.variableLength);
+    loop.range = compiled.range != 0;
+    loop.first = compiled.first;
+    loop.last = compiled.last;
+    if (loop.range)
+    {
+        uint64_t span = loop.last >= loop.first ? static_cast<uint64_t>(loop.last) - static_cast<uint64_t>(loop.first)
+                                                : static_cast<uint64_t>(loop.first) - static_cast<uint64_t>(loop.last);
+        loop.count = span + 1;
+    }
+    else
+    {
+        loop.count = compiled.wordCount;
+    }
+    return loop;
+}
+
+// Function to get an item of a word list loop
+string_view CompiledScript::loopWord(uint32_t i, uint64_t item) const
+{
+    const FileHeader &header = headerOf(image);
+    const FileLoop &compiled = loopAt(image, i);
+    if (item >= compiled.wordCount || compiled.firstWord + item >= header.wordCount)
+    {
+        throw ShellError("Corrupt script cache entry");
+    }
+    const FileWord &word = reinterpret_cast<const FileWord *>(image + header.wordOffset)[compiled.firstWord + item];
+    return stringAt(image, word.offset, word.length);
+}
+
+// Function to rebuild the commands of an OP_RUN in 'line'. Words point into the image, nothing
+// is tokenized or parsed.
+void CompiledScript::load(uint32_t first, uint32_t count, CommandLine &line) const
+{
+    const FileHeader &header = headerOf(image);
+    if (static_cast<uint64_t>(first) + count > header.commandCount)
+    {
+        throw ShellError("Corrupt script cache entry");
+    }
+
+    const FileCommand *commands = reinterpret_cast<const FileCommand *>(image + header.commandOffset) + first;
+    const FileWord *words = reinterpret_cast<const FileWord *>(image + header.wordOffset);
+
+    line.tokens.clear();
+    line.words.clear();
+    line.commands.clear();
+
+    // Reserve every word first so the commands' pointers into line.words stay valid
+    size_t wordTotal = 0;
+    for (uint32_t c = 0; c < count; c++)
+    {
+        if (static_cast<uint64_t>(commands[c].firstWord) + commands[c].wordCount > header.wordCount)
+        {
+            throw ShellError("Corrupt script cache entry");
+        }
+        wordTotal += commands[c].wordCount;
+    }
+    line.words.reserve(wordTotal);
+
+    for (uint32_t c = 0; c < count; c++)
+    {
+        const FileCommand &compiled = commands[c];
+        Command cmd;
+        size_t first = line.words.size();
+        for (uint32_t w = 0; w < compiled.wordCount; w++)
+        {
+            const FileWord &word = words[compiled.firstWord + w];
+            line.words.push_back(stringAt(image, word.offset, word.length));
+        }
+        cmd.tokens = TokenList(line.words.data() + first, compiled.wordCount);
+        cmd.flags = static_cast<uint16_t>(compiled.flags);
+        cmd.pipeSize = compiled.pipeSize;
+        if (compiled.output != NO_STRING)
+        {
+            cmd.redirectOutputFileName = stringAt(image, compiled.output, compiled.outputLength);
+        }
+        if (compiled.input != NO_STRING)
+        {
+            cmd.redirectedInputFileName = stringAt(image, compiled.input, compiled.inputLength);
+        }
+        line.commands.push_back(cmd);
+    }
+}
@@ -0,0 +1,1198 @@
+#include "mish.h"
+#include <cstdlib> // For environ
+using namespace std;
+
+bool showPath = false;
+int lastStatus = 0;
+extern char **environ;
+
+// Function to get the token of a single-character operator
+static string_view operatorToken(char c)
+{
+    switch (c)
+    {
+    case '|':
+        return "|";
+    case '>':
+        return ">";
+    case '<':
+        return "<";
+    case '&':
+        return "&";
+    default:
+        return ";";
+    }
+}
+
+// Function to read the variable reference after a '$': NAME, {NAME}, ? or $. Returns how many
+// characters it spans, 0 if there is none and the '$' is literal.
+static size_t variableReference(string_view input, size_t i, string_view &name)
+{
+    // Function to get the length of the variable name at 'start'
+    auto nameLength = [&input](size_t start)
+    {
+        size_t end = start;
+        while (end < input.size() && (isalnum(static_cast<unsigned char>(input[end])) || input[end] == '_'))
+        {
+            end++;
+        }
+        return start < input.size() && isdigit(static_cast<unsigned char>(input[start])) ? 0 : end - start;
+    };
+
+    if (i >= input.size())
+        return 0;
+    if (input[i] == '?' || input[i] == '$')
+    {
+        name = input.substr(i - 1, 2); // Kept with its '$', apart from the ? pattern
+        return 1;
+    }
+    if (input[i] == '{')
+    {
+        size_t length = nameLength(i + 1);
+        if (length == 0 || i + 1 + length >= input.size() || input[i + 1 + length] != '}')
+            return 0;
+        name = input.substr(i + 1, length);
+        return length + 2;
+    }
+    size_t length = nameLength(i);
+    name = input.substr(i, length);
+    return length;
+}
+
+// Function to get the length of the pattern at input[i]: a run of '*', a '?' or a bracket
+// expression. A '[' without its ']' in the same word is 0, an ordinary character.
+static size_t patternLength(string_view input, size_t i)
+{
+    if (input[i] == '*')
+    {
+        size_t end = i;
+        while (end < input.size() && input[end] == '*')
+        {
+            end++;
+        }
+        return end - i;
+    }
+    if (input[i] == '?')
+        return 1;
+
+    size_t end = i + 1;
+    if (end < input.size() && (input[end] == '!' || input[end] == '^'))
+        end++;
+    if (end < input.size() && input[end] == ']')
+        end++;
+    for (; end < input.size(); end++)
+    {
+        char c = input[end];
+        if (c == ']')
+            return end - i + 1;
+        if (memchr("|<>&; \t\"\\$/", c, 11) != nullptr || c == VAR_MARK)
+            return 0;
+    }
+    return 0;
+}
+
+// Function to get the length of a pipe buffer size like [64K] at 'i', right after a '|'.
+// Returns 0 if there is none.
+static size_t pipeSizeLength(string_view input, size_t i)
+{
+    if (i >= input.size() || input[i] != '[')
+        return 0;
+    size_t end = i + 1;
+    while (end < input.size() && isdigit(static_cast<unsigned char>(input[end])))
+    {
+        end++;
+    }
+    if (end == i + 1)
+        return 0;
+    if (end < input.size() && strchr("kKmMgG", input[end]) != nullptr && input[end] != '\0')
+        end++;
+    return end < input.size() && input[end] == ']' ? end - i + 1 : 0;
+}
+
+// Function to split input string into tokens while handling quotes and escape characters.
+// Token text is written into the line's arena, each token followed by a NUL.
+void tokenize(string_view input, CommandLine &line)
+{
+    TraceSpan span("tokenize");
+    line.arena.reset();
+    line.tokens.clear();
+    line.expansions = false;
+
+    // An input character becomes at most three bytes of token text (* is VAR_MARK * VAR_MARK)
+    // or one NUL, so three times the input length is the worst case
+    char *out = line.arena.allocate(3 * input.length() + 1);
+    char *tokenStart = out; // Start of the token being built
+    bool in_quotes = false; // Track if we're inside quotes
+    bool escaped = false;   // Track if the next character is escaped
+
+    // Function to finish the current token if it has any characters
+    auto endToken = [&]()
+    {
+        if (out != tokenStart)
+        {
+            *out = '\0';
+            line.tokens.push_back(string_view(tokenStart, out - tokenStart));
+            tokenStart = ++out;
+        }
+    };
+
+    for (size_t i = 0; i < input.length(); i++)
+    {
+        // Copy the run of ordinary characters up to the next one that needs a decision
+        if (!escaped)
+        {
+            size_t run = scanPlain(input.data() + i, input.length() - i, in_quotes);
+            memcpy(out, input.data() + i, run);
+            out += run;
+            i += run;
+            if (i == input.length())
+                break;
+        }
+
+        char c = input[i];
+
+        // A VAR_MARK byte of the input is kept as an empty reference, which expands to itself
+        if (c == VAR_MARK)
+        {
+            *out++ = VAR_MARK;
+            *out++ = VAR_MARK;
+            line.expansions = true;
+            escaped = false;
+            continue;
+        }
+
+        if (escaped)
+        {
+            *out++ = c;
+            escaped = false;
+            continue;
+        }
+
+        if (c == '\\')
+        {
+            escaped = true;
+            continue;
+        }
+
+        if (c == '"' && !escaped)
+        {
+            in_quotes = !in_quotes;
+            continue;
+        }
+
+        // Variable references are marked in the token and expanded when the command runs
+        if (c == '$')
+        {
+            string_view name;
+            size_t length = variableReference(input, i + 1, name);
+            if (length > 0)
+            {
+                *out++ = VAR_MARK;
+                memcpy(out, name.data(), name.size());
+                out += name.size();
+                *out++ = VAR_MARK;
+                line.expansions = true;
+                i += length;
+                continue;
+            }
+        }
+
+        // Unquoted *, ? and [...] are patterns, matched against file names when the command runs
+        if (!in_quotes && (c == '*' || c == '?' || c == '['))
+        {
+            size_t length = patternLength(input, i);
+            if (length > 0)
+            {
+                *out++ = VAR_MARK;
+                memcpy(out, input.data() + i, length);
+                out += length;
+                *out++ = VAR_MARK;
+                line.expansions = true;
+                i += length - 1;
+                continue;
+            }
+        }
+
+        // Handle special characters when not in quotes
+        if (!in_quotes && (c == '|' || c == '>' || c == '<' || c == '&' || c == ';'))
+        {
+            endToken();
+            // Handle ">>" as a single token, operators point at static strings
+            size_t sized = c == '|' ? pipeSizeLength(input, i + 1) : 0;
+            if (c == '>' && i + 1 < input.length() && input[i + 1] == '>')
+            {
+                line.tokens.push_back(">>");
+                i++;
+            }
+            else if (c == '|' && i + 1 < input.length() && input[i + 1] == '>')
+            {
+                line.tokens.push_back("|>"); // Metered pipe
+                i++;
+            }
+            else if (sized > 0)
+            {
+                // A pipe with its buffer size, |[1M], is kept whole in the arena
+                memcpy(out, input.data() + i, sized + 1);
+                out += sized + 1;
+                endToken();
+                i += sized;
+            }
+            else
+            {
+                line.tokens.push_back(operatorToken(c));
+            }
+            continue;
+        }
+
+        // Handle whitespace
+        if (!in_quotes && (c == ' ' || c == '\t'))
+        {
+            endToken();
+            continue;
+        }
+
+        *out++ = c;
+    }
+
+    endToken();
+
+    if (in_quotes)
+    {
+        throw ShellError("Unterminated quote"); // Throw error
+    }
+}
+
+// Function to check whether a token is a pipe with a buffer size, |[64K]
+static bool isSizedPipe(string_view token)
+{
+    return token.size() > 3 && token[0] == '|' && token[1] == '[' && token.back() == ']';
+}
+
+// Function to validate parsed command structure, 'report' prints what is wrong
+bool validateCommand(const Command &cmd, bool report)
+{
+    TraceSpan span("validateCommand");
+
+    // Function to report a problem and reject the command
+    auto invalid = [report](const char *message)
+    {
+        if (report)
+        {
+            handleError(message);
+        }
+        return false;
+    };
+
+    // Check if output redirection and pipe start are both set
+    if (cmd.redirectOutputToFile() && cmd.isPipeStart())
+    {
+        return invalid("Cannot combine output redirection with pipe output");
+    }
+    // Check if input redirection and pipe end are both set
+    if (cmd.redirectedInputFromFile() && cmd.isPipeEnd())
+    {
+        return invalid("Cannot combine input redirection with pipe input");
+    }
+
+    // Check for invalid redirection combinations
+    if (cmd.redirectOutputToFile() && cmd.redirectOutputFileName.empty())
+    {
+        return invalid("Missing output file name");
+    }
+    if (cmd.redirectedInputFromFile() && cmd.redirectedInputFileName.empty())
+    {
+        return invalid("Missing input file name");
+    }
+
+    // Check if the command has no tokens
+    if (cmd.tokens.empty())
+    {
+        return invalid("Empty command");
+    }
+    return true;
+}
+
+// Function to parse tokens into commands with support for pipes, redirections, and background execution.
+// Commands are stored in line.commands, their tokens are runs of line.words. With 'report' off,
+// invalid commands only throw, without printing what is wrong.
+void parseTokens(CommandLine &line, bool report)
+{
+    TraceSpan span("parseTokens");
+    const vector<string_view> &tokens = line.tokens;
+    vector<string_view> &words = line.words;
+    vector<Command> &commands = line.commands;
+    words.clear();
+    commands.clear();
+
+    // Every word is a token, so reserving keeps the commands' pointers into 'words' valid
+    words.reserve(tokens.size());
+    Command currentCommand;  // Current command being built
+    size_t firstWord = 0;    // Index of the current command's first word
+
+    // Function to finish the current command and start the next one
+    auto endCommand = [&](uint16_t nextFlags)
+    {
+        currentCommand.tokens = TokenList(words.data() + firstWord, words.size() - firstWord);
+        commands.push_back(currentCommand);
+        currentCommand = Command();
+        currentCommand.flags = nextFlags;
+        firstWord = words.size();
+    };
+
+    for (size_t i = 0; i < tokens.size(); i++)
+    {
+        if (tokens[i] == "|" || tokens[i] == "|>" || isSizedPipe(tokens[i])) // Handle pipes
+        {
+            if (words.size() == firstWord)
+            {
+                throw ShellError("Invalid pipe: empty command");
+            }
+            if (tokens[i] == "|>")
+            {
+                currentCommand.flags |= CMD_METER;
+            }
+            else if (tokens[i].size() > 1)
+            {
+                currentCommand.pipeSize = static_cast<uint32_t>(parsePipeSize(tokens[i].substr(2, tokens[i].size() - 3)));
+            }
+            currentCommand.flags |= CMD_PIPE_START;
+            endCommand(CMD_PIPE_END);
+        }
+        else if (tokens[i] == "&") // Handle background execution
+        {
+            if (words.size() != firstWord)
+            {
+                currentCommand.flags |= CMD_BACKGROUND;
+                endCommand(0);
+            }
+
+            // Ensure all previous pipeline commands are marked as background
+            for (auto &cmd : commands)
+            {
+                cmd.flags |= CMD_BACKGROUND;
+            }
+        }
+        else if (tokens[i] == ">" || tokens[i] == ">>") // Handle output redirection
+        {
+            if (i + 1 >= tokens.size())
+            {
+                throw ShellError("Missing filename for redirection");
+            }
+            currentCommand.flags |= CMD_REDIRECT_OUT;
+            if (tokens[i] == ">>")
+            {
+                currentCommand.flags |= CMD_APPEND;
+            }
+            else
+            {
+                currentCommand.flags &= ~CMD_APPEND;
+            }
+            currentCommand.redirectOutputFileName = tokens[++i];
+        }
+        else if (tokens[i] == "<") // Handle input redirection
+        {
+            if (i + 1 >= tokens.size())
+            {
+                throw ShellError("Missing filename for input redirection");
+            }
+            currentCommand.flags |= CMD_REDIRECT_IN;
+            currentCommand.redirectedInputFileName = tokens[++i];
+        }
+        else if (tokens[i] == ";") // Handle command sequencing
+        {
+            if (words.size() != firstWord)
+            {
+                endCommand(0);
+            }
+        }
+        else // Regular command tokens
+        {
+            words.push_back(tokens[i]);
+        }
+    }
+
+    // For command left after loop
+    if (words.size() != firstWord)
+    {
+        endCommand(0);
+    }
+
+    // Commands with variable references are expanded when they run
+    if (line.expansions)
+    {
+        auto marked = [](string_view text) { return !text.empty() && memchr(text.data(), VAR_MARK, text.size()) != nullptr; };
+        for (auto &cmd : commands)
+        {
+            bool expands = marked(cmd.redirectOutputFileName) || marked(cmd.redirectedInputFileName);
+            for (const auto &word : cmd.tokens)
+            {
+                expands = expands || marked(word);
+            }
+            cmd.flags |= expands ? CMD_EXPAND : 0;
+        }
+    }
+
+    // Validate all commands
+    for (const auto &cmd : commands)
+    {
+        if (!validateCommand(cmd, report))
+        {
+            throw ShellError("Invalid command structure");
+        }
+    }
+}
+
+void setupRedirection(const Command &cmd)
+{
+    TraceSpan span("setupRedirection");
+    if (cmd.redirectedInputFromFile())
+    {
+        int fd = open(cmd.redirectedInputFileName.data(), O_RDONLY);
+        if (fd == -1)
+        {
+            throw ShellError("Error opening input file: " + string(cmd.redirectedInputFileName));
+        }
+        if (dup2(fd, STDIN_FILENO) == -1)
+        {
+            close(fd);
+            throw ShellError("Error setting up input redirection");
+        }
+        close(fd);
+    }
+
+    if (cmd.redirectOutputToFile())
+    {
+        // Set the flags for opening the output file
+        int flags = O_WRONLY | O_CREAT;
+        // Set append or truncate mode
+        flags |= cmd.appendOutput() ? O_APPEND : O_TRUNC;
+
+        int fd = open(cmd.redirectOutputFileName.data(), flags, 0644);
+        if (fd == -1)
+        {
+            throw ShellError("Error opening output file: " + string(cmd.redirectOutputFileName));
+        }
+        if (dup2(fd, STDOUT_FILENO) == -1)
+        {
+            close(fd);
+            throw ShellError("Error setting up output redirection");
+        }
+        close(fd);
+    }
+}
+
+// Function to execute a pipeline of 'n' commands
+void executePipeline(const Command *pipeline, int n, bool timed, const Placement *placement)
+{
+    TraceSpan span("executePipeline");
+    vector<pid_t> pids(n);              // Store process IDs
+    vector<double> startTimes(n);       // Spawn time of each stage
+    vector<array<int, 2>> pipes;        // Store pipe file descriptors
+    vector<size_t> writePipe(n, 0);     // Pipe each stage writes to
+    vector<size_t> readPipe(n, 0);      // Pipe each stage reads from
+    vector<ShellStage> shellStages;     // Stages and relays the shell runs itself
+    bool background = pipeline[n - 1].isBackground();
+
+    // Function to create a pipe sized by |[SIZE] or MISH_PIPESIZE, returns its index
+    size_t pipeSize = n > 1 ? defaultPipeSize() : 0;
+    auto openPipe = [&](const Command &cmd)
+    {
+        array<int, 2> p;
+        if (pipe(p.data()) == -1)
+        {
+            throw ShellError("Failed to create pipe");
+        }
+        pipes.push_back(p);
+        size_t size = cmd.pipeSize != 0 ? cmd.pipeSize : pipeSize;
+        if (size != 0)
+        {
+            resizePipe(p, size);
+        }
+        return pipes.size() - 1;
+    };
+
+    // Create pipes. A metered link (|> or MISH_PIPESTATS=1) in a foreground pipeline gets two,
+    // with a relay in the shell that counts what passes between them.
+    bool meterAll = n > 1 && !background && env.get("MISH_PIPESTATS") == "1";
+    pipes.reserve(2 * (n - 1));
+    for (int i = 0; i < n - 1; i++)
+    {
+        writePipe[i] = readPipe[i + 1] = openPipe(pipeline[i]);
+        if (!background && (meterAll || (pipeline[i].flags & CMD_METER)))
+        {
+            readPipe[i + 1] = openPipe(pipeline[i]);
+            ShellStage relay;
+            relay.kind = ShellStageKind::Relay;
+            relay.index = i;
+            shellStages.push_back(relay);
+        }
+    }
+
+    // Create processes
+    // Leading 'cat FILE', trailing 'cat > FILE' and 'tee FILE' in between are run by the shell
+    // with splice in a foreground pipeline, unless MISH_SPLICE=0 or the stages are placed
+    vector<bool> inShell(n, false);
+    if (!background && n > 1 && placement == nullptr && env.get("MISH_SPLICE") != "0")
+    {
+        for (int i = 0; i < n; i++)
+        {
+            ShellStageKind kind = shellStageKind(pipeline, i, n);
+            if (kind != ShellStageKind::None)
+            {
+                ShellStage stage;
+                stage.kind = kind;
+                stage.index = i;
+                shellStages.push_back(stage);
+                inShell[i] = true;
+            }
+        }
+    }
+
+    // Scheduled background jobs wait for a free slot and may have their output captured
+    int captureFd = -1;
+    if (background && scheduler.active())
+    {
+        captureFd = scheduler.acquire(pipeline[n - 1]);
+    }
+
+    pid_t pgid = 0; // Background pipelines share the process group of their first started stage
+    for (int i = 0; i < n; i++)
+    {
+        StageIO io;
+        io.inFd = i > 0 ? pipes[readPipe[i]][0] : -1;              // Input from the previous pipe
+        io.outFd = i < n - 1 ? pipes[writePipe[i]][1] : captureFd; // Output to the next pipe
+        io.pipes = &pipes;
+        io.pgid = background ? pgid : -1;
+        io.placement = placement;
+        io.stage = i;
+
+        startTimes[i] = monotonicNow();
+        if (inShell[i])
+        {
+            pids[i] = -1;
+            continue;
+        }
+        {
+            TraceSpan spawnSpan("spawn");
+            pids[i] = spawnCommand(pipeline[i], io);
+        }
+        if (background && pgid == 0 && pids[i] != -1)
+        {
+            pgid = pids[i];
+        }
+    }
+
+    // The shell's stages keep their pipe ends, every other end is closed. A relay reads what
+    // stage 'index' writes and writes what the next stage reads.
+    for (auto &stage : shellStages)
+    {
+        int i = stage.index;
+        bool relay = stage.kind == ShellStageKind::Relay;
+        if (relay || i > 0)
+        {
+            int &end = pipes[relay ? writePipe[i] : readPipe[i]][0];
+            stage.in = end;
+            end = -1;
+        }
+        if (relay || i < n - 1)
+        {
+            int &end = pipes[relay ? readPipe[i + 1] : writePipe[i]][1];
+            stage.out = end;
+            end = -1;
+        }
+    }
+
+    // Parent process
+    // Close all pipe fds
+    for (auto &p : pipes)
+    {
+        for (int fd : p)
+        {
+            if (fd != -1)
+            {
+                close(fd);
+            }
+        }
+    }
+    if (!shellStages.empty())
+    {
+        runShellStages(pipeline, shellStages);
+    }
+
+    // For background processes, only wait for the last process in the pipeline
+    if (!background)
+    {
+        // Wait for all stages together, MISH_PIPEFAIL=1 tears the pipeline down on the first failure
+        bool pipefail = env.get("MISH_PIPEFAIL") == "1";
+        vector<StageResult> results;
+        {
+            TraceSpan waitSpan("wait");
+            supervisor.waitPipeline(pids, startTimes, results, pipefail);
+        }
+        bool metered = false;
+        for (const auto &stage : shellStages)
+        {
+            if (stage.kind == ShellStageKind::Relay)
+            {
+                metered = true;
+                continue;
+            }
+            results[stage.index].status = stage.status;
+            results[stage.index].wall = stage.wall;
+        }
+        if (metered)
+        {
+            printPipeStats(pipeline, shellStages);
+        }
+
+        // Child process lifetimes, from spawn to reap, each on its own track
+        if (traceEnabled)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                if (pids[i] == -1)
+                    continue;
+                uint64_t start = static_cast<uint64_t>(startTimes[i] * 1e9);
+                uint64_t end = static_cast<uint64_t>((startTimes[i] + results[i].wall) * 1e9);
+                traceRecord(pipeline[i].tokens[0].data(), "child", start, end, pids[i]);
+            }
+        }
+        accountPipeline(pipeline, pids, results, monotonicNow() - startTimes[0], timed);
+
+        lastStatus = exitStatusOf(results.back().status);
+        for (int i = 0; i < n; i++)
+        {
+            if (pids[i] == -1 && !inShell[i])
+                continue;
+
+            int status = results[i].status;
+            if (pipefail && exitStatusOf(status) != 0)
+            {
+                lastStatus = exitStatusOf(status); // Rightmost failing stage
+            }
+
+            // Check if the process exited with an error, a tested status is not one
+            if (WIFEXITED(status) && WEXITSTATUS(status) != 0 && !(pipeline[i].flags & CMD_TESTED))
+            {
+                handleError("Command exited with status: " + to_string(WEXITSTATUS(status)));
+            }
+        }
+    }
+    else
+    {
+        // Hand the pipeline to the job table so it is reaped when it finishes
+        string text;
+        for (int i = 0; i < n; i++)
+        {
+            for (const auto &token : pipeline[i].tokens)
+            {
+                text += text.empty() || text.back() == ' ' ? "" : " ";
+                text += token;
+            }
+            text += pipeline[i].isPipeStart() ? " | " : "";
+        }
+        const Job &job = jobs.add(pgid, pids, text);
+
+        if (scheduler.active())
+        {
+            scheduler.submitted(job.serial, captureFd);
+            return;
+        }
+
+        // Print process ID for background process
+        cout << "[" << pids.back() << "] " << pipeline[n - 1].tokens[0] << " &" << endl;
+    }
+}
+
+// Function to execute a sequence of commands, including handling built-in commands.
+// Pipelines run in place as runs of 'commands', 'time' and 'place' prefixes are stripped from the view.
+void executeCommands(vector<Command> &commands)
+{
+    size_t pipeline_start = 0;       // Index of the first command of the current pipeline
+    bool background_command = false; // Track if command was a background command
+    bool timed = false;              // Track if the pipeline has a 'time' prefix
+    bool placed = false;             // Track if the pipeline has a 'place' prefix
+    Placement placement;             // Options of the 'place' prefix
+    bool cached = false;             // Track if the pipeline has a 'cache' prefix
+    CacheOptions cacheOptions;       // Options of the 'cache' prefix
+
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        Command &cmd = commands[i];
+        if (cmd.tokens.empty())
+            continue;
+
+        try
+        {
+            // Substitute variables as the pipeline starts, so earlier commands' assignments count
+            bool first = i == pipeline_start;
+            if (first)
+            {
+                size_t last = i;
+                bool expands = false;
+                for (; ; last++)
+                {
+                    expands |= (commands[last].flags & CMD_EXPAND) != 0;
+                    if (!commands[last].isPipeStart() || last + 1 == commands.size())
+                        break;
+                }
+                if (expands)
+                {
+                    expandCommands(&commands[i], last - i + 1);
+                }
+            }
+
+            // Strip 'time', 'place' and 'cache' prefixes from the first command of a pipeline, in
+            // any order. The options of 'place' and 'cache' apply to every stage.
+            bool handled = false; // 'cache -s' or 'cache -c' ran on its own
+            while (first && !handled)
+            {
+                string_view prefix = cmd.tokens[0];
+                if (prefix == "time" && !timed)
+                {
+                    if (cmd.tokens.size() == 1)
+                    {
+                        throw ShellError("time: missing command");
+                    }
+                    cmd.tokens = cmd.tokens.dropFirst();
+                    timed = true;
+                }
+                else if (prefix == "place" && !placed)
+                {
+                    parsePlacement(cmd.tokens, placement);
+                    placed = true;
+                }
+                else if (prefix == "cache" && !cached)
+                {
+                    cached = parseCacheOptions(cmd.tokens, cacheOptions);
+                    handled = !cached;
+                }
+                else
+                {
+                    break;
+                }
+            }
+            if (handled)
+            {
+                pipeline_start = i + 1;
+                timed = placed = false;
+                continue;
+            }
+
+            // Run standalone built-in commands inside the shell, pipeline stages are spawned
+            if (first && !cmd.isPipeStart() && isBuiltInCommand(cmd.tokens[0]))
+            {
+                if (timed)
+                {
+                    timeBuiltIn(cmd);
+                    timed = false;
+                }
+                else
+                {
+                    executeBuiltInRedirected(cmd);
+                }
+                if (cmd.isBackground() && !scheduler.active())
+                {
+                    cout << "[builtin] " << cmd.tokens[0] << " &" << endl;
+                }
+                placed = cached = false; // Runs in the shell itself, which is never placed or cached
+                pipeline_start = i + 1;
+                continue;
+            }
+
+            background_command |= cmd.isBackground();
+
+            // Execute pipeline if this is the end of a pipeline or a standalone command
+            if (!cmd.isPipeStart())
+            {
+                if (cached)
+                {
+                    executeCached(&commands[pipeline_start], i - pipeline_start + 1, cacheOptions, timed,
+                                  placed ? &placement : nullptr);
+                }
+                else
+                {
+                    executePipeline(&commands[pipeline_start], i - pipeline_start + 1, timed,
+                                    placed ? &placement : nullptr);
+                }
+
+                // Print prompt only for background commands
+                if (background_command && !scheduler.active())
+                {
+                    char cwd[PATH_MAX];
+                    if (showPath && getcwd(cwd, sizeof(cwd)) != nullptr)
+                    {
+                        cout << "mish:" << cwd << "> " << flush;
+                    }
+                    else
+                    {
+                        cout << "mish> " << flush;
+                    }
+                }
+
+                pipeline_start = i + 1;
+                background_command = false;
+                timed = false;
+                placed = false;
+                cached = false;
+            }
+        }
+        catch (const ShellError &e)
+        {
+            handleError(e.what());
+            pipeline_start = i + 1;
+            background_command = false;
+            timed = false;
+            placed = false;
+            cached = false;
+        }
+
+        cout << flush;
+    }
+}
+
+// Function to run the shell in interactive mode
+void interactiveMode()
+{
+    LineReader reader; // Reads stdin in large blocks
+    reader.attach(STDIN_FILENO);
+    LineEditor editor; // Used instead when stdin is a terminal
+    bool editing = LineEditor::usable(STDIN_FILENO);
+    string edited;
+    if (editing)
+    {
+        history.open();
+    }
+    string_view input;
+    CommandLine line; // Reused for every line
+    // Buffer to store the current working directory
+    char cwd[PATH_MAX];
+
+    // Make sure stdout is line buffered
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+
+    while (true)
+    {
+        // Report background jobs that finished since the last prompt
+        jobs.report(true);
+
+        // Force flush before printing prompt
+        cout.flush();
+
+        string prompt = "mish> ";
+        if (showPath && getcwd(cwd, sizeof(cwd)) != nullptr)
+        {
+            prompt = "mish:" + string(cwd) + "> ";
+        }
+
+        if (editing)
+        {
+            if (!editor.readLine(prompt, edited))
+            {
+                cout << endl;
+                break;
+            }
+            input = edited;
+            history.add(input);
+        }
+        else
+        {
+            cout << prompt << flush;
+
+            // Keep reaping background jobs while waiting for the next line
+            if (!reader.lineReady())
+            {
+                supervisor.waitForInput(STDIN_FILENO);
+            }
+
+            if (!reader.next(input))
+            {
+                cout << endl;
+                break;
+            }
+        }
+
+        try
+        {
+            if (input.empty())
+                continue;
+
+            tokenize(input, line);
+            if (line.tokens.empty())
+                continue;
+
+            parseTokens(line);
+            executeCommands(line.commands);
+        }
+        catch (const ShellError &e)
+        {
+            handleError(e.what());
+        }
+    }
+}
+
+// Function to check for the 'parallel {' line that opens a parallel block
+bool isBlockStart(const vector<string_view> &tokens)
+{
+    return tokens.size() == 2 && tokens[0] == "parallel" && tokens[1] == "{";
+}
+
+// Function to check for the '}' line that closes a parallel block
+bool isBlockEnd(const vector<string_view> &tokens)
+{
+    return tokens.size() == 1 && tokens[0] == "}";
+}
+
+// Function to run the parsed commands of a script line, as background jobs inside a parallel block
+static void runParsedLine(CommandLine &line)
+{
+    if (scheduler.inBlock())
+    {
+        for (auto &cmd : line.commands)
+        {
+            cmd.flags |= CMD_BACKGROUND;
+        }
+    }
+    executeCommands(line.commands);
+}
+
+// Function to run a tokenized script line
+static void runTokenizedLine(CommandLine &line)
+{
+    if (line.tokens.empty())
+        return;
+
+    // 'parallel {' ... '}' runs every line of the block as a background job
+    if (isBlockStart(line.tokens))
+    {
+        scheduler.beginBlock();
+        return;
+    }
+    if (isBlockEnd(line.tokens))
+    {
+        scheduler.endBlock();
+        return;
+    }
+
+    parseTokens(line);
+    runParsedLine(line);
+}
+
+// Function to tokenize, parse and run one script line
+static void runScriptLine(string_view text, CommandLine &line)
+{
+    if (text.empty() || text[0] == '#')
+        return;
+
+    tokenize(text, line);
+    runTokenizedLine(line);
+}
+
+// Function to expand the words of a word list loop when it starts. Patterns can match many
+// files, so the items are only known once the words are expanded.
+static void expandLoopWords(const CompiledScript &script, uint32_t i, vector<string> &items)
+{
+    ScriptLoop loop = script.loop(i);
+    items.clear();
+    if (loop.range)
+        return;
+    for (uint64_t item = 0; item < loop.count; item++)
+    {
+        expandWord(script.loopWord(i, item), items);
+    }
+}
+
+// Function to set a loop variable to the next item of its loop
+static void setLoopVariable(const ScriptLoop &loop, const vector<string> &items, uint64_t item)
+{
+    if (loop.range)
+    {
+        int64_t value = loop.last >= loop.first ? loop.first + static_cast<int64_t>(item)
+                                                : loop.first - static_cast<int64_t>(item);
+        env.set(string(loop.variable), to_string(value));
+    }
+    else
+    {
+        env.set(string(loop.variable), items[item]);
+    }
+}
+
+// Function to run a compiled script. Loop bodies are parsed once when the script is compiled,
+// each pass only loads their commands from the image.
+static void runCompiledScript(const CompiledScript &script)
+{
+    CommandLine line;                             // Reused for every OP_RUN
+    vector<uint64_t> nextItem(script.loops(), 0); // Next item of each 'for' loop
+    vector<vector<string>> loopItems(script.loops()); // Expanded words of each word list loop
+    for (size_t pc = 0; pc < script.size();)
+    {
+        const ScriptInstruction &ins = script.instruction(pc++);
+        try
+        {
+            switch (ins.op)
+            {
+            case OP_RUN:
+                jobs.report(false);
+                script.load(ins.a, ins.b, line);
+                runParsedLine(line);
+                break;
+            case OP_SOURCE:
+                jobs.report(false);
+                runScriptLine(script.text(ins.a, ins.b), line);
+                break;
+            case OP_BLOCK_BEGIN:
+                scheduler.beginBlock();
+                break;
+            case OP_BLOCK_END:
+                scheduler.endBlock();
+                break;
+            case OP_JUMP:
+                pc = ins.a;
+                break;
+            case OP_JUMP_IF_FAILED:
+                if (lastStatus != 0)
+                    pc = ins.a;
+                break;
+            case OP_JUMP_IF_PASSED:
+                if (lastStatus == 0)
+                    pc = ins.a;
+                break;
+            case OP_FOR_INIT:
+                if (ins.a >= nextItem.size())
+                    throw ShellError("Corrupt script cache entry");
+                nextItem[ins.a] = 0;
+                expandLoopWords(script, ins.a, loopItems[ins.a]);
+                break;
+            case OP_FOR_NEXT:
+            {
+                ScriptLoop loop = script.loop(ins.a); // Checks ins.a
+                uint64_t count = loop.range ? loop.count : loopItems[ins.a].size();
+                if (nextItem[ins.a] >= count)
+                {
+                    pc = ins.b;
+                    break;
+                }
+                setLoopVariable(loop, loopItems[ins.a], nextItem[ins.a]++);
+                break;
+            }
+            case OP_ERROR:
+                throw ShellError(string(script.text(ins.a, ins.b)));
+            default:
+                throw ShellError("Corrupt script cache entry");
+            }
+        }
+        catch (const ShellError &e)
+        {
+            lastStatus = 1; // A test that cannot run fails
+            handleError("Line " + to_string(ins.line) + ": " + e.what());
+        }
+    }
+}
+
+// Function to compile the control statement gathered by 'compiler', run it and start over
+static void runStatement(ScriptCompiler &compiler)
+{
+    CompiledScript statement;
+    if (compiler.build(statement))
+    {
+        runCompiledScript(statement);
+    }
+    else
+    {
+        handleError("Statement too large to compile");
+    }
+    compiler.clear();
+}
+
+// Function to run the shell in script mode. The script runs from the script cache unless
+// MISH_SCRIPT_CACHE=0 or it is not a regular file, otherwise it is read line by line and only
+// control statements are compiled, each once it is complete.
+void scriptMode(const string &fileName)
+{
+    CompiledScript script;
+    if (scriptCacheEnabled() && script.open(fileName))
+    {
+        runCompiledScript(script);
+    }
+    else
+    {
+        LineReader file; // Maps regular files, reads pipes in large blocks
+        if (!file.open(fileName))
+        {
+            handleError("Cannot open file " + fileName, true);
+        }
+
+        string_view text;
+        CommandLine line; // Reused for every line
+        ScriptCompiler compiler;
+        int lineNumber = 0;
+
+        while (file.next(text))
+        {
+            lineNumber++;
+            try
+            {
+                if (!compiler.inStatement())
+                {
+                    jobs.report(false);
+                    if (text.empty() || text[0] == '#')
+                        continue;
+                    tokenize(text, line);
+                    if (!startsStatement(line.tokens))
+                    {
+                        runTokenizedLine(line);
+                        continue;
+                    }
+                }
+
+                compiler.addLine(text, lineNumber);
+                if (!compiler.inStatement())
+                {
+                    runStatement(compiler);
+                }
+            }
+            catch (const ShellError &e)
+            {
+                handleError("Line " + to_string(lineNumber) + ": " + e.what());
+            }
+        }
+
+        if (compiler.inStatement())
+        {
+            compiler.finish();
+            runStatement(compiler);
+        }
+    }
+
+    // Let scheduled jobs finish so their output is written before the shell exits
+    if (scheduler.active() || scheduler.inBlock())
+    {
+        if (scheduler.inBlock())
+        {
+            handleError("Missing '}' at end of parallel block");
+        }
+        scheduler.barrier();
+    }
+}
+
+// Function to prepare the shell core: spawn backend, tracing, child supervision and environment
+void initShell()
+{
+    // Pick how external commands are started and how lines are scanned
+    initSpawnBackend();
+    initLexerBackend();
+
+    // Start tracing if MISH_TRACE is set
+    initTrace();
+
+    // Start supervising children and reaping background jobs
+    supervisor.init();
+    jobs.init();
+
+    // Initialize environment
+    char *path = getenv("PATH");
+    if (path)
+    {
+        env.set("PATH", path);
+    }
+}
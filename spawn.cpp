@@ -0,0 +1,250 @@
+#include "mish.h"
+#include <spawn.h>
+#include <cstdlib> // For getenv
+using namespace std;
+
+// Backend used to start external commands (posix_spawn unless MISH_SPAWN=fork or --zygote)
+SpawnBackend spawnBackend = SpawnBackend::PosixSpawn;
+
+// Function to pick the spawn backend from the MISH_SPAWN environment variable, and start the
+// zygote if --zygote asked for it
+void initSpawnBackend()
+{
+    const char *backend = getenv("MISH_SPAWN");
+    if (backend != nullptr && string(backend) == "fork")
+    {
+        spawnBackend = SpawnBackend::Fork;
+    }
+    if (spawnBackend == SpawnBackend::Zygote && !startZygote())
+    {
+        handleError("Could not start the zygote, starting commands directly");
+        spawnBackend = SpawnBackend::PosixSpawn;
+    }
+}
+
+// Function to convert command tokens into a null-terminated argv array
+static vector<char *> buildArgv(const Command &cmd)
+{
+    vector<char *> args;
+    args.reserve(cmd.tokens.size() + 1);
+    for (const auto &token : cmd.tokens)
+    {
+        args.push_back(const_cast<char *>(token.data())); // Words are NUL-terminated in the arena
+    }
+    args.push_back(nullptr);
+    return args;
+}
+
+// Function to start a command with posix_spawn, which uses clone(CLONE_VM | CLONE_VFORK)
+// under glibc so the parent's page tables are never copied. Returns 0 or an errno value.
+static int posixSpawnCommand(const Command &cmd, const string &path, const StageIO &io, pid_t &pid)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+
+    // Setup pipes
+    if (io.inFd != -1)
+    {
+        posix_spawn_file_actions_adddup2(&actions, io.inFd, STDIN_FILENO);
+    }
+    if (io.outFd != -1)
+    {
+        posix_spawn_file_actions_adddup2(&actions, io.outFd, STDOUT_FILENO);
+    }
+
+    // Close all pipe fds
+    if (io.pipes != nullptr)
+    {
+        for (const auto &p : *io.pipes)
+        {
+            posix_spawn_file_actions_addclose(&actions, p[0]);
+            posix_spawn_file_actions_addclose(&actions, p[1]);
+        }
+    }
+
+    // Handle redirections (same order as setupRedirection, after the pipe dup2s)
+    if (cmd.redirectedInputFromFile())
+    {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO,
+                                         cmd.redirectedInputFileName.data(), O_RDONLY, 0);
+    }
+    if (cmd.redirectOutputToFile())
+    {
+        int flags = O_WRONLY | O_CREAT;
+        flags |= cmd.appendOutput() ? O_APPEND : O_TRUNC;
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO,
+                                         cmd.redirectOutputFileName.data(), flags, 0644);
+    }
+
+    // Restore the default action for signals the shell ignores
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    short flags = POSIX_SPAWN_SETSIGDEF;
+
+    if (io.pgid != -1)
+    {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, io.pgid);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    vector<char *> args = buildArgv(cmd);
+    int result = posix_spawn(&pid, path.c_str(), &actions, &attr, args.data(), env.envp());
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return result;
+}
+
+// Function to start a command with a full fork() followed by execve().
+// An empty path runs the command as a built-in in the forked child.
+static pid_t forkCommand(const Command &cmd, const string &path, const StageIO &io)
+{
+    char *const *envp = env.envp(); // Built before the fork, the child only execs
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        throw ShellError("Fork failed");
+    }
+
+    if (pid == 0)
+    { // Child process
+        try
+        {
+            if (io.pgid != -1)
+            {
+                setpgid(0, io.pgid);
+            }
+            signal(SIGTTOU, SIG_DFL);
+            if (io.placement != nullptr)
+            {
+                applyPlacement(*io.placement, io.stage);
+            }
+
+            // Setup pipes
+            if (io.inFd != -1 && dup2(io.inFd, STDIN_FILENO) == -1)
+            {
+                throw ShellError("Failed to set up pipe input");
+            }
+            if (io.outFd != -1 && dup2(io.outFd, STDOUT_FILENO) == -1)
+            {
+                throw ShellError("Failed to set up pipe output");
+            }
+
+            // Close all pipe fds
+            if (io.pipes != nullptr)
+            {
+                for (const auto &p : *io.pipes)
+                {
+                    close(p[0]); // Read end
+                    close(p[1]); // Write end
+                }
+            }
+
+            // Handle redirections
+            setupRedirection(cmd);
+
+            // Make sure stdout is line buffered
+            setvbuf(stdout, nullptr, _IOLBF, 0);
+
+            // Built-in stages run in the forked shell without an exec
+            if (path.empty())
+            {
+                int status = executeBuiltIn(cmd);
+                cout << flush;
+                _exit(status);
+            }
+
+            vector<char *> args = buildArgv(cmd);
+            execve(path.c_str(), args.data(), envp);
+            throw ShellError("Failed to execute command: " + string(args[0]));
+        }
+        catch (const ShellExit &e)
+        {
+            cout << flush;
+            _exit(e.status); // 'exit' inside a pipeline only ends its own stage
+        }
+        catch (const ShellError &e)
+        {
+            cout << flush;
+            cerr << "Error in child process: " << e.what() << endl;
+            exit(1);
+        }
+    }
+
+    // Set the process group from the parent as well to avoid racing the child
+    if (io.pgid != -1)
+    {
+        setpgid(pid, io.pgid == 0 ? pid : io.pgid);
+    }
+    return pid;
+}
+
+// Function to report a command that could not be started with error 'result'. Returns -1.
+static pid_t spawnFailed(const Command &cmd, int result)
+{
+    errno = result;
+    if (cmd.redirectedInputFromFile() && access(cmd.redirectedInputFileName.data(), R_OK) != 0)
+    {
+        handleError("Error opening input file: " + string(cmd.redirectedInputFileName));
+    }
+    else
+    {
+        handleError("Failed to execute command: " + string(cmd.tokens[0]));
+    }
+    errno = 0;
+    return -1;
+}
+
+// Function to start one pipeline stage with the configured backend.
+// Returns the child's PID, or -1 after reporting the error if the command could not be started.
+pid_t spawnCommand(const Command &cmd, const StageIO &io)
+{
+    // Built-in pipeline stages need a copy of the shell to run in
+    if (isBuiltInCommand(cmd.tokens[0]))
+    {
+        return forkCommand(cmd, "", io);
+    }
+
+    // Resolve the command once in the shell instead of probing PATH in the child
+    string path = commandHash.resolve(string(cmd.tokens[0]));
+    if (path.empty())
+    {
+        errno = ENOENT;
+        handleError("Failed to execute command: " + string(cmd.tokens[0]));
+        errno = 0;
+        return -1;
+    }
+
+    // posix_spawn and the zygote cannot set affinity, priorities or limits for the child
+    if (spawnBackend == SpawnBackend::Fork || io.placement != nullptr)
+    {
+        return forkCommand(cmd, path, io);
+    }
+
+    pid_t pid = -1;
+    if (spawnBackend == SpawnBackend::Zygote)
+    {
+        int result = zygoteSpawn(cmd, path, io, pid);
+        if (result != -1)
+            return result == 0 ? pid : spawnFailed(cmd, result);
+        // The zygote cannot take this command, start it directly
+    }
+
+    int result = posixSpawnCommand(cmd, path, io, pid);
+    if (result == ENOSYS)
+    {
+        // posix_spawn is not usable here, fall back to fork for good
+        spawnBackend = SpawnBackend::Fork;
+        return forkCommand(cmd, path, io);
+    }
+    if (result != 0)
+    {
+        return spawnFailed(cmd, result);
+    }
+    return pid;
+}
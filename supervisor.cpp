@@ -0,0 +1,293 @@
+#include "mish.h"
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+using namespace std;
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+// Global child supervisor
+Supervisor supervisor;
+
+// Write end of the self-pipe, used from signal handlers
+static int signalPipeWrite = -1;
+
+// Function to wake the supervisor from a signal handler (async-signal-safe)
+void notifySupervisor()
+{
+    if (signalPipeWrite != -1)
+    {
+        int savedErrno = errno;
+        char byte = 0;
+        ssize_t ignored = write(signalPipeWrite, &byte, 1);
+        (void)ignored;
+        errno = savedErrno;
+    }
+}
+
+// Create the epoll instance and the self-pipe that carries signals into it
+void Supervisor::init()
+{
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1)
+    {
+        handleError("epoll_create1 failed, falling back to blocking waits");
+        errno = 0;
+        return;
+    }
+
+    if (pipe2(signalPipe, O_CLOEXEC | O_NONBLOCK) == -1)
+    {
+        close(epollFd);
+        epollFd = -1;
+        errno = 0;
+        return;
+    }
+    signalPipeWrite = signalPipe[1];
+    addFd(signalPipe[0], WATCH_SIGNAL, -1);
+}
+
+// Register a file descriptor with epoll
+void Supervisor::addFd(int fd, WatchKind kind, pid_t pid)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == 0)
+    {
+        watches[fd] = {kind, pid};
+    }
+}
+
+// Remove a file descriptor from epoll
+void Supervisor::removeFd(int fd)
+{
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    watches.erase(fd);
+}
+
+// Open a pidfd for a child and add it to the epoll set. Returns the pidfd, or -1 when pidfds
+// are unavailable and the caller has to fall back to waitpid.
+int Supervisor::watch(pid_t pid, bool background)
+{
+    if (epollFd == -1 || !pidfdSupported || pid == -1)
+    {
+        return -1;
+    }
+
+    int pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+    if (pidfd == -1)
+    {
+        if (errno == ENOSYS)
+        {
+            pidfdSupported = false;
+        }
+        errno = 0;
+        return -1;
+    }
+    fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+
+    addFd(pidfd, background ? WATCH_BACKGROUND : WATCH_FOREGROUND, pid);
+    return pidfd;
+}
+
+// Remove a pidfd from the epoll set and close it
+void Supervisor::unwatch(int pidfd)
+{
+    if (pidfd == -1)
+        return;
+    removeFd(pidfd);
+    close(pidfd);
+}
+
+// Dispatch the events that are already pending without waiting, so background exits reach
+// the job table even when no foreground command runs
+void Supervisor::poll()
+{
+    if (epollFd == -1)
+        return;
+    vector<pair<pid_t, StageResult>> exited; // No foreground pipeline is being waited for
+    do
+    {
+        dispatch(exited, 0);
+    } while (lastBatch == MAX_EVENTS);
+}
+
+// Wait for events and dispatch them. Foreground exits are recorded in 'exited',
+// background exits are passed to the job table. Returns false if stdin became readable.
+bool Supervisor::dispatch(vector<pair<pid_t, StageResult>> &exited, int timeout)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int count = epoll_wait(epollFd, events, MAX_EVENTS, timeout);
+    lastBatch = max(count, 0);
+    if (count == -1)
+    {
+        if (errno == EINTR)
+        {
+            errno = 0;
+            return true;
+        }
+        throw ShellError("epoll_wait failed: " + string(strerror(errno)));
+    }
+
+    bool inputReady = false;
+    for (int i = 0; i < count; i++)
+    {
+        int fd = events[i].data.fd;
+        auto it = watches.find(fd);
+        if (it == watches.end())
+            continue;
+
+        switch (it->second.kind)
+        {
+        case WATCH_SIGNAL:
+        {
+            // Drain the self-pipe, the job table picks up slot changes on its next update
+            char buffer[256];
+            while (read(fd, buffer, sizeof(buffer)) > 0)
+            {
+            }
+            errno = 0;
+            break;
+        }
+        case WATCH_FOREGROUND:
+        {
+            StageResult result;
+            if (wait4(it->second.pid, &result.status, WNOHANG, &result.usage) == it->second.pid)
+            {
+                result.wall = monotonicNow(); // Reap time, the caller subtracts the start time
+                exited.push_back({it->second.pid, result});
+                unwatch(fd);
+            }
+            break;
+        }
+        case WATCH_BACKGROUND:
+            jobs.childExited(it->second.pid);
+            break;
+        case WATCH_INPUT:
+            inputReady = true;
+            break;
+        }
+    }
+    return !inputReady;
+}
+
+// Function to wait for all stages of a foreground pipeline through one epoll loop.
+// Fills 'results' with each stage's wait status and rusage from wait4. With pipefail, a failing
+// stage tears down the stages that are still running instead of waiting for them to notice.
+void Supervisor::waitPipeline(const vector<pid_t> &pids, const vector<double> &startTimes,
+                              vector<StageResult> &results, bool pipefail)
+{
+    size_t n = pids.size();
+    results.assign(n, StageResult());
+    vector<int> pidfds(n, -1);
+    vector<bool> done(n, false);
+    size_t remaining = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (pids[i] == -1)
+        {
+            results[i].status = 127 << 8;
+            done[i] = true;
+            continue;
+        }
+        pidfds[i] = watch(pids[i], false);
+        remaining++;
+    }
+
+    // Without pidfds, wait for each child in order
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!done[i] && pidfds[i] == -1)
+        {
+            while (wait4(pids[i], &results[i].status, 0, &results[i].usage) == -1 && errno == EINTR)
+            {
+            }
+            errno = 0;
+            results[i].wall = monotonicNow() - startTimes[i];
+            done[i] = true;
+            remaining--;
+        }
+    }
+
+    bool tornDown = false;
+    vector<pair<pid_t, StageResult>> exited;
+    while (remaining > 0)
+    {
+        exited.clear();
+        dispatch(exited, -1);
+        for (const auto &entry : exited)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                if (pids[i] != entry.first || done[i])
+                    continue;
+                results[i] = entry.second;
+                results[i].wall -= startTimes[i];
+                done[i] = true;
+                remaining--;
+
+                // Early teardown: the pipeline has already failed, stop the other stages
+                if (pipefail && !tornDown && exitStatusOf(entry.second.status) != 0)
+                {
+                    tornDown = true;
+                    for (size_t j = 0; j < n; j++)
+                    {
+                        if (!done[j])
+                        {
+                            kill(pids[j], SIGTERM);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Function to block until 'fd' is readable while still servicing child exits and signals
+void Supervisor::waitForInput(int fd)
+{
+    if (epollFd == -1)
+        return;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+        errno = 0; // Regular files cannot be polled and are always readable
+        return;
+    }
+    watches[fd] = {WATCH_INPUT, -1};
+
+    vector<pair<pid_t, StageResult>> exited;
+    try
+    {
+        while (dispatch(exited, -1))
+        {
+        }
+    }
+    catch (...)
+    {
+        removeFd(fd);
+        throw;
+    }
+    removeFd(fd);
+}
+
+// Function to block until a child changes state or a signal arrives
+void Supervisor::waitForChild()
+{
+    if (epollFd == -1)
+    {
+        usleep(1000); // Without epoll the job table polls with waitpid
+        return;
+    }
+
+    vector<pair<pid_t, StageResult>> exited;
+    dispatch(exited, -1);
+}
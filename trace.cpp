@@ -0,0 +1,107 @@
+#include "mish.h"
+#include <atomic>
+#include <ctime>
+using namespace std;
+
+// Tracing is on when MISH_TRACE names an output file
+bool traceEnabled = false;
+
+namespace
+{
+    // One complete ("X") trace event
+    struct TraceEvent
+    {
+        char name[48];          // Span name, copied so callers can pass temporaries
+        const char *category;   // Static category string
+        uint64_t start;         // Monotonic start in nanoseconds
+        uint64_t end;           // Monotonic end in nanoseconds
+        pid_t pid;              // Process the span belongs to
+    };
+
+    // Ring buffer of events. Writers claim a slot with one atomic increment, so recording
+    // never takes a lock; when more than TRACE_CAPACITY events are recorded the oldest are overwritten.
+    const size_t TRACE_CAPACITY = 1 << 16;
+    TraceEvent *events = nullptr;
+    atomic<uint64_t> head(0);
+
+    string tracePath;        // Output file
+    pid_t tracePid = -1;     // Shell process that owns the trace
+}
+
+// Function to read the monotonic clock in nanoseconds
+uint64_t traceNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+// Function to record one span into the ring buffer (pid 0 means the shell itself)
+void traceRecord(const char *name, const char *category, uint64_t start, uint64_t end, pid_t pid)
+{
+    if (!traceEnabled)
+        return;
+
+    TraceEvent &event = events[head.fetch_add(1, memory_order_relaxed) % TRACE_CAPACITY];
+    strncpy(event.name, name, sizeof(event.name) - 1);
+    event.name[sizeof(event.name) - 1] = '\0';
+    event.category = category;
+    event.start = start;
+    event.end = end;
+    event.pid = pid == 0 ? tracePid : pid;
+}
+
+// Function to write the recorded events as Chrome/Perfetto trace-event JSON
+static void writeTrace()
+{
+    // Forked children inherit the buffer and the atexit hook, only the shell writes the file
+    if (!traceEnabled || getpid() != tracePid)
+        return;
+
+    ofstream out(tracePath);
+    if (!out)
+    {
+        cerr << "Error: Cannot write trace file " << tracePath << endl;
+        return;
+    }
+
+    uint64_t count = head.load();
+    uint64_t first = count > TRACE_CAPACITY ? count - TRACE_CAPACITY : 0;
+
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << tracePid
+        << ",\"tid\":" << tracePid << ",\"args\":{\"name\":\"mish\"}}";
+
+    char buffer[64];
+    for (uint64_t i = first; i < count; i++)
+    {
+        const TraceEvent &event = events[i % TRACE_CAPACITY];
+        out << ",\n{\"name\":\"" << jsonEscape(event.name) << "\",\"cat\":\"" << event.category
+            << "\",\"ph\":\"X\"";
+        snprintf(buffer, sizeof(buffer), ",\"ts\":%.3f,\"dur\":%.3f", event.start / 1000.0,
+                 (event.end - event.start) / 1000.0);
+        out << buffer << ",\"pid\":" << event.pid << ",\"tid\":" << event.pid << "}";
+
+        // Name child process tracks after the command they ran
+        if (event.pid != tracePid)
+        {
+            out << ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << event.pid
+                << ",\"tid\":" << event.pid << ",\"args\":{\"name\":\"" << jsonEscape(event.name) << "\"}}";
+        }
+    }
+    out << "\n]}\n";
+}
+
+// Function to enable tracing when MISH_TRACE is set, the trace is written at exit
+void initTrace()
+{
+    const char *path = getenv("MISH_TRACE");
+    if (path == nullptr || *path == '\0')
+        return;
+
+    events = new TraceEvent[TRACE_CAPACITY];
+    tracePath = path;
+    tracePid = getpid();
+    traceEnabled = true;
+    atexit(writeTrace);
+}
@@ -0,0 +1,462 @@
+#include "mish.h"
+#include <poll.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <spawn.h>
+#include <sys/socket.h>
+using namespace std;
+
+namespace
+{
+    // Arguments the shell's binary is re-executed with to become the zygote
+    const char *const ZYGOTE_ARG = "--zygote-server";
+
+    // Time the shell waits for a new zygote to say it is ready
+    const int STARTUP_TIMEOUT_MS = 2000;
+
+    // Send buffer of the shell's end, which bounds the size of one request
+    const int SEND_BUFFER = 4 << 20;
+
+    // Environment count meaning "same as the last request"
+    const uint32_t ENV_UNCHANGED = UINT32_MAX;
+
+    // Redirections the child has to open
+    enum RequestFlags
+    {
+        REQUEST_INPUT_FILE = 1 << 0,
+        REQUEST_OUTPUT_FILE = 1 << 1,
+        REQUEST_APPEND = 1 << 2
+    };
+
+    // Fixed part of a request. It is followed by NUL-terminated strings: the path, the
+    // arguments, the environment unless unchanged, the working directory ("" if unchanged),
+    // the input file and the output file. Stdin, stdout and stderr travel as SCM_RIGHTS.
+    struct ZygoteRequest
+    {
+        uint32_t argc;
+        uint32_t envc;   // Environment entries, ENV_UNCHANGED to keep the last ones
+        int32_t pgid;    // Process group to join, 0 for a new one
+        uint32_t flags;  // RequestFlags
+        uint32_t length; // Bytes of strings after the header
+    };
+
+    // Step of starting a child that failed
+    enum FailedStep
+    {
+        STEP_NONE = 0,
+        STEP_CWD,
+        STEP_INPUT,
+        STEP_OUTPUT,
+        STEP_EXEC,
+        STEP_CLONE,
+        STEP_REQUEST
+    };
+
+    // Answer to a request, and the zygote's ready message with its own PID
+    struct ZygoteReply
+    {
+        int32_t pid;   // Started child, a child of the shell. Already reaped-able if 'step' is set.
+        int32_t step;  // FailedStep
+        int32_t error; // errno of the failed step
+    };
+}
+
+// Shell side state
+static int zygoteSocket = -1;
+static pid_t zygotePid = -1;
+static pid_t zygoteOwner = -1;             // Process that started the zygote, forked children may not use it
+static uint64_t sentEnvironment = UINT64_MAX; // Environment version the zygote has
+static string sentDirectory;                  // Working directory the zygote has
+
+// Function to send a message with file descriptors attached, retrying after signals
+static ssize_t sendWithFds(int sock, const iovec *parts, int count, const int *fds, int fdCount)
+{
+    char control[CMSG_SPACE(sizeof(int) * 3)];
+    memset(control, 0, sizeof(control));
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = const_cast<iovec *>(parts);
+    msg.msg_iovlen = count;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
+    cmsghdr *header = CMSG_FIRSTHDR(&msg);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * fdCount);
+    memcpy(CMSG_DATA(header), fds, sizeof(int) * fdCount);
+
+    ssize_t sent;
+    do
+    {
+        sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+    return sent;
+}
+
+// Function to read one reply, retrying after signals. Returns false if the zygote is gone.
+static bool readReply(int sock, ZygoteReply &reply)
+{
+    ssize_t count;
+    do
+    {
+        count = recv(sock, &reply, sizeof(reply), 0);
+    } while (count == -1 && errno == EINTR);
+    return count == static_cast<ssize_t>(sizeof(reply));
+}
+
+// Function to append a string and its NUL to a request
+static void appendString(string &data, string_view text)
+{
+    data.append(text.data(), text.size());
+    data += '\0';
+}
+
+// Function to start the zygote: the shell's binary from /proc/self/exe with one end of a
+// socket pair. Done once at startup, while the shell is still small.
+bool startZygote()
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+    {
+        errno = 0;
+        return false;
+    }
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &SEND_BUFFER, sizeof(SEND_BUFFER));
+    fcntl(sv[1], F_SETFD, 0); // Inherited by the zygote
+
+    string fdArg = to_string(sv[1]);
+    char *args[] = {const_cast<char *>("mish-zygote"), const_cast<char *>(ZYGOTE_ARG), &fdArg[0], nullptr};
+    char *noEnvironment[] = {nullptr}; // Every request carries the environment it needs
+    pid_t pid = -1;
+    int result = posix_spawn(&pid, "/proc/self/exe", nullptr, nullptr, args, noEnvironment);
+    close(sv[1]);
+
+    // The zygote says it is ready with its PID
+    pollfd ready = {sv[0], POLLIN, 0};
+    ZygoteReply reply;
+    if (result != 0 || poll(&ready, 1, STARTUP_TIMEOUT_MS) != 1 || !readReply(sv[0], reply) ||
+        reply.pid != pid)
+    {
+        if (result == 0)
+        {
+            kill(pid, SIGKILL);
+            waitpid(pid, nullptr, 0);
+        }
+        close(sv[0]);
+        errno = 0;
+        return false;
+    }
+
+    zygoteSocket = sv[0];
+    zygotePid = pid;
+    zygoteOwner = getpid();
+    sentEnvironment = UINT64_MAX;
+    sentDirectory.clear();
+    return true;
+}
+
+// Function to stop the zygote. Closing the socket is enough, it exits when it reads the end.
+void stopZygote()
+{
+    if (zygoteSocket == -1)
+        return;
+    close(zygoteSocket);
+    waitpid(zygotePid, nullptr, 0);
+    errno = 0;
+    zygoteSocket = -1;
+    zygotePid = -1;
+}
+
+// Function to start a command through the zygote. The child is a child of the shell, so it is
+// waited for like any other. Returns 0, an errno value if the command could not be started,
+// or -1 if the zygote cannot take the request and the command should be spawned directly.
+int zygoteSpawn(const Command &cmd, const string &path, const StageIO &io, pid_t &pid)
+{
+    if (zygoteSocket == -1 || getpid() != zygoteOwner)
+        return -1;
+
+    static string data; // Reused, requests are built one at a time
+    data.clear();
+    ZygoteRequest request = {static_cast<uint32_t>(cmd.tokens.size()), ENV_UNCHANGED, 0, 0, 0};
+    appendString(data, path);
+    for (const auto &token : cmd.tokens)
+    {
+        appendString(data, token);
+    }
+
+    // The environment and directory only travel when they changed
+    uint64_t version = env.version();
+    if (version != sentEnvironment)
+    {
+        request.envc = 0;
+        for (char *const *entry = env.envp(); *entry != nullptr; entry++)
+        {
+            appendString(data, *entry);
+            request.envc++;
+        }
+    }
+    char cwd[PATH_MAX];
+    string_view directory = getcwd(cwd, sizeof(cwd)) != nullptr ? cwd : "";
+    errno = 0;
+    appendString(data, directory != sentDirectory ? directory : "");
+
+    if (cmd.redirectedInputFromFile())
+    {
+        request.flags |= REQUEST_INPUT_FILE;
+    }
+    if (cmd.redirectOutputToFile())
+    {
+        request.flags |= REQUEST_OUTPUT_FILE | (cmd.appendOutput() ? REQUEST_APPEND : 0);
+    }
+    appendString(data, cmd.redirectedInputFromFile() ? cmd.redirectedInputFileName : "");
+    appendString(data, cmd.redirectOutputToFile() ? cmd.redirectOutputFileName : "");
+    request.length = static_cast<uint32_t>(data.size());
+    request.pgid = io.pgid == -1 ? getpgrp() : io.pgid;
+
+    int fds[3] = {io.inFd != -1 ? io.inFd : STDIN_FILENO, io.outFd != -1 ? io.outFd : STDOUT_FILENO,
+                  STDERR_FILENO};
+    iovec parts[2] = {{&request, sizeof(request)}, {&data[0], data.size()}};
+    ZygoteReply reply;
+    if (sendWithFds(zygoteSocket, parts, 2, fds, 3) == -1)
+    {
+        if (errno == EMSGSIZE || errno == ENOBUFS)
+        {
+            errno = 0;
+            return -1; // Too large for one message
+        }
+    }
+    else if (readReply(zygoteSocket, reply))
+    {
+        sentEnvironment = version;
+        sentDirectory.assign(directory.data(), directory.size());
+        if (reply.step == STEP_NONE)
+        {
+            pid = reply.pid;
+            return 0;
+        }
+
+        // The child exited without running the command, it is ours to reap
+        if (reply.pid > 0)
+        {
+            waitpid(reply.pid, nullptr, 0);
+        }
+        if (reply.step == STEP_CWD)
+        {
+            sentDirectory.clear();
+        }
+        return reply.error != 0 ? reply.error : EINVAL;
+    }
+
+    // The zygote is gone, keep going without it
+    handleError("Zygote exited, starting commands directly");
+    errno = 0;
+    stopZygote();
+    spawnBackend = SpawnBackend::PosixSpawn;
+    return -1;
+}
+
+namespace
+{
+    // What the child needs, on the zygote's stack. The child shares the zygote's memory and
+    // writes the outcome back into 'failure' before it execs or exits.
+    struct ChildSetup
+    {
+        const char *path;
+        char *const *argv;
+        char *const *envp;
+        const int *fds; // Stdin, stdout and stderr
+        pid_t pgid;
+        uint32_t flags;
+        const char *input;
+        const char *output;
+        ZygoteReply failure;
+    };
+}
+
+// Stack the child runs on until it execs
+static const size_t CHILD_STACK = 64 << 10;
+
+// Function to run the child side of a request. It shares the zygote's memory until the exec,
+// so it only makes system calls and records a failure in 'setup' before exiting.
+static int runChild(void *arg)
+{
+    ChildSetup &setup = *static_cast<ChildSetup *>(arg);
+    setpgid(0, setup.pgid);
+    signal(SIGTTOU, SIG_DFL);
+    for (int i = 0; i < 3; i++)
+    {
+        dup2(setup.fds[i], i); // The received descriptors are close-on-exec, the copies are not
+    }
+
+    if (setup.flags & REQUEST_INPUT_FILE)
+    {
+        int fd = open(setup.input, O_RDONLY);
+        if (fd == -1 || dup2(fd, STDIN_FILENO) == -1)
+        {
+            setup.failure = {0, STEP_INPUT, errno};
+            _exit(127);
+        }
+        close(fd);
+    }
+    if (setup.flags & REQUEST_OUTPUT_FILE)
+    {
+        int mode = (setup.flags & REQUEST_APPEND) ? O_APPEND : O_TRUNC;
+        int fd = open(setup.output, O_WRONLY | O_CREAT | mode, 0644);
+        if (fd == -1 || dup2(fd, STDOUT_FILENO) == -1)
+        {
+            setup.failure = {0, STEP_OUTPUT, errno};
+            _exit(127);
+        }
+        close(fd);
+    }
+
+    execve(setup.path, setup.argv, setup.envp);
+    setup.failure = {0, STEP_EXEC, errno};
+    _exit(127);
+}
+
+// Function to serve one request. The child is cloned with CLONE_PARENT so it belongs to the
+// shell, and with CLONE_VM | CLONE_VFORK like posix_spawn, so no page tables are copied and the
+// zygote resumes once the child has exec'd or failed.
+static void serveRequest(int sock, const vector<char> &message, const int *fds, vector<string> &environment,
+                         vector<char *> &envp)
+{
+    static char *stack = new char[CHILD_STACK];
+    ZygoteReply reply = {0, STEP_REQUEST, EINVAL};
+    ZygoteRequest request;
+    if (message.size() < sizeof(request))
+    {
+        send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+        return;
+    }
+    memcpy(&request, message.data(), sizeof(request));
+
+    // Cut the strings out of the message
+    vector<char *> strings;
+    const char *end = message.data() + message.size();
+    for (const char *p = message.data() + sizeof(request); p < end;)
+    {
+        const char *nul = static_cast<const char *>(memchr(p, '\0', end - p));
+        if (nul == nullptr)
+            break;
+        strings.push_back(const_cast<char *>(p));
+        p = nul + 1;
+    }
+    size_t envc = request.envc == ENV_UNCHANGED ? 0 : request.envc;
+    if (request.argc == 0 || strings.size() != 1 + request.argc + envc + 3)
+    {
+        send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+        return;
+    }
+
+    vector<char *> argv(strings.begin() + 1, strings.begin() + 1 + request.argc);
+    argv.push_back(nullptr);
+    if (request.envc != ENV_UNCHANGED)
+    {
+        environment.assign(strings.begin() + 1 + request.argc, strings.begin() + 1 + request.argc + envc);
+        envp.clear();
+        for (auto &entry : environment)
+        {
+            envp.push_back(&entry[0]);
+        }
+        envp.push_back(nullptr);
+    }
+    const char *directory = strings[1 + request.argc + envc];
+
+    ChildSetup setup = {strings[0], argv.data(), envp.data(), fds, request.pgid, request.flags,
+                        strings[2 + request.argc + envc], strings[3 + request.argc + envc], {0, STEP_NONE, 0}};
+    if (directory[0] != '\0' && chdir(directory) == -1)
+    {
+        reply = {0, STEP_CWD, errno};
+    }
+    else
+    {
+        int pid = clone(runChild, stack + CHILD_STACK, CLONE_VM | CLONE_VFORK | CLONE_PARENT | SIGCHLD, &setup);
+        reply = pid == -1 ? ZygoteReply{0, STEP_CLONE, errno} : setup.failure;
+        reply.pid = pid == -1 ? 0 : pid;
+    }
+    send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+}
+
+// Function to run as the zygote if the arguments say so. The zygote leaves the terminal's
+// process group, points its own stdio at /dev/null and serves requests until the shell closes
+// the socket.
+bool runZygoteServer(int argc, char *argv[])
+{
+    if (argc != 3 || strcmp(argv[1], ZYGOTE_ARG) != 0)
+        return false;
+
+    int sock = atoi(argv[2]);
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    prctl(PR_SET_NAME, "mish-zygote");
+    setpgid(0, 0);
+    int null = open("/dev/null", O_RDWR);
+    for (int i = 0; i < 3 && null != -1; i++)
+    {
+        if (null != i)
+        {
+            dup2(null, i);
+        }
+    }
+    if (null > 2)
+    {
+        close(null);
+    }
+
+    ZygoteReply ready = {static_cast<int32_t>(getpid()), STEP_NONE, 0};
+    send(sock, &ready, sizeof(ready), MSG_NOSIGNAL);
+
+    vector<char> message;
+    vector<string> environment;
+    vector<char *> envp(1, nullptr);
+    while (true)
+    {
+        // Peek at the size first, a request is one message of any length
+        ssize_t size = recv(sock, nullptr, 0, MSG_PEEK | MSG_TRUNC);
+        if (size == -1 && errno == EINTR)
+            continue;
+        if (size <= 0)
+            _exit(0);
+        message.resize(size);
+
+        char control[CMSG_SPACE(sizeof(int) * 3)];
+        iovec part = {message.data(), message.size()};
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &part;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t count = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            _exit(0);
+
+        int fds[3] = {-1, -1, -1};
+        int received = 0;
+        for (cmsghdr *header = CMSG_FIRSTHDR(&msg); header != nullptr; header = CMSG_NXTHDR(&msg, header))
+        {
+            if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+            {
+                received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                memcpy(fds, CMSG_DATA(header), sizeof(int) * min(received, 3));
+            }
+        }
+
+        message.resize(count);
+        if (received == 3)
+        {
+            serveRequest(sock, message, fds, environment, envp);
+        }
+        else
+        {
+            ZygoteReply reply = {0, STEP_REQUEST, EBADF};
+            send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+        }
+        for (int i = 0; i < min(received, 3); i++)
+        {
+            close(fds[i]);
+        }
+    }
+}